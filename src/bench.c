@@ -0,0 +1,432 @@
+/* Benchmark rendering stages on synthetic S3D volumes */
+
+#include <getopt.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "config.h"
+#include "s3d.h"
+#include "s3dpng.h"
+
+#define PI (3.14159265359)
+
+/* Spatial distributions of non-zero voxels */
+enum distribution {
+	DIST_SHELL,			/* Spherical shell */
+	DIST_TORUS,			/* Torus around the z axis */
+	DIST_RANDOM			/* Voxels scattered uniformly at random */
+};
+const char *distribution_names[] = {"shell", "torus", "random"};
+
+/* Long options without a short equivalent */
+enum long_option {
+	OPT_PNG_LEVEL = 256,
+	OPT_PNG_STRIPS
+};
+
+struct bench_settings {
+	size_t pixels, width, height, frames;
+	enum distribution dist;
+	double fill, visang;
+	int threads, png_level, png_strips, csv;
+	uint64_t seed;
+};
+
+/* Timing of one stage */
+struct stage {
+	const char *name;
+	double seconds;
+	/* Number of voxels, pixels and bytes processed */
+	double voxels, pixels, bytes;
+};
+
+void usage(const char *progname) {
+	printf("Usage: %s [options]\n\n", progname);
+	printf("Render frames of a synthetic S3D volume and report the throughput of each\n");
+	printf("stage: projection, colormapping, PNG encoding and complete frames.\n\n");
+	printf("Options:\n");
+	printf("  -c, --csv             Write results as CSV (default: JSON).\n");
+	printf("  -d, --distribution D  Distribution of non-zero voxels: 'shell' (default),\n");
+	printf("                        'torus' or 'random'.\n");
+	printf("  -f, --frames N        Number of frames to render per stage (default: 16).\n");
+	printf("  -F, --fill X          Approximate fraction of non-zero voxels (default: 0.05).\n");
+	printf("  -h, --help            Show this help message and exit.\n");
+	printf("  -H, --height N        Frame height, in pixels (default: 1080).\n");
+	printf("  -n, --pixels N        Number of voxels along each side of the volume\n");
+	printf("                        (default: 128).\n");
+	printf("      --png-level N     zlib compression level of PNG files (default: 6).\n");
+	printf("      --png-strips N    Number of PNG strips to compress in parallel (default: 1).\n");
+	printf("  -s, --seed N          Seed of the random number generator (default: 1).\n");
+	printf("  -t, --threads N       Number of threads (default: OMP_NUM_THREADS).\n");
+	printf("  -W, --width N         Frame width, in pixels (default: 1920).\n");
+}
+
+/**
+ * Parse the integer argument 'arg' to the command-line
+ * option 'opt', and check that it is at least 'min'.
+ */
+long parse_int(const char *opt, const char *arg, long min) {
+	char *end;
+	long v = strtol(arg, &end, 10);
+
+	if (*arg == 0 || *end != 0 || v < min) {
+		fprintf(stderr, "ERROR: Invalid value of option '%s': '%s'.\n", opt, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return v;
+}
+
+void parse_options(int argc, char *argv[], struct bench_settings *set) {
+	int c;
+	char *end;
+	static struct option long_options[] = {
+		{"csv",          no_argument, NULL, 'c'},
+		{"distribution", required_argument, NULL, 'd'},
+		{"frames",       required_argument, NULL, 'f'},
+		{"fill",         required_argument, NULL, 'F'},
+		{"help",         no_argument, NULL, 'h'},
+		{"height",       required_argument, NULL, 'H'},
+		{"pixels",       required_argument, NULL, 'n'},
+		{"png-level",    required_argument, NULL, OPT_PNG_LEVEL},
+		{"png-strips",   required_argument, NULL, OPT_PNG_STRIPS},
+		{"seed",         required_argument, NULL, 's'},
+		{"threads",      required_argument, NULL, 't'},
+		{"width",        required_argument, NULL, 'W'},
+		{NULL, 0, NULL, 0}
+	};
+
+	set->pixels = 128;
+	set->width = 1920;
+	set->height = 1080;
+	set->frames = 16;
+	set->dist = DIST_SHELL;
+	set->fill = 0.05;
+	set->visang = 0.8;
+	set->threads = omp_get_max_threads();
+	set->png_level = 6;
+	set->png_strips = 1;
+	set->csv = 0;
+	set->seed = 1;
+
+	while ((c = getopt_long(argc, argv, "cd:f:F:hH:n:s:t:W:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'c':
+				set->csv = 1;
+				break;
+			case 'd':
+				if (!strcmp(optarg, "shell")) set->dist = DIST_SHELL;
+				else if (!strcmp(optarg, "torus")) set->dist = DIST_TORUS;
+				else if (!strcmp(optarg, "random")) set->dist = DIST_RANDOM;
+				else {
+					fprintf(stderr, "ERROR: Unrecognized distribution: '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'f':
+				set->frames = parse_int("--frames", optarg, 1);
+				break;
+			case 'F':
+				set->fill = strtod(optarg, &end);
+				if (*optarg == 0 || *end != 0 || !(set->fill > 0 && set->fill <= 1)) {
+					fprintf(stderr, "ERROR: Invalid value of option '--fill': '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+			case 'H':
+				set->height = parse_int("--height", optarg, 1);
+				break;
+			case 'n':
+				set->pixels = parse_int("--pixels", optarg, 2);
+				break;
+			case OPT_PNG_LEVEL:
+				set->png_level = parse_int("--png-level", optarg, 0);
+				break;
+			case OPT_PNG_STRIPS:
+				set->png_strips = parse_int("--png-strips", optarg, 1);
+				break;
+			case 's':
+				set->seed = parse_int("--seed", optarg, 0);
+				break;
+			case 't':
+				set->threads = parse_int("--threads", optarg, 1);
+				break;
+			case 'W':
+				set->width = parse_int("--width", optarg, 1);
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Return a pseudo-random number, uniformly distributed
+ * in [0, 1) (xorshift64*, so that volumes are the same
+ * on all platforms).
+ */
+double bench_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Generate a synthetic S3D volume, spanning [-1,1] along
+ * each axis. For shells and tori, the thickness is chosen
+ * so that roughly a fraction 'fill' of the voxels are
+ * non-zero, and the intensity falls off linearly from
+ * the center of the shell (or tube). Intensities are
+ * randomly perturbed, so that images are not trivially
+ * compressible.
+ */
+s3d_t *bench_generate(struct bench_settings *set) {
+	const double R_shell = 0.7, R_torus = 0.6;
+	size_t n = set->pixels, i, j, k;
+	double x, y, z, d, w, h = 2.0 / (n-1), *buf;
+	uint64_t state = set->seed*0x9E3779B97F4A7C15ULL + 1;
+	s3d_t *s = s3d_new();
+
+	s->pixels = n;
+	s->xmin = s->ymin = s->zmin = -1;
+	s->xmax = s->ymax = s->zmax = 1;
+
+	buf = malloc(sizeof(double)*n*n*n);
+	if (buf == NULL) {
+		fprintf(stderr, "ERROR: Unable to allocate memory for S3D volume.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	s->buffer = buf;
+	s->data = s3d_index(buf, n);
+
+	/* Half thickness of shell, or radius of torus tube */
+	if (set->dist == DIST_SHELL)
+		w = set->fill * 8.0 / (8.0*PI*R_shell*R_shell);
+	else
+		w = sqrt(set->fill * 8.0 / (2.0*PI*PI*R_torus));
+
+	for (i = 0; i < n; i++) {
+		x = -1 + i*h;
+		for (j = 0; j < n; j++) {
+			y = -1 + j*h;
+			for (k = 0; k < n; k++) {
+				z = -1 + k*h;
+
+				switch (set->dist) {
+					case DIST_SHELL:
+						d = fabs(sqrt(x*x + y*y + z*z) - R_shell) / w;
+						break;
+					case DIST_TORUS:
+						d = hypot(hypot(x, y) - R_torus, z) / w;
+						break;
+					default:
+						d = (bench_random(&state) < set->fill ? 0 : 1);
+						break;
+				}
+
+				if (d < 1)
+					s->data[i][j][k] = (1-d) * (0.5 + 0.5*bench_random(&state)) + 1e-3;
+				else
+					s->data[i][j][k] = 0;
+			}
+		}
+	}
+
+	return s;
+}
+
+/**
+ * Position the camera 'cv' for frame 'j', rotating it
+ * around the z axis at a distance of three times
+ * the half-width of the volume.
+ */
+void bench_camera(struct bench_settings *set, camera_view_t *cv, size_t j) {
+	double a = 2.0*PI*j / set->frames,
+		   loc[3] = {3*sin(a), -3*cos(a), 0.3},
+		   dir[3] = {-loc[0], -loc[1], -loc[2]};
+
+	camera_view_place(cv, loc, dir);
+}
+
+/**
+ * Return the size of the given file (in bytes).
+ */
+double bench_filesize(const char *name) {
+	struct stat st;
+	if (stat(name, &st) < 0) return 0;
+	else return (double)st.st_size;
+}
+
+void print_results(struct bench_settings *set, s3d_t *s, struct stage *st, int nst) {
+	int i;
+
+	if (set->csv) {
+		printf("stage,seconds,voxels_per_s,pixels_per_s,mb_per_s\n");
+		for (i = 0; i < nst; i++)
+			printf("%s,%.6f,%.6e,%.6e,%.3f\n",
+				st[i].name, st[i].seconds,
+				st[i].voxels / st[i].seconds,
+				st[i].pixels / st[i].seconds,
+				st[i].bytes / st[i].seconds / 1e6);
+		return;
+	}
+
+	printf("{\n");
+	printf("  \"version\": \"%d.%d\",\n", S3DVID_VERSION_MAJOR, S3DVID_VERSION_MINOR);
+	printf("  \"precision\": \"%s\",\n", sizeof(real_t) == sizeof(float) ? "single" : "double");
+	printf("  \"threads\": %d,\n", set->threads);
+	printf("  \"volume\": {\"pixels\": %zu, \"distribution\": \"%s\", \"seed\": %llu, \"nvoxels\": %zu, \"nbricks\": %zu},\n",
+		set->pixels, distribution_names[set->dist], (unsigned long long)set->seed, s->nvoxels, s->nbricks);
+	printf("  \"frame\": {\"width\": %zu, \"height\": %zu, \"frames\": %zu},\n", set->width, set->height, set->frames);
+	printf("  \"png\": {\"level\": %d, \"strips\": %d},\n", set->png_level, set->png_strips);
+	printf("  \"stages\": [\n");
+	for (i = 0; i < nst; i++)
+		printf("    {\"name\": \"%s\", \"seconds\": %.6f, \"voxels_per_s\": %.6e, \"pixels_per_s\": %.6e, \"mb_per_s\": %.3f}%s\n",
+			st[i].name, st[i].seconds,
+			st[i].voxels / st[i].seconds,
+			st[i].pixels / st[i].seconds,
+			st[i].bytes / st[i].seconds / 1e6,
+			(i < nst-1 ? "," : ""));
+	printf("  ]\n");
+	printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_settings set;
+	struct stage st[6];
+	char pngname[] = "/tmp/s3dvid-bench-XXXXXX";
+	size_t j, npix;
+	real_t **img;
+	bitmap_t *bmp = NULL;
+	double t, mx, pngbytes = 0, origin[3] = {0, 0, 0}, axis[3] = {0, 0, 1};
+	camera_view_t cv;
+	png_options_t png;
+	int fd;
+	s3d_t *s;
+
+	parse_options(argc, argv, &set);
+	npix = set.width*set.height;
+
+	fd = mkstemp(pngname);
+	if (fd < 0) {
+		perror("ERROR");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	fprintf(stderr, "Generating %zu^3 %s volume...\n", set.pixels, distribution_names[set.dist]);
+	s = bench_generate(&set);
+
+	/* Compaction and bricking (as done after loading) */
+	t = omp_get_wtime();
+	s3d_compact(s);
+	s3d_free_data(s);
+	st[0] = (struct stage){"compact", omp_get_wtime()-t, (double)set.pixels*set.pixels*set.pixels, 0, 0};
+	st[0].bytes = st[0].voxels * sizeof(double);
+
+	t = omp_get_wtime();
+	s3d_build_bricks(s);
+	st[1] = (struct stage){"bricks", omp_get_wtime()-t, (double)s->nvoxels, 0, 4.0*sizeof(real_t)*s->nvoxels};
+
+	fprintf(stderr, "%zu non-zero voxels, %zu bricks.\n", s->nvoxels, s->nbricks);
+
+	png_options_init(&png, set.png_level, PNG_OPT_FILTER_DEFAULT, 0, set.png_strips);
+	camera_view_init(&cv, set.height, set.width, set.visang, origin, axis);
+	cv.threads = set.threads;
+	img = cv.image = camera_view_alloc_image(set.height, set.width);
+
+	/* Intensity threshold, from the first frame */
+	bench_camera(&set, &cv, 0);
+	camera_view_generate(s, &cv);
+	for (j = 0, mx = 0; j < npix; j++)
+		if (img[0][j] > mx) mx = img[0][j];
+	if (mx <= 0) mx = 1;
+
+	/* Individual stages, one frame at a time */
+	st[2] = (struct stage){"projection", 0, 0, 0, 0};
+	st[3] = (struct stage){"colormap", 0, 0, 0, 0};
+	st[4] = (struct stage){"png", 0, 0, 0, 0};
+	for (j = 0; j < set.frames; j++) {
+		bench_camera(&set, &cv, j);
+
+		t = omp_get_wtime();
+		camera_view_clear_image(&cv);
+		camera_view_generate(s, &cv);
+		st[2].seconds += omp_get_wtime()-t;
+
+		t = omp_get_wtime();
+		bmp = thread_bitmap_threshold(img, set.height, set.width, mx);
+		st[3].seconds += omp_get_wtime()-t;
+
+		t = omp_get_wtime();
+		if (savepng_options(bmp, &png, pngname)) {
+			unlink(pngname);
+			return EXIT_FAILURE;
+		}
+		st[4].seconds += omp_get_wtime()-t;
+		pngbytes += bench_filesize(pngname);
+	}
+
+	st[2].voxels = (double)s->nvoxels * set.frames;
+	st[2].pixels = (double)npix * set.frames;
+	st[2].bytes = 4.0*sizeof(real_t) * st[2].voxels;
+
+	st[3].pixels = st[4].pixels = (double)npix * set.frames;
+	st[3].bytes = sizeof(real_t) * st[3].pixels;
+	st[4].bytes = 3.0 * st[4].pixels;
+
+	camera_free_image(img);
+	camera_view_free(&cv);
+
+	/* Complete frames, rendered in parallel (one frame
+	 * per thread, as 's3dvid --parallel frame') */
+	t = omp_get_wtime();
+	#pragma omp parallel num_threads(set.threads)
+	{
+		long long signed int k;
+		char name[sizeof(pngname)+32];
+		camera_view_t tv;
+
+		snprintf(name, sizeof(name), "%s-%d", pngname, omp_get_thread_num());
+		camera_view_init(&tv, set.height, set.width, set.visang, origin, axis);
+		tv.image = camera_view_alloc_image(set.height, set.width);
+
+		#pragma omp for schedule(dynamic)
+		for (k = 0; k < (long long signed)set.frames; k++) {
+			bench_camera(&set, &tv, k);
+			camera_view_clear_image(&tv);
+			camera_view_generate(s, &tv);
+			saveimg_options(tv.image, set.height, set.width, mx, &png, name);
+		}
+
+		camera_free_image(tv.image);
+		camera_view_free(&tv);
+		unlink(name);
+	}
+	st[5] = (struct stage){"frames", omp_get_wtime()-t, (double)s->nvoxels*set.frames, (double)npix*set.frames, pngbytes};
+
+	unlink(pngname);
+
+	fprintf(stderr, "%.2f frames/s, %.1f kB per frame.\n", set.frames / st[5].seconds, pngbytes / set.frames / 1e3);
+	print_results(&set, s, st, 6);
+
+	return 0;
+}
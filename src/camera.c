@@ -4,182 +4,718 @@
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "camera.h"
+#include "placement.h"
 #include "s3d.h"
-
-double **camera_image;
-size_t camera_pixelsi, camera_pixelsj;
-double ehat1[3], ehat2[3], cnormal[3], cloc[3], tanvisangI;
-
-#pragma omp threadprivate(camera_image,ehat1,ehat2,cnormal,cloc)
+#include "timing.h"
 
 /**
- * Initialize camera image generator globally,
- * not just for one thread.
+ * Compute the largest elevation angle (relative to the
+ * plane orthogonal to the corresponding basis vector)
+ * at which a voxel can still end up in the image, along
+ * an axis with 'pixels' pixels. Since voxels end up in
+ * pixel 'I' = (int)u, with u = pixels/2 * (1 + sin(angle)
+ * / tan(visang/2)), and truncation rounds towards zero,
+ * voxels with u in (-1, pixels) are visible. A small
+ * margin is added to account for rounding errors.
  */
-void camera_init(size_t pixelsi, size_t pixelsj, double visang) {
-	/* Inverse of tangent of half vision angle */
-	tanvisangI = 1.0 / tan(visang/2.0);
+static double camera_cull_angle(size_t pixels, double tanvisangI) {
+	double s = (1.0 + 2.0/pixels) / tanvisangI;
 
-	camera_pixelsi = pixelsi;
-	camera_pixelsj = pixelsj;
+	if (!(s > 0) || s >= 1) return -1;
+	else return asin(s) + CAMERA_CULL_MARGIN;
 }
 
 /**
- * Initialize one thread. This function
- * sets the camera settings for that thread.
+ * Set up a camera.
  *
- * location: Camera position relative device center.
+ * pixelsi:   Number of rows of the image.
+ * pixelsj:   Number of columns of the image.
+ * visang:    Vision angle (in radians).
+ * location:  Camera position relative device center.
  * direction: Camera viewing direction (normal vector, not necessarily normalized).
  */
-void camera_init_local(double location[3], double direction[3]) {
+void camera_view_init(
+	camera_view_t *cv, size_t pixelsi, size_t pixelsj, double visang,
+	double location[3], double direction[3]
+) {
 	double n;
+
+	cv->pixelsi = pixelsi;
+	cv->pixelsj = pixelsj;
+	cv->visang = visang;
+
+	/* Inverse of tangent of half vision angle */
+	cv->tanvisangI = 1.0 / tan(visang/2.0);
+
+	cv->cull_i = camera_cull_angle(pixelsi, cv->tanvisangI);
+	cv->cull_j = camera_cull_angle(pixelsj, cv->tanvisangI);
+	cv->lod_scale = (pixelsi > pixelsj ? pixelsi : pixelsj) * cv->tanvisangI;
+
 	/* Camera location */
-	cloc[0] = location[0];
-	cloc[1] = location[1];
-	cloc[2] = location[2];
+	cv->cloc[0] = location[0];
+	cv->cloc[1] = location[1];
+	cv->cloc[2] = location[2];
 
 	/* Viewing direction */
 	n = hypot(direction[0], hypot(direction[1], direction[2]));
-	cnormal[0] = direction[0] / n;
-	cnormal[1] = direction[1] / n;
-	cnormal[2] = direction[2] / n;
+	cv->cnormal[0] = direction[0] / n;
+	cv->cnormal[1] = direction[1] / n;
+	cv->cnormal[2] = direction[2] / n;
 	
 	/* Compute camera basis */
-	if (cnormal[1] == 0) {
-		ehat1[0] = 0;
-		ehat1[1] = 1;
-		ehat1[0] = 0;
+	if (cv->cnormal[1] == 0) {
+		cv->ehat1[0] = 0;
+		cv->ehat1[1] = 1;
+		cv->ehat1[2] = 0;
 	} else {
-		n = 1 / sqrt(cnormal[0]*cnormal[0] + cnormal[1]*cnormal[1]);
-		ehat1[0] = n * cnormal[1];
-		ehat1[1] =-n * cnormal[0];
-		ehat1[2] = 0;
+		n = 1 / sqrt(cv->cnormal[0]*cv->cnormal[0] + cv->cnormal[1]*cv->cnormal[1]);
+		cv->ehat1[0] = n * cv->cnormal[1];
+		cv->ehat1[1] =-n * cv->cnormal[0];
+		cv->ehat1[2] = 0;
+	}
+
+	cv->ehat2[0] = cv->ehat1[1]*cv->cnormal[2] - cv->ehat1[2]*cv->cnormal[1];
+	cv->ehat2[1] = cv->ehat1[2]*cv->cnormal[0] - cv->ehat1[0]*cv->cnormal[2];
+	cv->ehat2[2] = cv->ehat1[0]*cv->cnormal[1] - cv->ehat1[1]*cv->cnormal[0];
+
+	cv->image = NULL;
+	cv->lod = 0;
+	cv->subset_first = 0;
+	cv->subset_stride = 1;
+	cv->threads = 1;
+	cv->huge = 0;
+	cv->partials = NULL;
+	cv->npartials = cv->partial_size = 0;
+	cv->partials_huge = 0;
+}
+
+/**
+ * Free the buffers of a camera (but not its image).
+ */
+void camera_view_free(camera_view_t *cv) {
+	size_t k;
+
+	for (k = 0; k < cv->npartials; k++) {
+		if (cv->partials_huge)
+			placement_free(cv->partials[k], sizeof(real_t)*cv->partial_size, 1);
+		else
+			free(cv->partials[k]);
+	}
+	free(cv->partials);
+
+	cv->partials = NULL;
+	cv->npartials = cv->partial_size = 0;
+	cv->partials_huge = 0;
+}
+
+/**
+ * Move the camera 'cv' to 'location', looking along
+ * 'direction', keeping its image size, vision angle,
+ * image and all other settings (and buffers).
+ */
+void camera_view_place(camera_view_t *cv, double location[3], double direction[3]) {
+	camera_view_t v = *cv;
+
+	camera_view_init(cv, v.pixelsi, v.pixelsj, v.visang, location, direction);
+
+	cv->image = v.image;
+	cv->lod = v.lod;
+	cv->subset_first = v.subset_first;
+	cv->subset_stride = v.subset_stride;
+	cv->threads = v.threads;
+	cv->huge = v.huge;
+	cv->partials = v.partials;
+	cv->npartials = v.npartials;
+	cv->partial_size = v.partial_size;
+	cv->partials_huge = v.partials_huge;
+}
+
+/**
+ * Rotate a camera by 'angle' (in radians) about the
+ * line through 'origin' along 'axis', rotating its
+ * location 'v1' about the line and its direction 'v2'
+ * (in place).
+ */
+void camera_rotate(double angle, double v1[3], double v2[3], double origin[3], double axis[3]) {
+	double n, s, c, ux, uy, uz, tx, ty, tz, vx, vy, vz, R[3][3];
+	n = hypot(axis[0], hypot(axis[1], axis[2]));
+	ux = axis[0] / n;
+	uy = axis[1] / n;
+	uz = axis[2] / n;
+
+	vx = v1[0]-origin[0];
+	vy = v1[1]-origin[1];
+	vz = v1[2]-origin[2];
+	
+	s = sin(angle), c = cos(angle);
+	R[0][0] = (c+ux*ux*(1-c));    R[0][1] = (ux*uy*(1-c)-uz*s); R[0][2] = (ux*uz*(1-c)+uy*s);
+	R[1][0] = (uy*ux*(1-c)+uz*s); R[1][1] = (c+uy*uy*(1-c));    R[1][2] = (uy*uz*(1-c)+ux*s);
+	R[2][0] = (uz*ux*(1-c)+uy*s); R[2][1] = (uz*uy*(1-c)+ux*s); R[2][2] = (c+uz*uz*(1-c));
+
+	tx = R[0][0]*vx + R[0][1]*vy + R[0][2]*vz  + origin[0];
+	ty = R[1][0]*vx + R[1][1]*vy + R[1][2]*vz  + origin[1];
+	tz = R[2][0]*vx + R[2][1]*vy + R[2][2]*vz  + origin[2];
+	v1[0]=tx; v1[1]=ty; v1[2]=tz;
+
+	tx = R[0][0]*v2[0] + R[0][1]*v2[1] + R[0][2]*v2[2];
+	ty = R[1][0]*v2[0] + R[1][1]*v2[1] + R[1][2]*v2[2];
+	tz = R[2][0]*v2[0] + R[2][1]*v2[1] + R[2][2]*v2[2];
+	v2[0]=tx; v2[1]=ty; v2[2]=tz;
+}
+
+/**
+ * Allocate memory for an image with the
+ * given dimensions.
+ */
+real_t **camera_view_alloc_image(size_t pixelsi, size_t pixelsj) {
+	size_t i;
+	real_t **img;
+	img = malloc(sizeof(real_t*)*pixelsi);
+	img[0] = calloc(pixelsi*pixelsj, sizeof(real_t));
+	for (i = 1; i < pixelsi; i++)
+		img[i] = img[i-1] + pixelsj;
+
+	return img;
+}
+
+/**
+ * Free memory for an image allocated
+ * with 'camera_view_alloc_image()'.
+ */
+void camera_free_image(real_t **img) {
+	free(img[0]);
+	free(img);
+}
+
+/**
+ * Clear the image of the camera 'cv'.
+ */
+void camera_view_clear_image(camera_view_t *cv) {
+	memset(cv->image[0], 0, sizeof(real_t)*cv->pixelsi*cv->pixelsj);
+}
+
+/**
+ * Project a batch of voxels onto the camera plane
+ * using the original, scalar, formulation. The
+ * (non-truncated) pixel coordinates of voxel 'n'
+ * are stored in 'u[n]' (row) and 'v[n]' (column).
+ *
+ * This is the reference against which the vectorized
+ * kernel (camera_project_simd()) is checked.
+ */
+static void camera_project_reference(
+	const camera_view_t *cv,
+	const real_t *x, const real_t *y, const real_t *z, size_t nv,
+	double *u, double *v
+) {
+	size_t n;
+	const double *cloc = cv->cloc, *cnormal = cv->cnormal,
+		*ehat1 = cv->ehat1, *ehat2 = cv->ehat2;
+	double npi2 = cv->pixelsi * 0.5,
+		   npj2 = cv->pixelsj * 0.5,
+		   tanvisangI = cv->tanvisangI,
+		   Li, f, q1, q2,
+		   rcp[3], q[3];
+
+	for (n = 0; n < nv; n++) {
+		rcp[0] = x[n]-cloc[0];
+		rcp[1] = y[n]-cloc[1];
+		rcp[2] = z[n]-cloc[2];
+
+		Li = 1.0 / hypot(rcp[0], hypot(rcp[1], rcp[2]));
+		f = cnormal[0]*rcp[0] + cnormal[1]*rcp[1] + cnormal[2]*rcp[2];
+
+		q[0] = rcp[0]-f*cnormal[0];
+		q[1] = rcp[1]-f*cnormal[1];
+		q[2] = rcp[2]-f*cnormal[2];
+
+		q1 = ehat1[0]*q[0] + ehat1[1]*q[1] + ehat1[2]*q[2];
+		q2 = ehat2[0]*q[0] + ehat2[1]*q[1] + ehat2[2]*q[2];
+
+		u[n] = npi2 * (q2*tanvisangI*Li + 1);
+		v[n] = npj2 * (q1*tanvisangI*Li + 1);
+	}
+}
+
+/**
+ * Project a batch of voxels onto the camera plane.
+ * Vectorized version of camera_project_reference().
+ *
+ * Since ehat1 and ehat2 are both orthogonal to the
+ * viewing direction, the component of 'rcp' along
+ * the viewing direction need not be subtracted
+ * before projecting. All constant factors are
+ * folded into the basis vectors, and hypot() is
+ * replaced by an (inlined) reciprocal square root,
+ * leaving a loop that the compiler vectorizes to
+ * whatever SIMD width the target supports. The
+ * arithmetic is done in the precision of real_t.
+ */
+static void camera_project_simd(
+	const camera_view_t *cv,
+	const real_t *restrict x, const real_t *restrict y, const real_t *restrict z,
+	size_t nv, real_t *restrict u, real_t *restrict v
+) {
+	size_t n;
+	double npi2d = cv->pixelsi * 0.5,
+		   npj2d = cv->pixelsj * 0.5,
+		   ti = cv->tanvisangI;
+	real_t npi2 = npi2d, npj2 = npj2d,
+		   c0 = cv->cloc[0], c1 = cv->cloc[1], c2 = cv->cloc[2],
+		   a0 = npj2d*ti*cv->ehat1[0],
+		   a1 = npj2d*ti*cv->ehat1[1],
+		   a2 = npj2d*ti*cv->ehat1[2],
+		   b0 = npi2d*ti*cv->ehat2[0],
+		   b1 = npi2d*ti*cv->ehat2[1],
+		   b2 = npi2d*ti*cv->ehat2[2];
+
+	#pragma omp simd
+	for (n = 0; n < nv; n++) {
+		real_t r0 = x[n]-c0, r1 = y[n]-c1, r2 = z[n]-c2;
+		real_t Li = (real_t)1 / REAL_SQRT(r0*r0 + r1*r1 + r2*r2);
+
+		u[n] = npi2 + (b0*r0 + b1*r1 + b2*r2)*Li;
+		v[n] = npj2 + (a0*r0 + a1*r1 + a2*r2)*Li;
+	}
+}
+
+/**
+ * Add a batch of projected voxels to the image 'img'
+ * (stored contiguously, row by row).
+ */
+static void camera_splat(
+	const camera_view_t *cv, const real_t *u, const real_t *v,
+	const real_t *w, size_t nv, real_t *img
+) {
+	size_t n;
+	long long signed int I, J,
+		pi = cv->pixelsi, pj = cv->pixelsj;
+
+	for (n = 0; n < nv; n++) {
+		I = (long long signed int)u[n];
+		J = (long long signed int)v[n];
+
+		if (I >= 0 && I < pi && J >= 0 && J < pj)
+			img[I*pj + J] += w[n];
+	}
+}
+
+/**
+ * Check whether any part of the brick 'b' may be visible
+ * from the camera 'cv'. Voxels project to
+ * the image based on their direction from the camera
+ * only (so that voxels behind the camera can also be
+ * visible), and the direction to any point in the brick
+ * lies within the angular radius of its bounding sphere
+ * from the direction to its center. The brick is thus
+ * culled if that cone lies entirely outside the range
+ * of visible angles along either image axis.
+ *
+ * Returns CAMERA_BRICK_CULLED if the brick is not
+ * visible, CAMERA_BRICK_POINT if it is visible but
+ * should be drawn as a single point, and otherwise
+ * CAMERA_BRICK_VISIBLE.
+ */
+static int camera_brick_visible(const camera_view_t *cv, const s3d_brick_t *b) {
+	const double *ehat1 = cv->ehat1, *ehat2 = cv->ehat2;
+	double d0 = b->center[0]-cv->cloc[0],
+		   d1 = b->center[1]-cv->cloc[1],
+		   d2 = b->center[2]-cv->cloc[2],
+		   D = sqrt(d0*d0 + d1*d1 + d2*d2),
+		   alpha, beta, s;
+
+	/* Camera inside (or very close to) the brick */
+	if (D <= b->radius)
+		return CAMERA_BRICK_VISIBLE;
+
+	alpha = asin(b->radius / D);
+
+	if (cv->cull_i >= 0) {
+		s = (ehat2[0]*d0 + ehat2[1]*d1 + ehat2[2]*d2) / D;
+		beta = asin(s > 1 ? 1 : (s < -1 ? -1 : s));
+		if (beta-alpha > cv->cull_i || beta+alpha < -cv->cull_i)
+			return CAMERA_BRICK_CULLED;
+	}
+	if (cv->cull_j >= 0) {
+		s = (ehat1[0]*d0 + ehat1[1]*d1 + ehat1[2]*d2) / D;
+		beta = asin(s > 1 ? 1 : (s < -1 ? -1 : s));
+		if (beta-alpha > cv->cull_j || beta+alpha < -cv->cull_j)
+			return CAMERA_BRICK_CULLED;
+	}
+
+	if (cv->lod && 2*alpha*cv->lod_scale < 1)
+		return CAMERA_BRICK_POINT;
+
+	return CAMERA_BRICK_VISIBLE;
+}
+
+/**
+ * Draw the voxels with indices 'start' to 'end-1' which
+ * belong to the subset of the camera (see 'subset_first'
+ * of camera_view_t). The voxels are gathered into
+ * batches before being projected.
+ */
+static void camera_draw_subset(const camera_view_t *cv, s3d_t *s, size_t start, size_t end, real_t *img) {
+	size_t stride = cv->subset_stride, run = CAMERA_SUBSET_RUN,
+		   r, n, a, b, nb = 0, drawn = 0;
+	real_t x[CAMERA_BATCH], y[CAMERA_BATCH], z[CAMERA_BATCH],
+		   w[CAMERA_BATCH], u[CAMERA_BATCH], v[CAMERA_BATCH];
+
+	/* First run of the subset which ends after 'start' */
+	r = start / run;
+	r += (cv->subset_first + stride - r % stride) % stride;
+
+	for (; r*run < end; r += stride) {
+		a = r*run > start ? r*run : start;
+		b = r*run + run < end ? r*run + run : end;
+
+		for (n = a; n < b; n++) {
+			x[nb] = s->vx[n];
+			y[nb] = s->vy[n];
+			z[nb] = s->vz[n];
+			w[nb] = s->vi[n];
+
+			if (++nb == CAMERA_BATCH || (n+1 == b && r*run + stride*run >= end)) {
+				camera_project_simd(cv, x, y, z, nb, u, v);
+				camera_splat(cv, u, v, w, nb, img);
+				drawn += nb;
+				nb = 0;
+			}
+		}
 	}
 
-	ehat2[0] = ehat1[1]*cnormal[2] - ehat1[2]*cnormal[1];
-	ehat2[1] = ehat1[2]*cnormal[0] - ehat1[0]*cnormal[2];
-	ehat2[2] = ehat1[0]*cnormal[1] - ehat1[1]*cnormal[0];
+	timing_count(TIMING_VOXELS, drawn);
 }
 
 /**
- * Free memory for current image.
+ * Draw the voxels with indices 'start' to 'end-1', as
+ * seen from the camera 'cv', into the image 'img'
+ * (stored contiguously).
  */
-void camera_destroy_image(void) {
-	free(camera_image[0]);
-	free(camera_image);
+static void camera_draw_voxels(const camera_view_t *cv, s3d_t *s, size_t start, size_t end, real_t *img) {
+	size_t n, nb;
+	real_t u[CAMERA_BATCH], v[CAMERA_BATCH];
+
+	if (cv->subset_stride > 1) {
+		camera_draw_subset(cv, s, start, end, img);
+		return;
+	}
+
+	for (n = start; n < end; n += CAMERA_BATCH) {
+		nb = end-n < CAMERA_BATCH ? end-n : CAMERA_BATCH;
+
+		camera_project_simd(cv, s->vx+n, s->vy+n, s->vz+n, nb, u, v);
+		camera_splat(cv, u, v, s->vi+n, nb, img);
+	}
+
+	timing_count(TIMING_VOXELS, end-start);
 }
+
 /**
- * Allocate memory for a new image.
+ * Draw a brick as a single point (at its centroid,
+ * with the total intensity of the brick).
  */
-void camera_new_image(void) {
-	size_t i, j;
-	camera_image = malloc(sizeof(double*)*camera_pixelsi);
-	camera_image[0] = malloc(sizeof(double)*camera_pixelsi*camera_pixelsj);
-	for (i = 0; i < camera_pixelsi; i++) {
-		if (i > 0) camera_image[i] = camera_image[i-1] + camera_pixelsj;
+static void camera_draw_point(const camera_view_t *cv, const s3d_brick_t *b, real_t *img) {
+	real_t x = b->centroid[0], y = b->centroid[1], z = b->centroid[2],
+		   w = b->sum / cv->subset_stride, u, v;
 
-		for (j = 0; j < camera_pixelsj; j++) {
-			camera_image[i][j] = 0.0;
+	camera_project_simd(cv, &x, &y, &z, 1, &u, &v);
+	camera_splat(cv, &u, &v, &w, 1, img);
+	timing_count(TIMING_VOXELS, 1);
+}
+
+/**
+ * Draw one brick into the image 'img', unless
+ * it lies outside the field of view.
+ */
+static void camera_draw_brick(const camera_view_t *cv, s3d_t *s, const s3d_brick_t *b, real_t *img) {
+	switch (camera_brick_visible(cv, b)) {
+		case CAMERA_BRICK_CULLED:
+			break;
+		case CAMERA_BRICK_POINT:
+			camera_draw_point(cv, b, img);
+			break;
+		default:
+			camera_draw_voxels(cv, s, b->start, b->start+b->count, img);
+			break;
+	}
+}
+
+/**
+ * Allocate the partial images of the camera 'cv', for
+ * all threads but the first, of 'npix' pixels each (on
+ * huge pages if 'cv->huge' is set and they can be had).
+ */
+static void camera_alloc_partials(camera_view_t *cv, size_t npix) {
+	size_t k;
+
+	camera_view_free(cv);
+
+	cv->npartials = cv->threads-1;
+	cv->partial_size = npix;
+	cv->partials = malloc(sizeof(real_t*)*cv->npartials);
+
+	if (cv->huge) {
+		for (k = 0; k < cv->npartials; k++) {
+			cv->partials[k] = placement_alloc(sizeof(real_t)*npix, PLACEMENT_NODE_ANY, 1);
+			if (cv->partials[k] == NULL) break;
 		}
+
+		if (k == cv->npartials) {
+			cv->partials_huge = 1;
+			return;
+		}
+
+		/* Fall back to the heap */
+		while (k-- > 0)
+			placement_free(cv->partials[k], sizeof(real_t)*npix, 1);
 	}
+
+	for (k = 0; k < cv->npartials; k++)
+		cv->partials[k] = malloc(sizeof(real_t)*npix);
 }
 
 /**
- * Clear the current image
+ * Generate the image of the camera 'cv', splitting the
+ * voxels among 'cv->threads' threads. Each thread
+ * accumulates a partial image (the first thread
+ * directly into the camera image), and the partial
+ * images are then summed in parallel.
  */
-void camera_clear_image(void) {
-	size_t i, j;
-	for (i = 0; i < camera_pixelsi; i++) {
-		for (j = 0; j < camera_pixelsj; j++) {
-			camera_image[i][j] = 0.0;
+static void camera_generate_parallel(s3d_t *s, camera_view_t *cv) {
+	size_t npix = cv->pixelsi*cv->pixelsj;
+	real_t *img = cv->image[0];
+
+	if (cv->npartials < (size_t)cv->threads-1 || cv->partial_size < npix)
+		camera_alloc_partials(cv, npix);
+
+	#pragma omp parallel num_threads(cv->threads)
+	{
+		long long signed int n, nb, p;
+		int t, tn = omp_get_thread_num(), nt = omp_get_num_threads();
+		real_t *part, sum;
+
+		if (tn == 0) part = img;
+		else {
+			part = cv->partials[tn-1];
+			memset(part, 0, sizeof(real_t)*npix);
+		}
+
+		if (s->bricks != NULL) {
+			/* Cost of bricks varies (due to culling) */
+			#pragma omp for schedule(dynamic, 16)
+			for (n = 0; n < (long long signed)s->nbricks; n++)
+				camera_draw_brick(cv, s, s->bricks+n, part);
+		} else {
+			#pragma omp for schedule(static)
+			for (n = 0; n < (long long signed)s->nvoxels; n += CAMERA_BATCH) {
+				nb = (long long signed)s->nvoxels-n < CAMERA_BATCH ? (long long signed)s->nvoxels-n : CAMERA_BATCH;
+				camera_draw_voxels(cv, s, n, n+nb, part);
+			}
+		}
+
+		/* Sum partial images */
+		#pragma omp for schedule(static)
+		for (p = 0; p < (long long signed)npix; p++) {
+			sum = 0;
+			for (t = 1; t < nt; t++)
+				sum += cv->partials[t-1][p];
+			img[p] += sum;
 		}
 	}
 }
 
 /**
- * Generate a camera image
+ * Generate the image of the camera 'cv', adding to
+ * 'cv->image' (allocated with camera_view_alloc_image()).
+ * If the voxels have been divided into bricks (see
+ * s3d_build_bricks()), bricks outside the field of view
+ * are skipped.
  */
-double **camera_generate(s3d_t *s) {
-	size_t i, j, k;
+void camera_view_generate(s3d_t *s, camera_view_t *cv) {
+	size_t n;
+
+	if (cv->threads > 1) {
+		camera_generate_parallel(s, cv);
+		return;
+	}
+
+	if (s->bricks != NULL) {
+		for (n = 0; n < s->nbricks; n++)
+			camera_draw_brick(cv, s, s->bricks+n, cv->image[0]);
+	} else
+		camera_draw_voxels(cv, s, 0, s->nvoxels, cv->image[0]);
+}
+
+/**
+ * Generate images for several cameras in a single pass
+ * over the voxels. Each batch of voxels is projected
+ * onto all cameras which may see it while it is still
+ * in cache, rather than streaming the full voxel list
+ * through memory once per camera. Every camera renders
+ * into its own image ('views[k].image', allocated with
+ * camera_view_alloc_image()), which is added to.
+ *
+ * If the voxels have been divided into bricks, each
+ * brick is culled (or drawn as a point) separately
+ * for each camera. Cameras which only draw a subset of
+ * the voxels (or split their image across threads) are
+ * rendered separately, with camera_view_generate().
+ */
+void camera_generate_views(s3d_t *s, camera_view_t *views, size_t nviews) {
+	size_t b, k, n, nb, end, nall = 0, nvis, *all, *vis;
+	int mode;
+	real_t u[CAMERA_BATCH], v[CAMERA_BATCH];
+
+	all = malloc(sizeof(size_t)*nviews);
+	for (k = 0; k < nviews; k++) {
+		if (views[k].subset_stride > 1 || views[k].threads > 1)
+			camera_view_generate(s, views+k);
+		else
+			all[nall++] = k;
+	}
+
+	if (s->bricks == NULL) {
+		for (n = 0; n < s->nvoxels; n += CAMERA_BATCH) {
+			nb = s->nvoxels-n < CAMERA_BATCH ? s->nvoxels-n : CAMERA_BATCH;
+
+			for (k = 0; k < nall; k++) {
+				camera_view_t *cv = views+all[k];
+				camera_project_simd(cv, s->vx+n, s->vy+n, s->vz+n, nb, u, v);
+				camera_splat(cv, u, v, s->vi+n, nb, cv->image[0]);
+			}
+		}
+
+		timing_count(TIMING_VOXELS, s->nvoxels*nall);
+		free(all);
+		return;
+	}
+
+	vis = malloc(sizeof(size_t)*nviews);
+
+	for (b = 0; b < s->nbricks && nall > 0; b++) {
+		const s3d_brick_t *br = s->bricks+b;
+
+		/* Cameras which see the individual voxels of this brick */
+		nvis = 0;
+		for (k = 0; k < nall; k++) {
+			camera_view_t *cv = views+all[k];
+			mode = camera_brick_visible(cv, br);
+			if (mode == CAMERA_BRICK_POINT)
+				camera_draw_point(cv, br, cv->image[0]);
+			else if (mode == CAMERA_BRICK_VISIBLE)
+				vis[nvis++] = all[k];
+		}
+
+		if (nvis == 0) continue;
+
+		end = br->start + br->count;
+		for (n = br->start; n < end; n += CAMERA_BATCH) {
+			nb = end-n < CAMERA_BATCH ? end-n : CAMERA_BATCH;
+
+			for (k = 0; k < nvis; k++) {
+				camera_view_t *cv = views+vis[k];
+				camera_project_simd(cv, s->vx+n, s->vy+n, s->vz+n, nb, u, v);
+				camera_splat(cv, u, v, s->vi+n, nb, cv->image[0]);
+			}
+		}
+
+		timing_count(TIMING_VOXELS, br->count*nvis);
+	}
+
+	free(all);
+	free(vis);
+}
+
+/**
+ * Generate the image of the camera 'cv' using the scalar
+ * reference kernel, without culling, accumulating the
+ * image in double precision (regardless of real_t).
+ *
+ * img: Image to add voxels to (stored contiguously,
+ *      row by row, with the dimensions of the camera).
+ */
+void camera_view_generate_reference(s3d_t *s, const camera_view_t *cv, double *img) {
+	size_t n, nb, i;
 	long long signed int I, J;
-	double dx = (s->xmax-s->xmin)/(s->pixels-1),
-		   dy = (s->ymax-s->ymin)/(s->pixels-1),
-		   dz = (s->zmax-s->zmin)/(s->pixels-1),
-		   xmin = s->xmin,
-		   ymin = s->ymin,
-		   zmin = s->zmin,
-		   idx, jdy, kdz,
-		   npi2 = camera_pixelsi * 0.5,
-		   npj2 = camera_pixelsj * 0.5,
-		   Li, f, q1, q2,
-		   x[3], rcp[3], q[3];
+	double u[CAMERA_BATCH], v[CAMERA_BATCH];
 	
-	for (i=0, idx=0; i < s->pixels; i++, idx+=dx) {
-		for (j=0, jdy=0; j < s->pixels; j++, jdy+=dy) {
-			for (k=0, kdz=0; k < s->pixels; k++, kdz+=dz) {
-				/* Ignore empty elements */
-				if (s->data[i][j][k] == 0) continue;
+	for (n = 0; n < s->nvoxels; n += CAMERA_BATCH) {
+		nb = s->nvoxels-n < CAMERA_BATCH ? s->nvoxels-n : CAMERA_BATCH;
 
-				x[0] = xmin+idx;
-				x[1] = ymin+jdy;
-				x[2] = zmin+kdz;
+		camera_project_reference(cv, s->vx+n, s->vy+n, s->vz+n, nb, u, v);
 
-				rcp[0] = x[0]-cloc[0];
-				rcp[1] = x[1]-cloc[1];
-				rcp[2] = x[2]-cloc[2];
+		for (i = 0; i < nb; i++) {
+			I = (long long signed int)u[i];
+			J = (long long signed int)v[i];
 
-				Li = 1.0 / hypot(rcp[0], hypot(rcp[1], rcp[2]));
-				f = cnormal[0]*rcp[0] + cnormal[1]*rcp[1] + cnormal[2]*rcp[2];
+			if (I >= 0 && I < (long long signed)cv->pixelsi &&
+				J >= 0 && J < (long long signed)cv->pixelsj)
+				img[I*cv->pixelsj + J] += s->vi[n+i];
+		}
+	}
+}
+
+/**
+ * Compare the vectorized projection kernel to the
+ * scalar reference kernel, for the camera 'cv'.
+ * Returns the largest deviation (in pixels) between
+ * the projected coordinates of any voxel.
+ *
+ * moved: On return, contains the number of voxels
+ *        which end up in different pixels with the
+ *        two kernels (may be NULL).
+ */
+double camera_view_verify_kernel(s3d_t *s, const camera_view_t *cv, size_t *moved) {
+	size_t n, nb, i, nmoved = 0;
+	real_t u[CAMERA_BATCH], v[CAMERA_BATCH];
+	double uref[CAMERA_BATCH], vref[CAMERA_BATCH],
+		   d, maxdev = 0.0;
 
-				q[0] = rcp[0]-f*cnormal[0];
-				q[1] = rcp[1]-f*cnormal[1];
-				q[2] = rcp[2]-f*cnormal[2];
+	for (n = 0; n < s->nvoxels; n += CAMERA_BATCH) {
+		nb = s->nvoxels-n < CAMERA_BATCH ? s->nvoxels-n : CAMERA_BATCH;
 
-				q1 = ehat1[0]*q[0] + ehat1[1]*q[1] + ehat1[2]*q[2];
-				q2 = ehat2[0]*q[0] + ehat2[1]*q[1] + ehat2[2]*q[2];
+		camera_project_simd(cv, s->vx+n, s->vy+n, s->vz+n, nb, u, v);
+		camera_project_reference(cv, s->vx+n, s->vy+n, s->vz+n, nb, uref, vref);
 
-				I = (long long signed int)(npi2 * (q2*tanvisangI*Li + 1));
-				J = (long long signed int)(npj2 * (q1*tanvisangI*Li + 1));
+		for (i = 0; i < nb; i++) {
+			d = fabs(u[i]-uref[i]);
+			if (d > maxdev) maxdev = d;
+			d = fabs(v[i]-vref[i]);
+			if (d > maxdev) maxdev = d;
 
-				if (I >= 0 && I < (long long signed)camera_pixelsi &&
-					J >= 0 && J < (long long signed)camera_pixelsj)
-					camera_image[I][J] += s->data[i][j][k];
-			}
+			if ((long long signed int)u[i] != (long long signed int)uref[i] ||
+				(long long signed int)v[i] != (long long signed int)vref[i])
+				nmoved++;
 		}
 	}
 
-	return camera_image;
+	if (moved != NULL) *moved = nmoved;
+	return maxdev;
 }
 
 void camera_get_extents(s3d_t *s) {
-	size_t i, j, k;
-	double dx = (s->xmax-s->xmin)/(s->pixels-1),
-		   dy = (s->ymax-s->ymin)/(s->pixels-1),
-		   dz = (s->zmax-s->zmin)/(s->pixels-1),
-		   xmin, ymin, zmin, xmax, ymax, zmax,
-		   idx, jdy, kdz, x, y, z;
+	size_t n;
+	double xmin, ymin, zmin, xmax, ymax, zmax,
+		   x, y, z;
 	
 	xmin = NAN, xmax = NAN;
 	ymin = NAN, ymax = NAN;
 	zmin = NAN, zmax = NAN;
 
-	for (i=0, idx=0; i < s->pixels; i++, idx+=dx) {
-		for (j=0, jdy=0; j < s->pixels; j++, jdy+=dy) {
-			for (k=0, kdz=0; k < s->pixels; k++, kdz+=dz) {
-				if (s->data[i][j][k] == 0) continue;
-
-				x = s->xmin + idx;
-				y = s->ymin + jdy;
-				z = s->zmin + kdz;
-
-					 if (isnan(xmin) || x < xmin) xmin = x;
-				else if (isnan(xmax) || x > xmax) xmax = x;
-					 if (isnan(ymin) || y < ymin) ymin = y;
-				else if (isnan(ymax) || y > ymax) ymax = y;
-					 if (isnan(zmin) || z < zmin) zmin = z;
-				else if (isnan(zmax) || z > zmax) zmax = z;
-			}
-		}
+	for (n = 0; n < s->nvoxels; n++) {
+		x = s->vx[n];
+		y = s->vy[n];
+		z = s->vz[n];
+
+			 if (isnan(xmin) || x < xmin) xmin = x;
+		else if (isnan(xmax) || x > xmax) xmax = x;
+			 if (isnan(ymin) || y < ymin) ymin = y;
+		else if (isnan(ymax) || y > ymax) ymax = y;
+			 if (isnan(zmin) || z < zmin) zmin = z;
+		else if (isnan(zmax) || z > zmax) zmax = z;
 	}
 
 	printf("-------------------------------\n");
@@ -0,0 +1,154 @@
+/* Bounded queue of rendered frames */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "camera.h"
+#include "frameq.h"
+#include "placement.h"
+
+/**
+ * Create a new frame queue, with 'nframes' frame
+ * buffers of 'height' times 'width' pixels. Buffers
+ * are allocated up front, and are recycled between
+ * frames, which bounds the memory used by the queue.
+ *
+ * huge: If non-zero, buffers are allocated on huge
+ *       pages (see placement_alloc_image()).
+ *
+ * Returns NULL if the buffers cannot be allocated.
+ */
+frameq_t *frameq_new(size_t nframes, size_t height, size_t width, int huge) {
+	size_t i;
+	frameq_t *q = malloc(sizeof(frameq_t));
+
+	q->nframes = nframes;
+	q->height = height;
+	q->width = width;
+	q->huge = huge;
+	q->frames = malloc(sizeof(frame_t)*nframes);
+	q->free = malloc(sizeof(frame_t*)*nframes);
+	q->queue = malloc(sizeof(frame_t*)*nframes);
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->has_free, NULL);
+	pthread_cond_init(&q->has_frame, NULL);
+
+	for (i = 0; i < nframes; i++) {
+		if (huge)
+			q->frames[i].img = placement_alloc_image(height, width, 1);
+		else
+			q->frames[i].img = camera_view_alloc_image(height, width);
+
+		if (q->frames[i].img == NULL) {
+			q->nframes = i;
+			frameq_free(q);
+			return NULL;
+		}
+
+		q->frames[i].index = 0;
+		q->free[i] = q->frames + i;
+	}
+
+	q->nfree = nframes;
+	q->head = q->count = 0;
+	q->closed = 0;
+
+	return q;
+}
+
+/**
+ * Destroy the given frame queue. All frame
+ * buffers must have been released.
+ */
+void frameq_free(frameq_t *q) {
+	size_t i;
+	for (i = 0; i < q->nframes; i++) {
+		if (q->huge)
+			placement_free_image(q->frames[i].img, q->height, q->width, 1);
+		else
+			camera_free_image(q->frames[i].img);
+	}
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->has_free);
+	pthread_cond_destroy(&q->has_frame);
+
+	free(q->queue);
+	free(q->free);
+	free(q->frames);
+	free(q);
+}
+
+/**
+ * Get an empty frame buffer to render into.
+ * Blocks until a buffer becomes available.
+ */
+frame_t *frameq_acquire(frameq_t *q) {
+	frame_t *f;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->nfree == 0)
+		pthread_cond_wait(&q->has_free, &q->lock);
+
+	f = q->free[--q->nfree];
+	pthread_mutex_unlock(&q->lock);
+
+	return f;
+}
+
+/**
+ * Put a rendered frame on the queue.
+ */
+void frameq_push(frameq_t *q, frame_t *f) {
+	pthread_mutex_lock(&q->lock);
+	q->queue[(q->head + q->count) % q->nframes] = f;
+	q->count++;
+	pthread_cond_signal(&q->has_frame);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Take the next rendered frame off the queue.
+ * Blocks until a frame is available. Returns
+ * NULL once the queue has been closed and all
+ * frames have been taken off it.
+ */
+frame_t *frameq_pop(frameq_t *q) {
+	frame_t *f = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->has_frame, &q->lock);
+
+	if (q->count > 0) {
+		f = q->queue[q->head];
+		q->head = (q->head + 1) % q->nframes;
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return f;
+}
+
+/**
+ * Return a frame buffer (obtained from
+ * 'frameq_pop()') to the queue once it is
+ * no longer needed.
+ */
+void frameq_release(frameq_t *q, frame_t *f) {
+	pthread_mutex_lock(&q->lock);
+	q->free[q->nfree++] = f;
+	pthread_cond_signal(&q->has_free);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Mark the queue as closed, i.e. indicate that
+ * no more frames will be pushed to it.
+ */
+void frameq_close(frameq_t *q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->has_frame);
+	pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,218 @@
+/* Stacks of raw (unnormalized) frames, for re-tone-mapping */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "framestack.h"
+#include "real.h"
+
+static framestack_t *framestack_new(const char *filename, int fd) {
+	framestack_t *r = malloc(sizeof(framestack_t));
+	size_t l = strlen(filename);
+
+	r->filename = malloc(l+1);
+	memcpy(r->filename, filename, l+1);
+	r->fd = fd;
+
+	return r;
+}
+
+/**
+ * Write the whole of 'buf' (of length 'len') to
+ * the file at 'offset'.
+ */
+static int framestack_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+	size_t done;
+	ssize_t wr;
+
+	for (done = 0; done < len; done += wr) {
+		wr = pwrite(fd, (const char*)buf + done, len-done, offset + done);
+		if (wr <= 0) return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Read the whole of 'buf' (of length 'len') from
+ * the file at 'offset'.
+ */
+static int framestack_pread(int fd, void *buf, size_t len, off_t offset) {
+	size_t done;
+	ssize_t rd;
+
+	for (done = 0; done < len; done += rd) {
+		rd = pread(fd, (char*)buf + done, len-done, offset + done);
+		if (rd <= 0) return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Create a frame stack file holding 'nframes' frames
+ * of 'height' times 'width' pixels, starting with frame
+ * number 'first' of a video of 'fps' frames per second.
+ * The file is given its full size up front, so that
+ * frames can be written in any order.
+ */
+framestack_t *framestack_create(
+	const char *filename, size_t height, size_t width,
+	size_t first, size_t nframes, size_t fps
+) {
+	framestack_t *r;
+	int fd;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to create frame stack: %s.\n", filename);
+		return NULL;
+	}
+
+	r = framestack_new(filename, fd);
+	memset(&r->h, 0, sizeof(framestack_header_t));
+	memcpy(r->h.magic, FRAMESTACK_MAGIC, sizeof(r->h.magic));
+	r->h.endian = FRAMESTACK_ENDIAN;
+	r->h.version = FRAMESTACK_VERSION;
+	r->h.height = height;
+	r->h.width = width;
+	r->h.first = first;
+	r->h.nframes = nframes;
+	r->h.fps = fps;
+	r->h.offset = FRAMESTACK_HEADER_SIZE;
+	r->framesize = height*width*sizeof(float);
+
+	if (ftruncate(fd, r->h.offset + (off_t)(nframes*r->framesize)) != 0) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to create frame stack: %s.\n", filename);
+		framestack_close(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/**
+ * Write frame number 'index' (of the video) to the
+ * stack. May be called from any thread. Returns
+ * non-zero on error.
+ */
+int framestack_write(framestack_t *r, size_t index, real_t **img) {
+	size_t k, n = r->h.height*r->h.width;
+	float *buf;
+	int err;
+
+	if (index < r->h.first || index >= r->h.first + r->h.nframes)
+		return -1;
+
+	buf = malloc(r->framesize);
+	for (k = 0; k < n; k++)
+		buf[k] = img[0][k];
+
+	err = framestack_pwrite(r->fd, buf, r->framesize,
+		r->h.offset + (off_t)((index - r->h.first)*r->framesize));
+	free(buf);
+
+	return err;
+}
+
+/**
+ * Record the normalization used when rendering the
+ * frames, write the header and close the file. The
+ * header is written last, so that a stack which was
+ * not completely written is not mistaken for a valid
+ * one.
+ */
+int framestack_finish(framestack_t *r, double max_intensity, double threshold) {
+	char pad[FRAMESTACK_HEADER_SIZE];
+	int err;
+
+	r->h.max_intensity = max_intensity;
+	r->h.threshold = threshold;
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, &r->h, sizeof(r->h));
+
+	err = framestack_pwrite(r->fd, pad, sizeof(pad), 0);
+	if (err) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to write frame stack: %s.\n", r->filename);
+	}
+
+	framestack_close(r);
+
+	return err;
+}
+
+/**
+ * Open an existing frame stack file for reading.
+ */
+framestack_t *framestack_open(const char *filename) {
+	framestack_t *r;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "ERROR: Unable to open frame stack: %s.\n", filename);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	r = framestack_new(filename, fd);
+	if (framestack_pread(fd, &r->h, sizeof(r->h), 0) ||
+		memcmp(r->h.magic, FRAMESTACK_MAGIC, sizeof(r->h.magic))) {
+		fprintf(stderr, "ERROR: '%s' is not a (completely written) s3dvid frame stack.\n", filename);
+		framestack_close(r);
+		return NULL;
+	}
+	if (r->h.endian != FRAMESTACK_ENDIAN || r->h.version != FRAMESTACK_VERSION) {
+		fprintf(stderr, "ERROR: '%s' was written by an incompatible version of s3dvid (or on another architecture).\n", filename);
+		framestack_close(r);
+		return NULL;
+	}
+
+	r->framesize = r->h.height*r->h.width*sizeof(float);
+	if ((uint64_t)st.st_size < r->h.offset + r->h.nframes*r->framesize) {
+		fprintf(stderr, "ERROR: '%s' is truncated.\n", filename);
+		framestack_close(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/**
+ * Read image 'k' of the stack (frame number 'first+k'
+ * of the video) into 'img'. May be called from any
+ * thread. Returns non-zero on error.
+ */
+int framestack_read(framestack_t *r, size_t k, real_t **img) {
+	size_t i, n = r->h.height*r->h.width;
+	float *buf;
+	int err;
+
+	if (k >= r->h.nframes)
+		return -1;
+
+	buf = malloc(r->framesize);
+	err = framestack_pread(r->fd, buf, r->framesize, r->h.offset + (off_t)(k*r->framesize));
+	if (!err) {
+		for (i = 0; i < n; i++)
+			img[0][i] = buf[i];
+	}
+	free(buf);
+
+	return err;
+}
+
+void framestack_close(framestack_t *r) {
+	close(r->fd);
+	free(r->filename);
+	free(r);
+}
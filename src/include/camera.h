@@ -1,14 +1,95 @@
 #ifndef _CAMERA_H
 #define _CAMERA_H
 
+#include "real.h"
 #include "s3d.h"
 
-void camera_init(size_t, size_t, double);
-void camera_init_local(double[3], double[3]);
-void camera_destroy_image(void);
-void camera_new_image(void);
-void camera_clear_image(void);
-double **camera_generate(s3d_t*);
+/* Number of voxels projected at a time */
+#define CAMERA_BATCH 256
+/* Number of consecutive voxels in each run
+ * of a subset (see 'subset_first' of camera_view_t) */
+#define CAMERA_SUBSET_RUN 8
+/* Largest accepted deviation (in pixels) between
+ * the vectorized and reference projection kernels */
+#ifdef SINGLE_PRECISION
+#	define CAMERA_KERNEL_TOLERANCE 1e-2
+#else
+#	define CAMERA_KERNEL_TOLERANCE 1e-6
+#endif
+/* Margin (in radians) added to the field of
+ * view when culling bricks */
+#define CAMERA_CULL_MARGIN 1e-6
+
+/* Return values of camera_brick_visible() */
+#define CAMERA_BRICK_CULLED 0
+#define CAMERA_BRICK_VISIBLE 1
+#define CAMERA_BRICK_POINT 2
+
+/**
+ * A camera, with everything needed to render its image.
+ * Cameras are independent of each other, so that any
+ * number of them may be rendered at the same time, with
+ * different settings, from any thread.
+ */
+typedef struct {
+	/* Image size (rows, columns) */
+	size_t pixelsi, pixelsj;
+	/* Vision angle (in radians) */
+	double visang;
+	/* Inverse of tangent of half vision angle */
+	double tanvisangI;
+	/* Camera basis, viewing direction and location */
+	double ehat1[3], ehat2[3], cnormal[3], cloc[3];
+	/* Largest angle (in radians) between a visible voxel
+	 * and the plane spanned by the viewing direction and
+	 * ehat1 (cull_i) or ehat2 (cull_j), or negative if
+	 * all voxels may be visible */
+	double cull_i, cull_j;
+	/* Factor converting the angular radius of a brick
+	 * to its (largest) diameter in pixels */
+	double lod_scale;
+	/* Image to render into (see camera_view_generate()) */
+	real_t **image;
+
+	/* Whether to draw bricks smaller than a pixel as
+	 * single points (at the centroid of the brick, with
+	 * the total intensity of the brick) */
+	int lod;
+	/* Subset of the voxels to draw: runs of CAMERA_SUBSET_RUN
+	 * consecutive voxels (which are close in space, see
+	 * s3d_build_bricks()) number 'subset_first',
+	 * 'subset_first+subset_stride', ... of the voxel list.
+	 * Bricks drawn as single points are drawn with
+	 * 1/subset_stride of their intensity, so that drawing
+	 * each of the subsets once gives the same image as
+	 * drawing all voxels, and drawing some of them gives an
+	 * unbiased estimate of a fraction of it. A stride of 1
+	 * draws all voxels. */
+	size_t subset_first, subset_stride;
+	/* Number of threads to split the image across (each
+	 * accumulating a partial image of some of the voxels,
+	 * which are then summed), and buffers for the partial
+	 * images of all threads but the first (reused between
+	 * images) */
+	int threads;
+	real_t **partials;
+	size_t npartials, partial_size;
+	/* Whether to allocate the partial images on (transparent)
+	 * huge pages, and whether they are */
+	int huge, partials_huge;
+} camera_view_t;
+
+void camera_view_init(camera_view_t*, size_t, size_t, double, double[3], double[3]);
+void camera_view_place(camera_view_t*, double[3], double[3]);
+void camera_rotate(double, double[3], double[3], double[3], double[3]);
+void camera_view_free(camera_view_t*);
+real_t **camera_view_alloc_image(size_t, size_t);
+void camera_view_clear_image(camera_view_t*);
+void camera_view_generate(s3d_t*, camera_view_t*);
+void camera_view_generate_reference(s3d_t*, const camera_view_t*, double*);
+double camera_view_verify_kernel(s3d_t*, const camera_view_t*, size_t*);
+void camera_free_image(real_t**);
+void camera_generate_views(s3d_t*, camera_view_t*, size_t);
 void camera_get_extents(s3d_t*);
 
 #endif/*_CAMERA_H*/
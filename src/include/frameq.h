@@ -0,0 +1,42 @@
+#ifndef _FRAMEQ_H
+#define _FRAMEQ_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "real.h"
+
+typedef struct {
+	real_t **img;
+	size_t index;
+} frame_t;
+
+typedef struct {
+	frame_t *frames;
+	size_t nframes;
+	/* Size of the frame buffers, and whether they
+	 * are on huge pages */
+	size_t height, width;
+	int huge;
+
+	/* Stack of free frame buffers */
+	frame_t **free;
+	size_t nfree;
+
+	/* Ring buffer of rendered frames */
+	frame_t **queue;
+	size_t head, count;
+
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t has_free, has_frame;
+} frameq_t;
+
+frameq_t *frameq_new(size_t, size_t, size_t, int);
+void frameq_free(frameq_t*);
+frame_t *frameq_acquire(frameq_t*);
+void frameq_push(frameq_t*, frame_t*);
+frame_t *frameq_pop(frameq_t*);
+void frameq_release(frameq_t*, frame_t*);
+void frameq_close(frameq_t*);
+
+#endif/*_FRAMEQ_H*/
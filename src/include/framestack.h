@@ -0,0 +1,51 @@
+#ifndef _FRAMESTACK_H
+#define _FRAMESTACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "real.h"
+
+#define FRAMESTACK_MAGIC "S3DVRAWF"
+#define FRAMESTACK_VERSION 1
+#define FRAMESTACK_ENDIAN 0x01020304
+/* Size of header (frames start on a page boundary) */
+#define FRAMESTACK_HEADER_SIZE 4096
+
+/**
+ * Header of frame stack files. The header is followed
+ * (at byte 'offset') by 'nframes' images of 'height'
+ * times 'width' intensities each, stored row by row as
+ * single precision floats. Image 'k' is frame number
+ * 'first+k' of the video.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t endian, version;
+	uint64_t height, width;
+	uint64_t first, nframes;
+	uint64_t fps, offset;
+	/* Normalization used when rendering (maximum intensity
+	 * of the reference image, and intensity threshold) */
+	double max_intensity, threshold;
+} framestack_header_t;
+
+/**
+ * Frame stack file, open either for writing (frames
+ * are written in any order, by any thread) or reading.
+ */
+typedef struct {
+	char *filename;
+	int fd;
+	framestack_header_t h;
+	/* Size of one frame (in bytes) */
+	size_t framesize;
+} framestack_t;
+
+framestack_t *framestack_create(const char*, size_t, size_t, size_t, size_t, size_t);
+int framestack_write(framestack_t*, size_t, real_t**);
+int framestack_finish(framestack_t*, double, double);
+framestack_t *framestack_open(const char*);
+int framestack_read(framestack_t*, size_t, real_t**);
+void framestack_close(framestack_t*);
+
+#endif/*_FRAMESTACK_H*/
@@ -0,0 +1,35 @@
+#ifndef _PLACEMENT_H
+#define _PLACEMENT_H
+
+#include <stdlib.h>
+#include "real.h"
+#include "s3d.h"
+
+/* Size of (transparent) huge pages */
+#define PLACEMENT_HUGE_PAGE (2*1024*1024)
+/* Number of pages sampled when reporting placement */
+#define PLACEMENT_SAMPLES 1024
+
+/* Node argument of placement_alloc() */
+#define PLACEMENT_NODE_ANY -1
+#define PLACEMENT_NODE_INTERLEAVE -2
+
+/* How to place the volume on NUMA nodes (see --numa) */
+enum placement_mode {
+	PLACEMENT_DEFAULT,		/* Wherever it is first written */
+	PLACEMENT_INTERLEAVE,	/* Interleaved across all nodes */
+	PLACEMENT_REPLICATE		/* One copy on every node */
+};
+
+int placement_available(void);
+int placement_nodes(void);
+int placement_node_id(int);
+void *placement_alloc(size_t, int, int);
+void placement_free(void*, size_t, int);
+s3d_t **placement_place_volume(s3d_t*, enum placement_mode, int, int*);
+int placement_pin_thread(int, int);
+real_t **placement_alloc_image(size_t, size_t, int);
+void placement_free_image(real_t**, size_t, size_t, int);
+void placement_report(s3d_t**, int, enum placement_mode, int);
+
+#endif/*_PLACEMENT_H*/
@@ -0,0 +1,16 @@
+#ifndef _REAL_H
+#define _REAL_H
+
+#include "config.h"
+
+/* Floating-point type of the voxel list and of
+ * rendered images (see SINGLE_PRECISION) */
+#ifdef SINGLE_PRECISION
+typedef float real_t;
+#	define REAL_SQRT sqrtf
+#else
+typedef double real_t;
+#	define REAL_SQRT sqrt
+#endif
+
+#endif/*_REAL_H*/
@@ -0,0 +1,46 @@
+#ifndef _RESUME_H
+#define _RESUME_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RESUME_MAGIC "s3dvid-resume"
+#define RESUME_VERSION 1
+
+/* Initial value of hashes (FNV-1a offset basis) */
+#define RESUME_HASH_INIT 0xcbf29ce484222325ULL
+
+/* Frame recorded in a manifest */
+typedef struct {
+	size_t index;
+	uint64_t key, size;
+	/* Position in the manifest (later records take precedence) */
+	size_t seq;
+} resume_frame_t;
+
+/**
+ * Manifest of the frames written so far by runs with
+ * the same settings (see resume.c).
+ */
+typedef struct {
+	char *filename;
+	uint64_t settings;
+
+	/* Frames recorded by earlier runs (sorted by index) */
+	size_t n, capacity;
+	resume_frame_t *frames;
+
+	FILE *f;
+	pthread_mutex_t lock;
+} resume_t;
+
+uint64_t resume_hash(uint64_t, const void*, size_t);
+uint64_t resume_frame_key(resume_t*, size_t, double);
+resume_t *resume_open(const char*, uint64_t);
+int resume_is_done(resume_t*, size_t, uint64_t, const char*);
+int resume_record(resume_t*, size_t, uint64_t, const char*);
+void resume_close(resume_t*);
+
+#endif/*_RESUME_H*/
@@ -2,6 +2,22 @@
 #define _S3D_H
 
 #include <stdlib.h>
+#include "real.h"
+
+/* Number of grid cells along each side of a brick */
+#define S3D_BRICK_SIZE 8
+
+/**
+ * A brick of non-zero voxels (see s3d_build_bricks()).
+ * The voxels of the brick are stored at indices
+ * 'start' to 'start+count-1' of the voxel list.
+ */
+typedef struct {
+	size_t start, count;
+	double center[3], radius;	/* Bounding sphere */
+	double centroid[3];			/* Intensity-weighted centroid */
+	double sum;					/* Total intensity */
+} s3d_brick_t;
 
 typedef struct {
 	double ***data;
@@ -9,9 +25,40 @@ typedef struct {
 		   ymin, ymax,
 		   zmin, zmax;
 	size_t pixels;
+
+	/* Compacted list of non-zero voxels, stored
+	 * as a structure-of-arrays (see s3d_compact()) */
+	size_t nvoxels;
+	real_t *vx, *vy, *vz, *vi;
+
+	/* Non-empty bricks of the voxel list */
+	size_t nbricks;
+	s3d_brick_t *bricks;
+
+	/* Memory allocated for the data cube (if owned by
+	 * this object), and memory mapping holding the data
+	 * (if any) */
+	double *buffer;
+	void *map;
+	size_t mapsize;
 } s3d_t;
 
+s3d_t *s3d_new(void);
+double ***s3d_index(double*, size_t);
+void s3d_lock_library(void);
+void s3d_unlock_library(void);
 void s3d_center(s3d_t*, double[3]);
-s3d_t *loads3d(const char*);
+void s3d_compact(s3d_t*);
+void s3d_compact_planes(s3d_t*, const double*, size_t, size_t);
+void s3d_free_voxels(s3d_t*);
+void s3d_free_data(s3d_t*);
+void s3d_build_bricks(s3d_t*);
+size_t s3d_brick_layer(s3d_t*, double);
+s3d_t *loads3d(const char*, int);
+
+/* File format specific loaders */
+int s3d_is_hdf5(const char*);
+s3d_t *loads3d_hdf5(const char*, int);
+s3d_t *loads3d_mat(const char*);
 
 #endif/*_S3D_H*/
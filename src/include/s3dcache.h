@@ -0,0 +1,50 @@
+#ifndef _S3DCACHE_H
+#define _S3DCACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "s3d.h"
+
+#define S3DCACHE_MAGIC "S3DVCACH"
+#define S3DCACHE_VERSION 1
+#define S3DCACHE_ENDIAN 0x01020304
+/* Size of header (payload starts on a page boundary) */
+#define S3DCACHE_HEADER_SIZE 4096
+
+/* Prefixes of names of cache data held in shared memory
+ * or by an open file descriptor (see s3dcache_open()) */
+#define S3DCACHE_SHM_PREFIX "shm:"
+#define S3DCACHE_FD_PREFIX "fd:"
+
+/* Flags */
+#define S3DCACHE_SPARSE 0x1		/* Only non-zero voxels are stored */
+
+/**
+ * Header of s3dvid cache files. The header is followed
+ * (at byte 'offset') by either the full data cube
+ * (pixels^3 doubles), or, for sparse files, by the
+ * x, y, z and intensity arrays of the non-zero voxels
+ * (nvoxels doubles each).
+ */
+typedef struct {
+	char magic[8];
+	uint32_t endian, version;
+	uint32_t flags, reserved;
+	uint64_t pixels, nvoxels, offset;
+	double xmin, xmax,
+		   ymin, ymax,
+		   zmin, zmax;
+} s3dcache_header_t;
+
+int s3d_is_cache(const char*);
+int s3dcache_is_handle(const char*);
+int s3dcache_open(const char*, int);
+s3d_t *loads3d_cache(const char*);
+int s3d_save_cache(s3d_t*, const char*, int);
+
+size_t s3dcache_check_header(s3dcache_header_t*, const char*);
+s3d_t *s3dcache_attach(void*, size_t, const char*);
+void s3dcache_header(s3d_t*, int, s3dcache_header_t*);
+int s3dcache_write_payload(s3d_t*, int, FILE*);
+
+#endif/*_S3DCACHE_H*/
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include "real.h"
 
 typedef struct {
 	uint8_t red, green, blue;
@@ -12,8 +13,25 @@ typedef struct {
 	size_t width, height;
 } bitmap_t;
 
-void set_png_threshold(double);
-int saveimg(double**, size_t, size_t, const char*);
-int savepng(bitmap_t*, const char*);
+/* Number of entries in the colormap lookup table */
+#define COLORMAP_LUT_SIZE 4096
+/* Number of pixels converted to table indices at a time */
+#define COLORMAP_BLOCK 256
+
+/* Let libpng choose the filter for each row */
+#define PNG_OPT_FILTER_DEFAULT -1
+
+/* PNG encoder settings (see png_options_init()) */
+typedef struct {
+	int level, filter, rle, strips;
+} png_options_t;
+
+void png_options_init(png_options_t*, int, int, int, int);
+void colormap_init(void);
+void colormap_image_threshold(real_t**, size_t, size_t, double, bitmap_t*);
+bitmap_t *thread_bitmap_threshold(real_t**, size_t, size_t, double);
+void freebitmap(bitmap_t*);
+int saveimg_options(real_t**, size_t, size_t, double, const png_options_t*, const char*);
+int savepng_options(bitmap_t*, const png_options_t*, const char*);
 
 #endif/*_S3DPNG_H*/
@@ -0,0 +1,59 @@
+#ifndef _S3DSLAB_H
+#define _S3DSLAB_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "s3d.h"
+
+/**
+ * Reader of slabs of planes (along x) of a dense S3D
+ * data cube, which is never loaded into memory as a
+ * whole. 's' holds the size and bounds of the volume.
+ */
+typedef struct s3d_slab_reader {
+	s3d_t *s;
+
+	/* Read planes 'first' to 'first+n-1' into a buffer */
+	int (*read)(struct s3d_slab_reader*, size_t, size_t, double*);
+	void (*close)(struct s3d_slab_reader*);
+
+	/* Cache files: file descriptor and offset of the data cube */
+	int fd;
+	off_t offset;
+	/* Format specific state (e.g. HDF5 handles) */
+	void *priv;
+} s3d_slab_reader_t;
+
+/**
+ * A slab of the volume, as a list of non-zero voxels
+ * divided into bricks (in 's'), loaded either directly
+ * or in the background (see s3d_slab_prefetch()).
+ */
+typedef struct {
+	s3d_slab_reader_t *r;
+	size_t first, n;
+	s3d_t *s;
+
+	/* Raw planes, with room for 'capacity' planes */
+	double *buf;
+	size_t capacity;
+
+	pthread_t thread;
+	int running, err;
+} s3d_slab_t;
+
+s3d_slab_reader_t *s3d_slab_open(const char*);
+void s3d_slab_close(s3d_slab_reader_t*);
+size_t s3d_slab_plane_bytes(size_t);
+size_t s3d_slab_plan(s3d_slab_reader_t*, size_t, size_t**);
+s3d_slab_t *s3d_slab_new(s3d_slab_reader_t*, size_t);
+int s3d_slab_load(s3d_slab_t*, size_t, size_t);
+void s3d_slab_prefetch(s3d_slab_t*, size_t, size_t);
+int s3d_slab_wait(s3d_slab_t*);
+void s3d_slab_free(s3d_slab_t*);
+
+/* File format specific readers */
+int s3d_slab_open_hdf5(const char*, s3d_slab_reader_t*);
+
+#endif/*_S3DSLAB_H*/
@@ -0,0 +1,60 @@
+#ifndef _S3DVID_H
+#define _S3DVID_H
+
+/**
+ * Interface of libs3dvid, for rendering S3D volumes
+ * from within another program. All state is held in
+ * the objects below, so that any number of volumes,
+ * cameras and frames may be used at the same time, from
+ * any thread (as long as each camera and frame is only
+ * used by one thread at a time). A volume may be shared
+ * by any number of threads.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "camera.h"
+#include "real.h"
+#include "s3d.h"
+#include "s3dpng.h"
+
+/* Volume, as a list of non-zero voxels divided into bricks */
+typedef struct {
+	s3d_t *s;
+	/* Center of the volume (about which cameras orbit) */
+	double center[3];
+} s3dvid_volume_t;
+
+/**
+ * Camera. The settings in 'view' (e.g. 'view.lod' and
+ * 'view.threads') may be changed between renders.
+ */
+typedef struct {
+	camera_view_t view;
+} s3dvid_camera_t;
+
+/* Frame buffer, holding the (unnormalized) intensity of every pixel */
+typedef struct {
+	size_t height, width;
+	real_t **image;
+} s3dvid_frame_t;
+
+s3dvid_volume_t *s3dvid_volume_load(const char*, int);
+s3dvid_volume_t *s3dvid_volume_new(const double*, size_t, const double[6]);
+void s3dvid_volume_free(s3dvid_volume_t*);
+
+s3dvid_camera_t *s3dvid_camera_new(size_t, size_t, double, double[3], double[3]);
+void s3dvid_camera_place(s3dvid_camera_t*, double[3], double[3]);
+void s3dvid_camera_orbit(s3dvid_camera_t*, s3dvid_volume_t*, double[3], double[3], double[3], double);
+void s3dvid_camera_free(s3dvid_camera_t*);
+
+s3dvid_frame_t *s3dvid_frame_new(size_t, size_t);
+void s3dvid_frame_clear(s3dvid_frame_t*);
+double s3dvid_frame_max(const s3dvid_frame_t*);
+void s3dvid_frame_rgb(const s3dvid_frame_t*, double, uint8_t*);
+int s3dvid_frame_save_png(const s3dvid_frame_t*, double, const png_options_t*, const char*);
+void s3dvid_frame_free(s3dvid_frame_t*);
+
+int s3dvid_render(s3dvid_volume_t*, s3dvid_camera_t*, s3dvid_frame_t*);
+
+#endif/*_S3DVID_H*/
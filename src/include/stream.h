@@ -0,0 +1,36 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "s3dpng.h"
+
+enum stream_format {
+	STREAM_Y4M,		/* YUV4MPEG2, 4:2:0 chroma subsampling */
+	STREAM_RGB		/* Raw RGB24 frames, without header */
+};
+
+typedef struct {
+	FILE *f;
+	enum stream_format format;
+	size_t width, height, framesize;
+	int failed;
+
+	/* Reorder buffer. Frame 'i' is stored in
+	 * slot 'i % capacity' until all frames
+	 * before it have been written. */
+	size_t next, capacity;
+	uint8_t **slots;
+	int *ready;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} stream_t;
+
+stream_t *stream_open(FILE*, enum stream_format, size_t, size_t, size_t, size_t);
+void stream_rgb2yuv420(const pixel_t*, size_t, size_t, uint8_t*);
+int stream_write(stream_t*, size_t, const pixel_t*);
+int stream_close(stream_t*, size_t);
+
+#endif/*_STREAM_H*/
@@ -0,0 +1,40 @@
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Stages of rendering which are timed */
+enum timing_stage {
+	TIMING_LOAD,			/* Reading the S3D file */
+	TIMING_COMPACT,			/* Building the voxel list and bricks */
+	TIMING_EXTENTS,			/* camera_get_extents() */
+	TIMING_MAX_INTENSITY,	/* Rendering the reference frame */
+	TIMING_RENDER,			/* Rendering frames */
+	TIMING_COLORMAP,		/* Converting frames to RGB */
+	TIMING_ENCODE,			/* PNG compression (or YUV conversion) */
+	TIMING_WRITE,			/* Writing files (or the output stream) */
+	TIMING_WAIT,			/* Waiting for frame buffers or the stream */
+	TIMING_NSTAGES
+};
+
+/* Quantities which are counted */
+enum timing_counter {
+	TIMING_VOXELS,			/* Voxels drawn (after culling) */
+	TIMING_FRAMES,			/* Frames written */
+	TIMING_BYTES_READ,		/* Size of input files */
+	TIMING_BYTES_WRITTEN,	/* Bytes written to output files */
+	TIMING_NCOUNTERS
+};
+
+void timing_init(void);
+void timing_enable_trace(void);
+double timing_now(void);
+void timing_thread_name(const char*);
+void timing_add(enum timing_stage, double);
+void timing_count(enum timing_counter, size_t);
+size_t timing_peak_memory(void);
+void timing_summary(FILE*);
+int timing_write_trace(const char*);
+
+#endif/*_TIMING_H*/
@@ -1,18 +1,88 @@
 /* Space3D video generator */
 
+#include <errno.h>
+#include <getopt.h>
 #include <math.h>
 #include <omp.h>
+#include <png.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "camera.h"
+#include "frameq.h"
+#include "framestack.h"
+#include "placement.h"
+#include "resume.h"
 #include "s3d.h"
+#include "s3dcache.h"
 #include "s3dpng.h"
+#include "s3dslab.h"
+#include "stream.h"
+#include "timing.h"
 
 #define PI (3.14159265359)
 
+/* Number of subsets of the voxels drawn one after the
+ * other in a preview (a power of 4, see render_preview()) */
+#define PREVIEW_SUBSETS 64
+/* Size of the blocks of pixels over which the maximum
+ * intensity of a preview is estimated (the square root
+ * of PREVIEW_SUBSETS, see preview_max_intensity()) */
+#define PREVIEW_BLOCK 8
+/* Time (in seconds) a server waits for a client to send
+ * (or accept) data before closing the connection */
+#define SERVE_TIMEOUT 30
+
+/* Ways of dividing threads among frames and voxels */
+enum parallel_mode {
+	PARALLEL_AUTO,		/* Choose based on number of frames, voxels and threads */
+	PARALLEL_FRAME,		/* One thread per frame */
+	PARALLEL_VOXEL,		/* All threads work on one frame at a time */
+	PARALLEL_NESTED		/* Several frames at a time, several threads per frame */
+};
+
+/* Long options without a short equivalent */
+enum long_option {
+	OPT_CAMERAS = 256,
+	OPT_FRAMES,
+	OPT_GLOBAL_MAX,
+	OPT_HUGE_PAGES,
+	OPT_LOD,
+	OPT_MAX_INTENSITY,
+	OPT_MEMORY_BUDGET,
+	OPT_NUMA,
+	OPT_PNG_FILTER,
+	OPT_PNG_LEVEL,
+	OPT_PNG_RLE,
+	OPT_PNG_STRIPS,
+	OPT_PREVIEW,
+	OPT_RESUME,
+	OPT_RETONE,
+	OPT_SAVE_RAW,
+	OPT_SERVE,
+	OPT_SHARD,
+	OPT_THRESHOLD,
+	OPT_TRACE
+};
+
+/* Additional camera (see --cameras) */
+struct camera {
+	char *outfile;
+	double location[3], direction[3];
+	double visang;
+	size_t height, width;
+	/* Intensity at the top of the colormap */
+	double threshold;
+};
+
 struct settings {
 	size_t fps, videolength;
 	size_t height, width;
@@ -22,33 +92,567 @@ struct settings {
 	char *infile, *outfile;
 	int draw_bounds;
 	double threshold;
+	/* Intensity at the top of the colormap (the maximum
+	 * intensity times the threshold) */
+	double top;
+
+	/* Command-line options */
+	int verify_kernel;
+	enum parallel_mode parallel;
+	int chunk;
+	int threads, encoders, queue;
+	char *convert;
+	int sparse;
+	int lod;
+	char *format;
+	char *trace;
+	/* PNG encoder settings (--png-*) */
+	png_options_t png;
+
+	/* Range of frames to render ('first' to 'last-1'),
+	 * given either directly or as shard 'shard' of
+	 * 'nshards' (see select_frames()) */
+	size_t first, last;
+	int last_set;
+	int shard, nshards;
+	/* Maximum intensity (if given with --max-intensity) */
+	double max_intensity;
+	/* Memory budget (in bytes) for out-of-core rendering,
+	 * or 0 to load the whole volume */
+	size_t memory_budget;
+	/* Factor by which to reduce the frame size in a
+	 * (progressive) preview, or 0 to render frames */
+	int preview;
+	/* Socket to serve requests on (or '-' for stdin) */
+	char *serve;
+	/* Frame stack to save the raw frames to (with
+	 * --save-raw), and the open stack */
+	char *saveraw;
+	framestack_t *raw;
+	/* Output file prefix when re-tone-mapping frame
+	 * stacks (--retone), the stacks, the threshold to
+	 * use instead of the stored one (or 0), and whether
+	 * to normalize by the maximum over all frames */
+	char *retone;
+	char **rawfiles;
+	int nrawfiles;
+	double retone_threshold;
+	int global_max;
+	/* Placement of the volume on NUMA nodes (with --numa),
+	 * whether to use huge pages, and the copies of the
+	 * volume (one per node if replicated) */
+	enum placement_mode numa;
+	int huge_pages;
+	s3d_t **volumes;
+	int nvolumes;
+
+	/* Frames to render (in order), leaving out frames
+	 * written by an earlier run (with --resume) */
+	size_t *todo, ntodo;
+	/* Manifest of written frames (with --resume), and
+	 * the key of each frame from 'first' to 'last-1' */
+	int resume;
+	resume_t *manifest;
+	uint64_t *keys;
+
+	/* Additional cameras, rendered in the same pass
+	 * over the voxels as the main camera */
+	char *camerafile;
+	struct camera *cameras;
+	size_t ncameras;
+
+	/* Output stream (if not writing PNG files) */
+	stream_t *stream;
 };
 
-struct timespec ticclock;
+/* Load statistics for one rendering thread */
+struct thread_stats {
+	size_t frames;
+	double render, busy, finished;
+};
 
-#pragma omp threadprivate(ticclock)
+/* Encoder thread (used with --encoders) */
+struct encoder {
+	pthread_t thread;
+	frameq_t *queue;
+	struct settings *set;
+	size_t frames;
+	double busy;
+};
 
-void tic(void) {
-	clock_gettime(CLOCK_REALTIME, &ticclock);
+void usage(const char *progname) {
+	printf("Usage: %s [options] < settings\n", progname);
+	printf("       %s --convert OUTFILE [--sparse] INFILE\n", progname);
+	printf("       %s --retone PREFIX [--threshold X] [--max-intensity X | --global-max] RAWFILE...\n\n", progname);
+	printf("Options:\n");
+	printf("      --cameras FILE   Render the view of every camera listed in FILE along\n");
+	printf("                       with the main camera, in a single pass over the voxels.\n");
+	printf("                       Each line of FILE holds the output file prefix, location\n");
+	printf("                       (x y z), direction (x y z), vision angle, height and\n");
+	printf("                       width of one camera. Only for PNG output.\n");
+	printf("  -c, --chunk N        Number of frames handed to a thread at a time (default: 1).\n");
+	printf("  -C, --convert FILE   Convert the S3D file INFILE to an s3dvid cache file FILE,\n");
+	printf("                       which can be loaded much faster than a MATLAB file.\n");
+	printf("                       FILE may be 'shm:NAME' to write to POSIX shared memory,\n");
+	printf("                       which can then be given as input file as well.\n");
+	printf("  -e, --encoders N     Number of threads to colormap, compress and write frames,\n");
+	printf("                       separately from the rendering threads. If 0 (default),\n");
+	printf("                       each frame is written by the thread which rendered it.\n");
+	printf("  -f, --format FORMAT  Output format: 'png' (default) writes one PNG file per\n");
+	printf("                       frame. 'y4m' (YUV4MPEG2) and 'rgb' (raw RGB24) write all\n");
+	printf("                       frames, in order, to a single stream. The output file\n");
+	printf("                       name is then used as is, with '-' meaning stdout.\n");
+	printf("      --frames A:B     Only render frames A to B-1 (counting from 0) of the\n");
+	printf("                       video. Either end may be left out.\n");
+	printf("      --global-max     Normalize re-tone-mapped frames (with --retone) by the\n");
+	printf("                       maximum intensity over all frames, rather than by that\n");
+	printf("                       of the reference image.\n");
+	printf("  -h, --help           Show this help message and exit.\n");
+	printf("      --huge-pages     Keep the volume and frame buffers in (transparent)\n");
+	printf("                       huge pages, where the system allows.\n");
+	printf("      --lod            Draw groups of voxels which are smaller than a pixel\n");
+	printf("                       in the image as a single point (faster, approximate).\n");
+	printf("      --max-intensity X\n");
+	printf("                       Maximum intensity of the reference image, as printed\n");
+	printf("                       by an earlier run (skips computing it).\n");
+	printf("      --memory-budget SIZE\n");
+	printf("                       Render without loading the whole volume, reading it\n");
+	printf("                       in slabs and using at most about SIZE bytes of memory\n");
+	printf("                       (suffixes K, M, G and T are accepted).\n");
+	printf("      --numa MODE      Place the volume on the NUMA nodes of the system:\n");
+	printf("                       'interleave' (across all nodes) or 'replicate' (a\n");
+	printf("                       copy on every node), and pin rendering threads to\n");
+	printf("                       nodes.\n");
+	printf("  -p, --parallel MODE  How to divide threads among frames. MODE is one of\n");
+	printf("                       'auto' (default), 'frame' (one thread per frame),\n");
+	printf("                       'voxel' (all threads render each frame) or 'nested'\n");
+	printf("                       (several frames at a time, several threads per frame).\n");
+	printf("      --png-filter F   PNG row filter: 'none', 'sub', 'up', 'avg', 'paeth' or\n");
+	printf("                       'all' (default; choose the best filter for each row).\n");
+	printf("      --png-level N    zlib compression level of PNG files, from 0 (no\n");
+	printf("                       compression, fastest) to 9 (smallest files).\n");
+	printf("      --png-rle        Compress PNG files using run-length encoding only.\n");
+	printf("      --png-strips N   Split PNG images into N strips which are compressed\n");
+	printf("                       in parallel (default: 1).\n");
+	printf("      --preview N      Quickly render a preview of the frames, at 1/N of the\n");
+	printf("                       frame size, refining each frame from a small subset of\n");
+	printf("                       the voxels to all of them.\n");
+	printf("  -q, --queue N        Maximum number of frames held in memory when using\n");
+	printf("                       separate encoder threads (default: twice the total\n");
+	printf("                       number of threads).\n");
+	printf("      --resume         Keep a record of the frames written, and skip frames\n");
+	printf("                       already written (with the same settings) by an\n");
+	printf("                       earlier, interrupted run. Only for PNG output.\n");
+	printf("      --retone PREFIX  Colormap the raw frames of the frame stacks RAWFILE\n");
+	printf("                       (written with --save-raw) again, without rendering,\n");
+	printf("                       writing them to PREFIX (as with --format).\n");
+	printf("      --save-raw FILE  Also save the raw (unnormalized) intensity of every\n");
+	printf("                       frame to the frame stack FILE, as single precision\n");
+	printf("                       floats, so that they can be colormapped again using\n");
+	printf("                       --retone.\n");
+	printf("      --serve SOCKET   Load the volume once, and then render the requests\n");
+	printf("                       received on the Unix domain socket SOCKET (or on\n");
+	printf("                       stdin, after the settings, if SOCKET is '-').\n");
+	printf("      --shard K/N      Split the video into N parts of consecutive frames, and\n");
+	printf("                       only render part K (counting from 0).\n");
+	printf("  -s, --sparse         Only store non-zero voxels in the cache file (with --convert).\n");
+	printf("  -t, --threads N      Number of rendering threads (default: OMP_NUM_THREADS).\n");
+	printf("      --threshold X    Intensity threshold (fraction of the maximum intensity\n");
+	printf("                       at the top of the colormap) to use with --retone,\n");
+	printf("                       instead of the one used when rendering.\n");
+	printf("      --trace FILE     Write the time spent by each thread in each stage of\n");
+	printf("                       rendering to FILE, as JSON (if the name ends with\n");
+	printf("                       '.json') or CSV.\n");
+	printf("  -V, --verify-kernel  Check the vectorized projection kernel against\n");
+	printf("                       the scalar reference kernel before rendering.\n");
 }
-double toc(void) {
-	struct timespec tocclock;
-	if (!clock_gettime(CLOCK_REALTIME, &tocclock)) {
-		long ds = tocclock.tv_sec - ticclock.tv_sec;
-		long dn = tocclock.tv_nsec - ticclock.tv_nsec;
-		return (((double)ds) + ((double)dn)/1e9);
-	} else return NAN;
+
+/**
+ * Parse the integer argument 'arg' to the command-line
+ * option 'opt', and check that it is at least 'min'.
+ */
+int parse_int(const char *opt, const char *arg, int min) {
+	char *end;
+	long v = strtol(arg, &end, 10);
+
+	if (*arg == 0 || *end != 0 || v < min) {
+		fprintf(stderr, "ERROR: Invalid value of option '%s': '%s'.\n", opt, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return (int)v;
 }
 
 /**
- * Read settings
+ * Parse the (positive) floating-point argument 'arg'
+ * to the command-line option 'opt'.
+ */
+double parse_double(const char *opt, const char *arg) {
+	char *end;
+	double v = strtod(arg, &end);
+
+	if (*arg == 0 || *end != 0 || !(v > 0) || isinf(v)) {
+		fprintf(stderr, "ERROR: Invalid value of option '%s': '%s'.\n", opt, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return v;
+}
+
+/**
+ * Parse the size (in bytes, with an optional binary
+ * suffix K, M, G or T) given as argument 'arg' to the
+ * command-line option 'opt'.
+ */
+size_t parse_size(const char *opt, const char *arg) {
+	char *end;
+	double v = strtod(arg, &end);
+	const char *suffixes = "KMGT", *p;
+
+	if (*end != 0 && end[1] == 0 && (p = strchr(suffixes, end[0] & ~0x20)) != NULL) {
+		v *= pow(1024.0, (p - suffixes) + 1);
+		end++;
+	}
+
+	if (*arg == 0 || *end != 0 || !(v >= 1) || v > 1e19) {
+		fprintf(stderr, "ERROR: Invalid value of option '%s': '%s'.\n", opt, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return (size_t)v;
+}
+
+/**
+ * Parse the argument 'A:B' of option --frames.
+ * Returns non-zero if it is invalid.
+ */
+int parse_frames(struct settings *s, const char *arg) {
+	char *end;
+	const char *p = arg;
+
+	s->first = 0;
+	if (*p != ':') {
+		s->first = strtoul(p, &end, 10);
+		if (end == p || *p == '-') return -1;
+		p = end;
+	}
+	if (*p++ != ':') return -1;
+
+	s->last_set = (*p != 0);
+	if (s->last_set) {
+		s->last = strtoul(p, &end, 10);
+		if (*end != 0 || *p == '-' || s->last <= s->first) return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse the argument 'K/N' of option --shard.
+ */
+void parse_shard(struct settings *s, const char *arg) {
+	if (sscanf(arg, "%d/%d", &s->shard, &s->nshards) != 2 ||
+		s->nshards < 1 || s->shard < 0 || s->shard >= s->nshards) {
+		fprintf(stderr, "ERROR: Invalid value of option '--shard': '%s'.\n", arg);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Parse command-line options. Returns a settings
+ * object with all options set, to be completed by
+ * 'read_settings()'.
  */
-struct settings *read_settings(void) {
+struct settings *parse_options(int argc, char *argv[]) {
 	struct settings *s;
+	int c, png_level = -1, png_filter = PNG_OPT_FILTER_DEFAULT, png_rle = 0, png_strips = 1;
+	static struct option long_options[] = {
+		{"cameras",       required_argument, NULL, OPT_CAMERAS},
+		{"chunk",         required_argument, NULL, 'c'},
+		{"convert",       required_argument, NULL, 'C'},
+		{"encoders",      required_argument, NULL, 'e'},
+		{"format",        required_argument, NULL, 'f'},
+		{"frames",        required_argument, NULL, OPT_FRAMES},
+		{"global-max",    no_argument, NULL, OPT_GLOBAL_MAX},
+		{"huge-pages",    no_argument, NULL, OPT_HUGE_PAGES},
+		{"help",          no_argument, NULL, 'h'},
+		{"lod",           no_argument, NULL, OPT_LOD},
+		{"max-intensity", required_argument, NULL, OPT_MAX_INTENSITY},
+		{"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+		{"numa",          required_argument, NULL, OPT_NUMA},
+		{"parallel",      required_argument, NULL, 'p'},
+		{"png-filter",    required_argument, NULL, OPT_PNG_FILTER},
+		{"png-level",     required_argument, NULL, OPT_PNG_LEVEL},
+		{"png-rle",       no_argument, NULL, OPT_PNG_RLE},
+		{"png-strips",    required_argument, NULL, OPT_PNG_STRIPS},
+		{"preview",       required_argument, NULL, OPT_PREVIEW},
+		{"queue",         required_argument, NULL, 'q'},
+		{"resume",        no_argument, NULL, OPT_RESUME},
+		{"retone",        required_argument, NULL, OPT_RETONE},
+		{"save-raw",      required_argument, NULL, OPT_SAVE_RAW},
+		{"serve",         required_argument, NULL, OPT_SERVE},
+		{"shard",         required_argument, NULL, OPT_SHARD},
+		{"sparse",        no_argument, NULL, 's'},
+		{"threads",       required_argument, NULL, 't'},
+		{"threshold",     required_argument, NULL, OPT_THRESHOLD},
+		{"trace",         required_argument, NULL, OPT_TRACE},
+		{"verify-kernel", no_argument, NULL, 'V'},
+		{NULL, 0, NULL, 0}
+	};
+
+	s = malloc(sizeof(struct settings));
+	s->verify_kernel = 0;
+	s->parallel = PARALLEL_AUTO;
+	s->chunk = 1;
+	s->threads = omp_get_max_threads();
+	s->encoders = 0;
+	s->queue = 0;
+	s->convert = NULL;
+	s->sparse = 0;
+	s->lod = 0;
+	s->infile = NULL;
+	s->format = "png";
+	s->trace = NULL;
+	s->camerafile = NULL;
+	s->cameras = NULL;
+	s->ncameras = 0;
+	s->first = 0;
+	s->last_set = 0;
+	s->shard = 0;
+	s->nshards = 0;
+	s->max_intensity = 0.0;
+	s->memory_budget = 0;
+	s->preview = 0;
+	s->serve = NULL;
+	s->saveraw = NULL;
+	s->raw = NULL;
+	s->retone = NULL;
+	s->rawfiles = NULL;
+	s->nrawfiles = 0;
+	s->retone_threshold = 0.0;
+	s->global_max = 0;
+	s->numa = PLACEMENT_DEFAULT;
+	s->huge_pages = 0;
+	s->volumes = NULL;
+	s->nvolumes = 0;
+	s->todo = NULL;
+	s->ntodo = 0;
+	s->resume = 0;
+	s->manifest = NULL;
+	s->keys = NULL;
+	s->stream = NULL;
+
+	while ((c = getopt_long(argc, argv, "c:C:e:f:hp:q:st:V", long_options, NULL)) != -1) {
+		switch (c) {
+			case OPT_CAMERAS:
+				s->camerafile = optarg;
+				break;
+			case 'c':
+				s->chunk = parse_int("--chunk", optarg, 1);
+				break;
+			case 'C':
+				s->convert = optarg;
+				break;
+			case 'e':
+				s->encoders = parse_int("--encoders", optarg, 0);
+				break;
+			case 'f':
+				if (strcmp(optarg, "png") && strcmp(optarg, "y4m") && strcmp(optarg, "rgb")) {
+					fprintf(stderr, "ERROR: Unrecognized output format: '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				s->format = optarg;
+				break;
+			case OPT_FRAMES:
+				if (parse_frames(s, optarg)) {
+					fprintf(stderr, "ERROR: Invalid value of option '--frames': '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_GLOBAL_MAX:
+				s->global_max = 1;
+				break;
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+			case OPT_HUGE_PAGES:
+				s->huge_pages = 1;
+				break;
+			case OPT_LOD:
+				s->lod = 1;
+				break;
+			case OPT_MAX_INTENSITY:
+				s->max_intensity = parse_double("--max-intensity", optarg);
+				break;
+			case OPT_MEMORY_BUDGET:
+				s->memory_budget = parse_size("--memory-budget", optarg);
+				break;
+			case OPT_NUMA:
+				if (!strcmp(optarg, "interleave")) s->numa = PLACEMENT_INTERLEAVE;
+				else if (!strcmp(optarg, "replicate")) s->numa = PLACEMENT_REPLICATE;
+				else {
+					fprintf(stderr, "ERROR: Invalid value of option '--numa': '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				if (!strcmp(optarg, "auto")) s->parallel = PARALLEL_AUTO;
+				else if (!strcmp(optarg, "frame")) s->parallel = PARALLEL_FRAME;
+				else if (!strcmp(optarg, "voxel")) s->parallel = PARALLEL_VOXEL;
+				else if (!strcmp(optarg, "nested")) s->parallel = PARALLEL_NESTED;
+				else {
+					fprintf(stderr, "ERROR: Unrecognized parallelization mode: '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_PNG_FILTER:
+				if (!strcmp(optarg, "all")) png_filter = PNG_OPT_FILTER_DEFAULT;
+				else if (!strcmp(optarg, "none")) png_filter = PNG_FILTER_VALUE_NONE;
+				else if (!strcmp(optarg, "sub")) png_filter = PNG_FILTER_VALUE_SUB;
+				else if (!strcmp(optarg, "up")) png_filter = PNG_FILTER_VALUE_UP;
+				else if (!strcmp(optarg, "avg")) png_filter = PNG_FILTER_VALUE_AVG;
+				else if (!strcmp(optarg, "paeth")) png_filter = PNG_FILTER_VALUE_PAETH;
+				else {
+					fprintf(stderr, "ERROR: Unrecognized PNG filter: '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_PNG_LEVEL:
+				png_level = parse_int("--png-level", optarg, 0);
+				if (png_level > 9) {
+					fprintf(stderr, "ERROR: Invalid value of option '--png-level': '%s'.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_PNG_RLE:
+				png_rle = 1;
+				break;
+			case OPT_PNG_STRIPS:
+				png_strips = parse_int("--png-strips", optarg, 1);
+				break;
+			case OPT_PREVIEW:
+				s->preview = parse_int("--preview", optarg, 1);
+				break;
+			case 'q':
+				s->queue = parse_int("--queue", optarg, 1);
+				break;
+			case OPT_RESUME:
+				s->resume = 1;
+				break;
+			case OPT_RETONE:
+				s->retone = optarg;
+				break;
+			case OPT_SAVE_RAW:
+				s->saveraw = optarg;
+				break;
+			case OPT_SERVE:
+				s->serve = optarg;
+				break;
+			case OPT_SHARD:
+				parse_shard(s, optarg);
+				break;
+			case 's':
+				s->sparse = 1;
+				break;
+			case 't':
+				s->threads = parse_int("--threads", optarg, 1);
+				break;
+			case OPT_THRESHOLD:
+				s->retone_threshold = parse_double("--threshold", optarg);
+				break;
+			case OPT_TRACE:
+				s->trace = optarg;
+				timing_enable_trace();
+				break;
+			case 'V':
+				s->verify_kernel = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	png_options_init(&s->png, png_level, png_filter, png_rle, png_strips);
+
+	if (s->nshards > 0 && (s->first > 0 || s->last_set)) {
+		fprintf(stderr, "ERROR: Options '--frames' and '--shard' cannot be combined.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->resume && (strcmp(s->format, "png") || s->camerafile != NULL)) {
+		fprintf(stderr, "ERROR: Option '--resume' can only be used with PNG output, without '--cameras'.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (s->resume && s->memory_budget > 0 && s->max_intensity <= 0) {
+		fprintf(stderr, "ERROR: Option '--resume' requires '--max-intensity' when used with '--memory-budget'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->serve != NULL && (strcmp(s->format, "png") || s->camerafile != NULL ||
+		s->memory_budget > 0 || s->resume)) {
+		fprintf(stderr, "ERROR: Option '--serve' can only be used with PNG output, without '--cameras', '--memory-budget' and '--resume'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->preview > 0 && (strcmp(s->format, "png") || s->camerafile != NULL || s->encoders > 0 ||
+		s->memory_budget > 0 || s->resume || s->serve != NULL)) {
+		fprintf(stderr, "ERROR: Option '--preview' can only be used with PNG output, without '--cameras', '--encoders', '--memory-budget', '--resume' and '--serve'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->saveraw != NULL && (s->resume || s->serve != NULL || s->preview > 0)) {
+		fprintf(stderr, "ERROR: Option '--save-raw' cannot be combined with '--preview', '--resume' and '--serve'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((s->numa != PLACEMENT_DEFAULT || s->huge_pages) && s->memory_budget > 0) {
+		fprintf(stderr, "ERROR: Options '--numa' and '--huge-pages' cannot be combined with '--memory-budget'.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (s->numa != PLACEMENT_DEFAULT && !placement_available()) {
+		fprintf(stderr, "ERROR: Option '--numa' is not available (s3dvid was compiled without libnuma, or the system does not support NUMA).\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->retone == NULL && (s->global_max || s->retone_threshold > 0)) {
+		fprintf(stderr, "ERROR: Options '--global-max' and '--threshold' can only be used with '--retone'.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (s->global_max && s->max_intensity > 0) {
+		fprintf(stderr, "ERROR: Options '--global-max' and '--max-intensity' cannot be combined.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s->retone != NULL) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		s->rawfiles = argv + optind;
+		s->nrawfiles = argc - optind;
+	}
+
+	if (s->convert != NULL) {
+		if (optind != argc-1) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		s->infile = argv[optind];
+	}
+
+	return s;
+}
+
+/**
+ * Read settings
+ */
+void read_settings(struct settings *s) {
 	const int strmaxlen = 1024;
 	long l;
 
-	s = malloc(sizeof(struct settings));
 	s->infile  = malloc(sizeof(char)*(strmaxlen+1));
 	s->outfile = malloc(sizeof(char)*(strmaxlen+1));
 
@@ -99,47 +703,110 @@ struct settings *read_settings(void) {
 	printf("Intensity threshold: ");
 	scanf("%lf", &s->threshold);
 	printf("(%lf)\n", s->threshold);
+}
 
-	return s;
+/**
+ * Read the list of additional cameras from the file
+ * given with --cameras. Empty lines, and lines starting
+ * with '#', are ignored.
+ */
+void read_cameras(struct settings *s) {
+	char line[1024], name[1024];
+	size_t capacity = 0, lineno = 0;
+	struct camera *c;
+	FILE *f;
+
+	f = fopen(s->camerafile, "r");
+	if (f == NULL) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to open camera file: %s.\n", s->camerafile);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (sscanf(line, " %1023s", name) != 1 || name[0] == '#')
+			continue;
+
+		if (s->ncameras == capacity) {
+			capacity = capacity > 0 ? 2*capacity : 8;
+			s->cameras = realloc(s->cameras, sizeof(struct camera)*capacity);
+		}
+
+		c = s->cameras + s->ncameras;
+		if (sscanf(line, " %1023s %lf %lf %lf %lf %lf %lf %lf %zu %zu",
+				name, c->location, c->location+1, c->location+2,
+				c->direction, c->direction+1, c->direction+2,
+				&c->visang, &c->height, &c->width) != 10 ||
+			c->height == 0 || c->width == 0) {
+			fprintf(stderr, "ERROR: %s:%zu: Invalid camera.\n", s->camerafile, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		c->outfile = strdup(name);
+		s->ncameras++;
+	}
+
+	fclose(f);
+
+	printf("Additional cameras: %zu\n", s->ncameras);
 }
 
+#ifdef SINGLE_PRECISION
 /**
- * Rotate a vector
+ * Compare the single-precision image 'img' to the same
+ * image rendered in double precision (with the scalar
+ * reference kernel, and without level of detail), and
+ * report the largest deviation.
+ *
+ * cv: Camera which rendered 'img'.
+ * mx: Maximum intensity of 'img'.
  */
-void rotate2(double angle, double v1[3], double v2[3], double origin[3], double axis[3]) {
-	double n, s, c, ux, uy, uz, tx, ty, tz, vx, vy, vz, R[3][3];
-	n = hypot(axis[0], hypot(axis[1], axis[2]));
-	ux = axis[0] / n;
-	uy = axis[1] / n;
-	uz = axis[2] / n;
+void report_precision(s3d_t *s, struct settings *set, camera_view_t *cv, real_t **img, double mx) {
+	size_t npix = set->height*set->width, p;
+	double *ref = calloc(npix, sizeof(double)), d, maxdev = 0.0;
 
-	vx = v1[0]-origin[0];
-	vy = v1[1]-origin[1];
-	vz = v1[2]-origin[2];
-	
-	s = sin(angle), c = cos(angle);
-	R[0][0] = (c+ux*ux*(1-c));    R[0][1] = (ux*uy*(1-c)-uz*s); R[0][2] = (ux*uz*(1-c)+uy*s);
-	R[1][0] = (uy*ux*(1-c)+uz*s); R[1][1] = (c+uy*uy*(1-c));    R[1][2] = (uy*uz*(1-c)+ux*s);
-	R[2][0] = (uz*ux*(1-c)+uy*s); R[2][1] = (uz*uy*(1-c)+ux*s); R[2][2] = (c+uz*uz*(1-c));
+	camera_view_generate_reference(s, cv, ref);
+
+	for (p = 0; p < npix; p++) {
+		d = fabs(img[0][p] - ref[p]);
+		if (d > maxdev) maxdev = d;
+	}
 
-	tx = R[0][0]*vx + R[0][1]*vy + R[0][2]*vz  + origin[0];
-	ty = R[1][0]*vx + R[1][1]*vy + R[1][2]*vz  + origin[1];
-	tz = R[2][0]*vx + R[2][1]*vy + R[2][2]*vz  + origin[2];
-	v1[0]=tx; v1[1]=ty; v1[2]=tz;
+	printf("Single precision: max deviation from double precision %.3e (%.3e of the colormap range).\n",
+		maxdev, maxdev / (mx*set->threshold));
 
-	tx = R[0][0]*v2[0] + R[0][1]*v2[1] + R[0][2]*v2[2];
-	ty = R[1][0]*v2[0] + R[1][1]*v2[1] + R[1][2]*v2[2];
-	tz = R[2][0]*v2[0] + R[2][1]*v2[1] + R[2][2]*v2[2];
-	v2[0]=tx; v2[1]=ty; v2[2]=tz;
+	free(ref);
+}
+#endif
+
+/**
+ * Set up the main camera 'cv' in its initial position,
+ * splitting each image across 'threads' threads.
+ */
+void init_main_view(struct settings *set, camera_view_t *cv, int threads) {
+	camera_view_init(cv, set->height, set->width, set->visang, set->location, set->direction);
+	cv->lod = set->lod;
+	cv->threads = threads;
+	cv->huge = set->huge_pages;
 }
 
-void find_max_intensity(s3d_t *s, struct settings *set) {
-	double **tmpimg, mx = 0.0;
+/**
+ * Render the reference image (from the initial camera
+ * position, using 'threads' threads) and return its
+ * maximum intensity, by which frames are normalized.
+ */
+double find_max_intensity(s3d_t *s, struct settings *set, int threads) {
+	camera_view_t cv;
+	real_t **tmpimg;
+	double mx = 0.0;
 	size_t i, j;
 
-	camera_new_image();
-	camera_init_local(set->location, set->direction);
-	tmpimg = camera_generate(s);
+	double t0 = timing_now();
+
+	init_main_view(set, &cv, threads);
+	tmpimg = cv.image = camera_view_alloc_image(set->height, set->width);
+	camera_view_generate(s, &cv);
 
 	for (i = 0; i < set->height; i++) {
 		for (j = 0; j < set->width; j++) {
@@ -148,17 +815,120 @@ void find_max_intensity(s3d_t *s, struct settings *set) {
 		}
 	}
 
-	camera_destroy_image();
+	timing_add(TIMING_MAX_INTENSITY, t0);
+	printf("Maximum intensity: %.17g\n", mx);
 
-	if (mx <= 0) {
-		fprintf(stderr, "ERROR: Maximum value of reference image is %e\n", mx);
-		exit(EXIT_FAILURE);
+#ifdef SINGLE_PRECISION
+	report_precision(s, set, &cv, tmpimg, mx);
+#endif
+
+	camera_free_image(tmpimg);
+	camera_view_free(&cv);
+
+	return mx;
+}
+
+/**
+ * Set up the cameras 'views' for the frame at the given
+ * angle of rotation, and clear their images. The first
+ * view is the main camera, followed by the additional
+ * cameras (see --cameras), or only the additional
+ * cameras if 'main' is zero.
+ *
+ * images: Image to render into, for each view.
+ */
+void init_views(
+	struct settings *set, camera_view_t *views, real_t ***images,
+	int main, double angle, double centerpoint[3]
+) {
+	size_t k, n = set->ncameras + (main ? 1 : 0);
+	double loc[3], dir[3], visang;
+	size_t height, width;
+	struct camera *c;
+
+	for (k = 0; k < n; k++) {
+		if (main && k == 0) {
+			memcpy(loc, set->location, sizeof(loc));
+			memcpy(dir, set->direction, sizeof(dir));
+			visang = set->visang, height = set->height, width = set->width;
+		} else {
+			c = set->cameras + k - (main ? 1 : 0);
+			memcpy(loc, c->location, sizeof(loc));
+			memcpy(dir, c->direction, sizeof(dir));
+			visang = c->visang, height = c->height, width = c->width;
+		}
+
+		camera_rotate(angle, loc, dir, centerpoint, set->rotate_axis);
+		camera_view_init(views+k, height, width, visang, loc, dir);
+
+		views[k].lod = set->lod;
+		views[k].image = images[k];
+		camera_view_clear_image(views+k);
+	}
+}
+
+/**
+ * Find the maximum intensity seen by each of the
+ * additional cameras (in their initial position),
+ * rendering all of them in one pass over the voxels.
+ */
+void find_camera_max_intensity(s3d_t *s, struct settings *set, double centerpoint[3]) {
+	camera_view_t *views = malloc(sizeof(camera_view_t)*set->ncameras);
+	real_t ***images = malloc(sizeof(real_t**)*set->ncameras);
+	size_t k, p, npix;
+	double mx, t0 = timing_now();
+
+	for (k = 0; k < set->ncameras; k++)
+		images[k] = camera_view_alloc_image(set->cameras[k].height, set->cameras[k].width);
+
+	init_views(set, views, images, 0, 0.0, centerpoint);
+	camera_generate_views(s, views, set->ncameras);
+
+	for (k = 0; k < set->ncameras; k++) {
+		npix = set->cameras[k].height * set->cameras[k].width;
+		mx = 0.0;
+		for (p = 0; p < npix; p++) {
+			if (images[k][0][p] > mx)
+				mx = images[k][0][p];
+		}
+
+		if (mx <= 0) {
+			fprintf(stderr, "ERROR: Maximum value of reference image of camera '%s' is %e\n", set->cameras[k].outfile, mx);
+			exit(EXIT_FAILURE);
+		}
+
+		set->cameras[k].threshold = mx * set->threshold;
+		camera_free_image(images[k]);
 	}
 
-	set_png_threshold(mx * set->threshold);
+	timing_add(TIMING_MAX_INTENSITY, t0);
+
+	free(images);
+	free(views);
+}
+
+/**
+ * Check that the vectorized projection kernel agrees
+ * with the scalar reference kernel for the reference
+ * camera position.
+ */
+void verify_kernel(s3d_t *s, struct settings *set) {
+	camera_view_t cv;
+	size_t moved;
+	double dev;
+
+	init_main_view(set, &cv, 1);
+	dev = camera_view_verify_kernel(s, &cv, &moved);
+
+	printf("Projection kernel: max deviation %.3e pixels, %zu of %zu voxels moved.\n", dev, moved, s->nvoxels);
+
+	if (dev > CAMERA_KERNEL_TOLERANCE) {
+		fprintf(stderr, "ERROR: Vectorized projection kernel deviates from reference kernel by %e pixels.\n", dev);
+		exit(EXIT_FAILURE);
+	}
 }
 
-void write_img(double **img, size_t height, size_t width, char *name) {
+void write_img(real_t **img, size_t height, size_t width, char *name) {
 	size_t i, j;
 	FILE *f;
 
@@ -178,106 +948,1607 @@ void write_img(double **img, size_t height, size_t width, char *name) {
 	fclose(f);
 }
 
-void generate_frames(
-	s3d_t *s, double *angles, size_t *anglecount, double **anglestart,
-	double dangle, struct settings *set, double centerpoint[3]
-) {
-	size_t j, offset=0;
-	int tn = omp_get_thread_num(), mlen = strlen(set->outfile)+20;
-	double avg = 0.0;
-	double loc[3], dir[3];
-	char *outname = malloc(sizeof(char)*mlen);
+/**
+ * Write frame number 'index', either to a PNG file
+ * or to the output stream (and to the frame stack,
+ * with --save-raw).
+ *
+ * outname: Buffer (of length 'mlen') for the output file name.
+ */
+void write_frame(struct settings *set, real_t **img, size_t index, char *outname, int mlen) {
+	bitmap_t *bmp;
 
-	/* Compute filename offset */
-	for (j = 0; j < (size_t)tn; j++)
-		offset += anglecount[j];
+	if (set->raw != NULL && framestack_write(set->raw, index, img)) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to write frame %zu to frame stack.\n", index);
+		exit(EXIT_FAILURE);
+	}
 
-	camera_new_image();
-	for (j = 0; j < anglecount[tn]; j++) {
-		camera_clear_image();
+	if (set->stream != NULL) {
+		bmp = thread_bitmap_threshold(img, set->height, set->width, set->top);
+		if (stream_write(set->stream, index - set->first, bmp->pixels)) {
+			perror("ERROR");
+			fprintf(stderr, "ERROR: Unable to write frame %zu to output stream.\n", index);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		snprintf(outname, mlen, "%s%zu.png", set->outfile, index);
+		if (saveimg_options(img, set->height, set->width, set->top, &set->png, outname) == 0 &&
+			set->manifest != NULL &&
+			resume_record(set->manifest, index, set->keys[index - set->first], outname)) {
+			perror("ERROR");
+			fprintf(stderr, "ERROR: Unable to record frame %zu in manifest.\n", index);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-		loc[0] = set->location[0];
-		loc[1] = set->location[1];
-		loc[2] = set->location[2];
-		dir[0] = set->direction[0];
-		dir[1] = set->direction[1];
-		dir[2] = set->direction[2];
+	timing_count(TIMING_FRAMES, 1);
+}
 
-		rotate2(anglestart[tn][j], loc, dir, centerpoint, set->rotate_axis);
-		camera_init_local(loc, dir);
+/**
+ * Open the output stream (for formats other than PNG).
+ *
+ * out: File descriptor of the original stdout.
+ * capacity: Size of the reorder buffer (in frames).
+ */
+void open_stream(struct settings *set, int out, size_t capacity) {
+	FILE *f;
 
-		tic();
-		double **img = camera_generate(s);
-		avg += toc();
+	if (!strcmp(set->outfile, "-"))
+		f = fdopen(out, "wb");
+	else
+		f = fopen(set->outfile, "wb");
 
-		snprintf(outname, mlen, "%s%zu.png", set->outfile, offset+j);
-		saveimg(img, set->height, set->width, outname);
+	if (f == NULL) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to open output stream: %s.\n", set->outfile);
+		exit(EXIT_FAILURE);
 	}
 
-	printf("Average time per frame on thread #%d: %.3fms\n", tn, avg*1e3/((double)anglecount[tn]));
+	set->stream = stream_open(
+		f, !strcmp(set->format, "y4m") ? STREAM_Y4M : STREAM_RGB,
+		set->width, set->height, set->fps, capacity
+	);
 }
-void divide_among_threads(
-	const size_t frames, double dangle, const size_t threads,
-	double *angles, double **anglestart, size_t *anglecount
-) {
+
+/**
+ * Compute the angle of rotation of the camera
+ * in each of the 'frames' frames of the video.
+ */
+double *frame_angles(size_t frames) {
+	double *angles = malloc(sizeof(double)*frames),
+		   dangle = 2.0*PI / (double)(frames-1);
 	size_t i;
-	angles[0] = 0.0;
 
-	anglestart[0] = angles;
+	angles[0] = 0.0;
 	for (i = 1; i < frames; i++)
 		angles[i] = angles[i-1] + dangle;
-	
-	/* Divide frames among threads */
-	if (threads > 1) {
-		for (i = 0; i < threads; i++)
-			anglecount[i] = frames / threads;
-		for (i = 0; i < frames % threads; i++)
-			anglecount[i]++;
 
-		for (i = 1; i < threads; i++)
-			anglestart[i] = anglestart[i-1] + anglecount[i-1];
-	} else anglecount[0] = frames;
+	return angles;
 }
 
-int main(int argc, char *argv[]) {
-	s3d_t *s;
-	struct settings *set;
-	double centerpoint[3];
-	const size_t threads = omp_get_max_threads();
-	double *angles, dangle, **anglestart;
-	size_t *anglecount;
+/**
+ * Determine which of the 'frames' frames of the video
+ * to render (set->first to set->last-1). With --shard,
+ * the video is split into parts of (nearly) equal
+ * numbers of consecutive frames. Frames keep their
+ * index in the full video (and thus their file names
+ * and camera angles). Returns non-zero if there are
+ * no frames to render.
+ */
+int select_frames(struct settings *set, size_t frames) {
+	if (set->nshards > 0) {
+		set->first = frames * set->shard / set->nshards;
+		set->last = frames * (set->shard+1) / set->nshards;
+	} else if (!set->last_set || set->last > frames)
+		set->last = frames;
 
-	set = read_settings();
+	if (set->first >= set->last) {
+		fprintf(stderr, "ERROR: No frames to render (the video has %zu frames).\n", frames);
+		return -1;
+	}
 
-	s = loads3d(set->infile);
-	if (s == NULL) return -1;
+	if (set->first > 0 || set->last < frames)
+		printf("Rendering frames %zu to %zu of %zu.\n", set->first, set->last-1, frames);
 
-	s3d_center(s, centerpoint);
+	return 0;
+}
 
-	size_t frames = set->fps * set->videolength;
-	angles = malloc(sizeof(double)*frames);
-	anglecount = malloc(sizeof(size_t)*threads);
-	anglestart = malloc(sizeof(double*)*threads);
-	dangle = 2.0*PI / (double)(frames-1);
+/**
+ * Return a hash of everything (other than the camera
+ * angle) which affects the contents of frames: the
+ * input file (its size and time of modification, and
+ * for cache data in shared memory or held by a file
+ * descriptor, its header), the settings of the main
+ * camera, the normalization, and how voxels are drawn.
+ */
+uint64_t settings_hash(struct settings *set) {
+	uint64_t h = RESUME_HASH_INIT, v[6] = {0};
+	s3dcache_header_t hd;
+	struct stat st;
+	int fd;
 
-	divide_among_threads(frames, dangle, threads, angles, anglestart, anglecount);
+	if (s3dcache_is_handle(set->infile)) {
+		fd = s3dcache_open(set->infile, 0);
+		if (fd >= 0 && fstat(fd, &st) == 0 &&
+			pread(fd, &hd, sizeof(hd), 0) == sizeof(hd)) {
+			v[0] = st.st_size;
+			v[1] = st.st_mtime;
+			h = resume_hash(h, &hd, sizeof(hd));
+		}
+		if (fd >= 0) close(fd);
+	} else if (stat(set->infile, &st) == 0) {
+		v[0] = st.st_size;
+		v[1] = st.st_mtime;
+	}
+	v[2] = set->height;
+	v[3] = set->width;
+	v[4] = set->lod;
+	v[5] = sizeof(real_t);
 
-	camera_init(set->height, set->width, set->visang);
+	h = resume_hash(h, v, sizeof(v));
+	h = resume_hash(h, &set->visang, sizeof(double));
+	h = resume_hash(h, set->location, sizeof(set->location));
+	h = resume_hash(h, set->direction, sizeof(set->direction));
+	h = resume_hash(h, set->rotate_axis, sizeof(set->rotate_axis));
+	h = resume_hash(h, &set->threshold, sizeof(double));
+	h = resume_hash(h, &set->max_intensity, sizeof(double));
 
-	/* Determine SOV extents (for the user's convenience) */
-	camera_get_extents(s);
+	return h;
+}
 
-	/* Find maximum intensity */
-	find_max_intensity(s, set);
-	
-	#pragma omp parallel
-	{
-		generate_frames(
-			s, angles, anglecount, anglestart, dangle,
-			set, centerpoint
-		);
+/**
+ * Make the list of frames to render (set->todo). With
+ * --resume, frames recorded in the manifest (named after
+ * the output file, and the range of frames if not the
+ * whole video) are left out, if they were rendered with
+ * the same settings and at the same angle, and the file
+ * is still there. Must be called once the normalization
+ * (set->max_intensity) is known.
+ *
+ * Returns the number of frames to render.
+ */
+size_t plan_frames(struct settings *set, double *angles, size_t frames) {
+	size_t j, n = set->last - set->first, mlen = strlen(set->outfile)+64;
+	char *name;
+
+	set->todo = malloc(sizeof(size_t)*n);
+	set->ntodo = 0;
+
+	if (!set->resume) {
+		for (j = set->first; j < set->last; j++)
+			set->todo[set->ntodo++] = j;
+		return set->ntodo;
+	}
+
+	name = malloc(sizeof(char)*mlen);
+	if (set->first == 0 && set->last == frames)
+		snprintf(name, mlen, "%s.resume", set->outfile);
+	else
+		snprintf(name, mlen, "%s.%zu-%zu.resume", set->outfile, set->first, set->last-1);
+
+	set->manifest = resume_open(name, settings_hash(set));
+	set->keys = malloc(sizeof(uint64_t)*n);
+
+	for (j = set->first; j < set->last; j++) {
+		set->keys[j - set->first] = resume_frame_key(set->manifest, j, angles[j]);
+
+		snprintf(name, mlen, "%s%zu.png", set->outfile, j);
+		if (!resume_is_done(set->manifest, j, set->keys[j - set->first], name))
+			set->todo[set->ntodo++] = j;
 	}
 
+	printf("Resuming: %zu of %zu frame(s) left to render.\n", set->ntodo, n);
+	free(name);
+
+	return set->ntodo;
+}
+
+/**
+ * Create the frame stack to save the raw frames to
+ * (with --save-raw), with room for frames set->first
+ * to set->last-1. Returns non-zero on error.
+ */
+int open_raw(struct settings *set) {
+	if (set->saveraw == NULL)
+		return 0;
+
+	set->raw = framestack_create(
+		set->saveraw, set->height, set->width,
+		set->first, set->last - set->first, set->fps
+	);
+
+	return (set->raw == NULL ? -1 : 0);
+}
+
+/**
+ * Complete the frame stack (if any), once all frames
+ * have been written. Returns non-zero on error.
+ */
+int close_raw(struct settings *set) {
+	int err;
+
+	if (set->raw == NULL)
+		return 0;
+
+	err = framestack_finish(set->raw, set->max_intensity, set->threshold);
+	set->raw = NULL;
+
+	if (!err)
+		printf("Raw frames saved to '%s'.\n", set->saveraw);
+
+	return err;
+}
+
+/**
+ * Allocate an image of 'height' times 'width' pixels to
+ * render into, on huge pages with --huge-pages. Exits if
+ * out of memory.
+ */
+real_t **alloc_frame_image(struct settings *set, size_t height, size_t width) {
+	real_t **img;
+
+	if (!set->huge_pages)
+		return camera_view_alloc_image(height, width);
+
+	img = placement_alloc_image(height, width, 1);
+	if (img == NULL) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to allocate a frame buffer on huge pages.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return img;
+}
+
+/**
+ * Free an image allocated with alloc_frame_image().
+ */
+void free_frame_image(struct settings *set, real_t **img, size_t height, size_t width) {
+	if (set->huge_pages)
+		placement_free_image(img, height, width, 1);
+	else
+		camera_free_image(img);
+}
+
+/**
+ * Render frames. Must be called from within a parallel
+ * region: frames are handed out to threads dynamically,
+ * 'set->chunk' at a time, so that threads which happen
+ * to get cheap frames (or are not descheduled) pick up
+ * more work. Output files are named after the global
+ * frame index, regardless of which thread renders them.
+ *
+ * Only the frames listed in set->todo are rendered.
+ *
+ * If 'q' is not NULL, frames are rendered into buffers
+ * taken from 'q' and then put on it to be written by
+ * the encoder threads (see 'encode_frames()'), rather
+ * than being written directly.
+ *
+ * inner: Number of threads to split each frame across.
+ * stats: Per-thread load statistics (indexed by thread number).
+ */
+void generate_frames(
+	s3d_t *s, double *angles, struct settings *set, double centerpoint[3],
+	frameq_t *q, int inner, struct thread_stats *stats
+) {
+	long long signed int t, j;
+	int tn = omp_get_thread_num(), mlen = strlen(set->outfile)+20;
+	double loc[3], dir[3], t0, t1;
+	char *outname;
+	struct thread_stats *st = stats + tn;
+	frame_t *f = NULL;
+	camera_view_t cv, *views = NULL;
+	real_t ***images = NULL;
+	size_t k, nviews = set->ncameras + 1;
+	int node;
+
+	st->frames = 0;
+	st->render = st->busy = 0.0;
+
+	timing_thread_name("render");
+
+	/* Keep threads next to their copy of the volume (the
+	 * threads of a single team rendering each frame are
+	 * left to the system) */
+	if (set->numa != PLACEMENT_DEFAULT && omp_get_num_threads() > 1) {
+		node = placement_pin_thread(tn, omp_get_num_threads());
+		if (set->nvolumes > 1 && node >= 0 && node < set->nvolumes)
+			s = set->volumes[node];
+	}
+
+	init_main_view(set, &cv, inner);
+	if (q == NULL && set->ncameras == 0)
+		cv.image = alloc_frame_image(set, set->height, set->width);
+
+	/* Images of the main and additional cameras */
+	if (set->ncameras > 0) {
+		views = malloc(sizeof(camera_view_t)*nviews);
+		images = malloc(sizeof(real_t**)*nviews);
+		images[0] = alloc_frame_image(set, set->height, set->width);
+		for (k = 1; k < nviews; k++) {
+			images[k] = alloc_frame_image(set, set->cameras[k-1].height, set->cameras[k-1].width);
+			if ((int)strlen(set->cameras[k-1].outfile)+20 > mlen)
+				mlen = strlen(set->cameras[k-1].outfile)+20;
+		}
+	}
+
+	outname = malloc(sizeof(char)*mlen);
+
+	#pragma omp for schedule(dynamic, set->chunk) nowait
+	for (t = 0; t < (long long signed)set->ntodo; t++) {
+		j = set->todo[t];
+		t0 = timing_now();
+		if (q != NULL) {
+			f = frameq_acquire(q);
+			cv.image = f->img;
+			timing_add(TIMING_WAIT, t0);
+		}
+		if (set->ncameras > 0) {
+			init_views(set, views, images, 1, angles[j], centerpoint);
+
+			t1 = timing_now();
+			camera_generate_views(s, views, nviews);
+			timing_add(TIMING_RENDER, t1);
+			st->render += timing_now() - t1;
+
+			write_frame(set, images[0], j, outname, mlen);
+			for (k = 1; k < nviews; k++) {
+				snprintf(outname, mlen, "%s%lld.png", set->cameras[k-1].outfile, j);
+				saveimg_options(images[k], views[k].pixelsi, views[k].pixelsj, set->cameras[k-1].threshold, &set->png, outname);
+				timing_count(TIMING_FRAMES, 1);
+			}
+
+			st->frames++;
+			st->busy += timing_now() - t0;
+			continue;
+		}
+
+		camera_view_clear_image(&cv);
+
+		loc[0] = set->location[0];
+		loc[1] = set->location[1];
+		loc[2] = set->location[2];
+		dir[0] = set->direction[0];
+		dir[1] = set->direction[1];
+		dir[2] = set->direction[2];
+
+		camera_rotate(angles[j], loc, dir, centerpoint, set->rotate_axis);
+		camera_view_place(&cv, loc, dir);
+
+		t1 = timing_now();
+		camera_view_generate(s, &cv);
+		timing_add(TIMING_RENDER, t1);
+		st->render += timing_now() - t1;
+
+		if (q != NULL) {
+			f->index = j;
+			frameq_push(q, f);
+		} else
+			write_frame(set, cv.image, j, outname, mlen);
+
+		st->frames++;
+		st->busy += timing_now() - t0;
+	}
+
+	st->finished = timing_now();
+
+	if (q == NULL && set->ncameras == 0)
+		free_frame_image(set, cv.image, set->height, set->width);
+	camera_view_free(&cv);
+	if (set->ncameras > 0) {
+		free_frame_image(set, images[0], set->height, set->width);
+		for (k = 1; k < nviews; k++)
+			free_frame_image(set, images[k], set->cameras[k-1].height, set->cameras[k-1].width);
+		free(images);
+		free(views);
+	}
+	free(outname);
+}
+
+/**
+ * Encoder thread: take rendered frames off the
+ * queue and write them to file, until the queue
+ * is closed.
+ */
+void *encode_frames(void *arg) {
+	struct encoder *e = arg;
+	int mlen = strlen(e->set->outfile)+20;
+	char *outname = malloc(sizeof(char)*mlen);
+	double t0;
+	frame_t *f;
+
+	e->frames = 0;
+	e->busy = 0.0;
+
+	timing_thread_name("encoder");
+
+	while (t0 = timing_now(), (f = frameq_pop(e->queue)) != NULL) {
+		timing_add(TIMING_WAIT, t0);
+		t0 = timing_now();
+
+		write_frame(e->set, f->img, f->index, outname, mlen);
+		frameq_release(e->queue, f);
+
+		e->frames++;
+		e->busy += timing_now() - t0;
+	}
+
+	free(outname);
+	return NULL;
+}
+
+/**
+ * Print per-thread load statistics, as well as a
+ * summary of the load imbalance among threads.
+ *
+ * start: Time (timing_now()) at which rendering started.
+ */
+void print_thread_stats(struct thread_stats *stats, int nthreads, double start) {
+	int i;
+	double mean = 0.0, mx = 0.0, first = stats[0].finished, last = stats[0].finished;
+
+	printf("-------------------------------\n");
+	printf("THREAD LOAD\n\n");
+	for (i = 0; i < nthreads; i++) {
+		printf("  #%-3d %6zu frames, %8.3fms/frame (render %8.3fms/frame), busy %8.3fs\n",
+			i, stats[i].frames,
+			stats[i].frames > 0 ? stats[i].busy*1e3/stats[i].frames : 0.0,
+			stats[i].frames > 0 ? stats[i].render*1e3/stats[i].frames : 0.0,
+			stats[i].busy
+		);
+
+		mean += stats[i].busy;
+		if (stats[i].busy > mx) mx = stats[i].busy;
+		if (stats[i].finished < first) first = stats[i].finished;
+		if (stats[i].finished > last) last = stats[i].finished;
+	}
+	mean /= nthreads;
+
+	printf("\n  Wall time:       %.3fs\n", last-start);
+	printf("  Load imbalance:  %.1f%% (max busy / mean busy - 1)\n", mean > 0 ? (mx/mean - 1.0)*100.0 : 0.0);
+	printf("  Tail idle time:  %.3fs (last - first thread finished)\n", last-first);
+	printf("-------------------------------\n\n");
+}
+
+/**
+ * Print per-thread statistics for encoder threads.
+ */
+void print_encoder_stats(struct encoder *enc, int nencoders) {
+	int i;
+
+	printf("-------------------------------\n");
+	printf("ENCODER LOAD\n\n");
+	for (i = 0; i < nencoders; i++) {
+		printf("  #%-3d %6zu frames, %8.3fms/frame, busy %8.3fs\n",
+			i, enc[i].frames,
+			enc[i].frames > 0 ? enc[i].busy*1e3/enc[i].frames : 0.0,
+			enc[i].busy
+		);
+	}
+	printf("-------------------------------\n\n");
+}
+
+/**
+ * Decide how to divide the available threads among
+ * frames ('outer', number of frames rendered at a time)
+ * and voxels ('inner', number of threads per frame).
+ *
+ * Splitting a frame across threads requires one
+ * partial image per thread to be summed, so in
+ * automatic mode this is only done when there are
+ * fewer frames than threads, and the volume has more
+ * non-zero voxels than the image has pixels.
+ */
+void choose_parallelism(
+	enum parallel_mode mode, size_t frames, size_t nvoxels,
+	size_t npix, int threads, int *outer, int *inner
+) {
+	int maxouter = frames < (size_t)threads ? (int)frames : threads;
+
+	if (maxouter < 1) maxouter = 1;
+
+	if (mode == PARALLEL_AUTO) {
+		if (frames >= (size_t)threads || nvoxels < npix)
+			mode = PARALLEL_FRAME;
+		else
+			mode = PARALLEL_NESTED;
+	}
+
+	switch (mode) {
+		case PARALLEL_VOXEL:
+			*outer = 1;
+			*inner = threads;
+			break;
+		case PARALLEL_NESTED:
+			*outer = maxouter;
+			*inner = threads / maxouter;
+			break;
+		case PARALLEL_FRAME:
+		default:
+			*outer = maxouter;
+			*inner = 1;
+			break;
+	}
+}
+
+/**
+ * Convert an S3D file to an s3dvid cache file. The
+ * voxel list of sparse files is stored in brick order,
+ * so that it can be rendered without being reordered
+ * (and thus used in place, see s3d_build_bricks()).
+ */
+int convert_s3d(struct settings *set) {
+	s3d_t *s;
+
+	s = loads3d(set->infile, set->threads);
+	if (s == NULL) return -1;
+
+	if (set->sparse) {
+		s3d_compact(s);
+		s3d_build_bricks(s);
+	}
+
+	if (s3d_save_cache(s, set->convert, set->sparse))
+		return -1;
+
+	if (set->sparse)
+		printf("Wrote %zu non-zero voxels to '%s'.\n", s->nvoxels, set->convert);
+	else
+		printf("Wrote %zu^3 voxels to '%s'.\n", s->pixels, set->convert);
+
+	return 0;
+}
+
+static int compare_stacks(const void *a, const void *b) {
+	const framestack_t *ra = *(framestack_t* const*)a, *rb = *(framestack_t* const*)b;
+
+	if (ra->h.first != rb->h.first)
+		return ra->h.first < rb->h.first ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Colormap the raw frames of the given frame stacks
+ * (--retone) again, without rendering anything. Frames
+ * are written as with --format, to files named after
+ * the prefix (or, for streams, to the file itself) and
+ * the index of the frame in the video.
+ *
+ * Unless given with --max-intensity or --global-max,
+ * the frames of each stack are normalized by the
+ * maximum intensity stored in it, and unless given with
+ * --threshold, the stored intensity threshold is used.
+ *
+ * out: File descriptor of the original stdout.
+ */
+int retone_frames(struct settings *set, int out) {
+	framestack_t **r;
+	size_t *start, total = 0, height, width;
+	double *top, mx = set->max_intensity, threshold, t0;
+	long long signed int t;
+	int i, n = set->nrawfiles, mlen = strlen(set->retone)+20, err = 0;
+
+	r = malloc(sizeof(framestack_t*)*n);
+	for (i = 0; i < n; i++) {
+		r[i] = framestack_open(set->rawfiles[i]);
+		if (r[i] == NULL) return -1;
+	}
+
+	/* Streams are written in the order of the video */
+	qsort(r, n, sizeof(framestack_t*), compare_stacks);
+
+	height = r[0]->h.height;
+	width = r[0]->h.width;
+	start = malloc(sizeof(size_t)*(n+1));
+	for (i = 0; i < n; i++) {
+		if (r[i]->h.height != height || r[i]->h.width != width) {
+			fprintf(stderr, "ERROR: Frame stacks '%s' and '%s' hold frames of different sizes.\n",
+				r[0]->filename, r[i]->filename);
+			return -1;
+		}
+		if (strcmp(set->format, "png") && i > 0 &&
+			r[i]->h.first != r[i-1]->h.first + r[i-1]->h.nframes) {
+			fprintf(stderr, "ERROR: Frame stacks must hold consecutive frames to be written to a single stream.\n");
+			return -1;
+		}
+
+		start[i] = total;
+		total += r[i]->h.nframes;
+	}
+	start[n] = total;
+
+	set->outfile = set->retone;
+	set->height = height;
+	set->width = width;
+	set->fps = r[0]->h.fps;
+	set->first = r[0]->h.first;
+
+	t0 = timing_now();
+	if (set->global_max) {
+		mx = 0.0;
+
+		#pragma omp parallel num_threads(set->threads) reduction(max:mx)
+		{
+			real_t **img = camera_view_alloc_image(height, width);
+			size_t k, j;
+
+			#pragma omp for schedule(dynamic)
+			for (t = 0; t < (long long signed)total; t++) {
+				for (j = 0; start[j+1] <= (size_t)t; j++) ;
+				if (framestack_read(r[j], t - start[j], img)) {
+					fprintf(stderr, "ERROR: Unable to read frame stack: %s.\n", r[j]->filename);
+					exit(EXIT_FAILURE);
+				}
+
+				for (k = 0; k < height*width; k++)
+					if (img[0][k] > mx) mx = img[0][k];
+			}
+
+			camera_free_image(img);
+		}
+
+		printf("Maximum intensity (all frames): %.17g\n", mx);
+		if (mx <= 0) {
+			fprintf(stderr, "ERROR: Maximum value of all frames is %e\n", mx);
+			return -1;
+		}
+	}
+
+	/* Intensity at the top of the colormap, for each stack */
+	top = malloc(sizeof(double)*n);
+	for (i = 0; i < n; i++) {
+		threshold = (set->retone_threshold > 0 ? set->retone_threshold : r[i]->h.threshold);
+		top[i] = (mx > 0 ? mx : r[i]->h.max_intensity) * threshold;
+	}
+
+	if (strcmp(set->format, "png"))
+		open_stream(set, out, set->threads+1);
+
+	#pragma omp parallel num_threads(set->threads)
+	{
+		real_t **img = camera_view_alloc_image(height, width);
+		char *outname = malloc(sizeof(char)*mlen);
+		size_t j, index;
+		bitmap_t *bmp;
+		double t1;
+
+		timing_thread_name("retone");
+
+		#pragma omp for schedule(dynamic)
+		for (t = 0; t < (long long signed)total; t++) {
+			for (j = 0; start[j+1] <= (size_t)t; j++) ;
+			index = r[j]->h.first + (t - start[j]);
+
+			t1 = timing_now();
+			if (framestack_read(r[j], t - start[j], img)) {
+				fprintf(stderr, "ERROR: Unable to read frame stack: %s.\n", r[j]->filename);
+				exit(EXIT_FAILURE);
+			}
+			timing_add(TIMING_LOAD, t1);
+			timing_count(TIMING_BYTES_READ, r[j]->framesize);
+
+			if (set->stream != NULL) {
+				bmp = thread_bitmap_threshold(img, height, width, top[j]);
+				if (stream_write(set->stream, index - set->first, bmp->pixels)) {
+					perror("ERROR");
+					fprintf(stderr, "ERROR: Unable to write frame %zu to output stream.\n", index);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				snprintf(outname, mlen, "%s%zu.png", set->outfile, index);
+				saveimg_options(img, height, width, top[j], &set->png, outname);
+			}
+
+			timing_count(TIMING_FRAMES, 1);
+		}
+
+		camera_free_image(img);
+		free(outname);
+	}
+
+	if (set->stream != NULL && stream_close(set->stream, total)) {
+		fprintf(stderr, "ERROR: Failed to write output stream.\n");
+		err = -1;
+	}
+
+	printf("Re-tone-mapped %zu frame(s) in %.3fs.\n", total, timing_now()-t0);
+
+	for (i = 0; i < n; i++)
+		framestack_close(r[i]);
+	free(r);
+	free(start);
+	free(top);
+
+	return err;
+}
+
+/**
+ * Render the video without loading the whole volume
+ * (--memory-budget). The volume is read in slabs of
+ * planes, and each slab is drawn into all frames of
+ * the current pass before being dropped, so that the
+ * volume is read once per pass. The next slab is read
+ * (and compacted) by a separate thread while the
+ * current one is drawn. Frames are divided among
+ * passes so that the frames of a pass take up at most
+ * half of the budget, and slabs the rest.
+ *
+ * Unless --max-intensity is given, the reference image
+ * is rendered along with the frames of the first pass.
+ *
+ * out: File descriptor of the original stdout.
+ */
+int render_out_of_core(struct settings *set, int out) {
+	s3d_slab_reader_t *r;
+	s3d_slab_t *slab[2] = {NULL, NULL}, *cur;
+	size_t *bounds = NULL, *index = NULL, nslabs, frames, perframe, perplane, maxplanes,
+		   nimg, npass, nv, gs, k, j, t, p, pixels, nper = 0, ntotal;
+	int ref = (set->max_intensity <= 0), threads = set->threads,
+		mlen = strlen(set->outfile)+20, err = -1;
+	double *angles, centerpoint[3], loc[3], dir[3], max = 0.0, t0;
+	long long signed int g, ngroups;
+	camera_view_t *views = NULL;
+	real_t ***images = NULL;
+
+	if (set->encoders > 0 || set->camerafile != NULL || set->verify_kernel) {
+		fprintf(stderr, "ERROR: Options '--encoders', '--cameras' and '--verify-kernel' cannot be used with '--memory-budget'.\n");
+		return -1;
+	}
+
+	r = s3d_slab_open(set->infile);
+	if (r == NULL) return -1;
+
+	pixels = r->s->pixels;
+	s3d_center(r->s, centerpoint);
+
+	frames = set->fps * set->videolength;
+	angles = frame_angles(frames);
+	if (select_frames(set, frames))
+		goto done;
+	if (plan_frames(set, angles, frames) == 0) {
+		printf("All frames have already been rendered.\n");
+		err = 0;
+		goto done;
+	}
+
+	/* Divide memory among frames and slabs (two slabs
+	 * are in memory while one is being prefetched) */
+	perframe = set->height*set->width*sizeof(real_t)
+		+ set->height*sizeof(real_t*) + sizeof(camera_view_t);
+	perplane = 2*s3d_slab_plane_bytes(pixels);
+
+	nimg = set->ntodo + ref;
+	nper = set->memory_budget/2 / perframe;
+	if (nper > nimg) nper = nimg;
+	if (nper == 0 || (ref && nper < 2)) {
+		fprintf(stderr, "ERROR: Memory budget is too small to hold %s.\n", ref ? "two frames" : "one frame");
+		goto done;
+	}
+
+	maxplanes = (set->memory_budget - nper*perframe) / perplane;
+	if (maxplanes > pixels) maxplanes = pixels;
+	if (maxplanes == 0) {
+		fprintf(stderr, "ERROR: Memory budget is too small to hold a plane of the volume (%zu bytes).\n", perplane);
+		goto done;
+	}
+
+	nslabs = s3d_slab_plan(r, maxplanes, &bounds);
+	npass = (nimg + nper-1) / nper;
+
+	printf("Out-of-core rendering: %zu slab(s) of at most %zu planes, %zu pass(es) of at most %zu frame(s).\n",
+		nslabs, maxplanes, npass, nper);
+
+	if (strcmp(set->format, "png"))
+		open_stream(set, out, threads+1);
+	if (open_raw(set))
+		goto done;
+
+	views = malloc(sizeof(camera_view_t)*nper);
+	images = malloc(sizeof(real_t**)*nper);
+	index = malloc(sizeof(size_t)*nper);
+	for (k = 0; k < nper; k++)
+		images[k] = camera_view_alloc_image(set->height, set->width);
+
+	slab[0] = s3d_slab_new(r, maxplanes);
+	slab[1] = s3d_slab_new(r, maxplanes);
+
+	/* Slabs are loaded in the order (pass, slab) */
+	ntotal = npass*nslabs;
+	s3d_slab_prefetch(slab[0], bounds[0], bounds[1]-bounds[0]);
+
+	for (p = 0, j = 0, t = 0; p < npass; p++) {
+		/* Cameras of this pass */
+		nv = 0;
+		if (p == 0 && ref) {
+			camera_view_init(views, set->height, set->width, set->visang, set->location, set->direction);
+			nv++;
+		}
+		for (; nv < nper && j < set->ntodo; nv++, j++) {
+			index[nv] = set->todo[j];
+			memcpy(loc, set->location, sizeof(loc));
+			memcpy(dir, set->direction, sizeof(dir));
+			camera_rotate(angles[index[nv]], loc, dir, centerpoint, set->rotate_axis);
+			camera_view_init(views+nv, set->height, set->width, set->visang, loc, dir);
+		}
+		for (k = 0; k < nv; k++) {
+			views[k].lod = set->lod;
+			views[k].image = images[k];
+			camera_view_clear_image(views+k);
+		}
+
+		/* Groups of cameras handed to threads */
+		gs = (nv + 4*threads-1) / (4*threads);
+		ngroups = (nv + gs-1) / gs;
+
+		for (k = 0; k < nslabs; k++, t++) {
+			cur = slab[t % 2];
+			t0 = timing_now();
+			if (s3d_slab_wait(cur)) goto done;
+			timing_add(TIMING_WAIT, t0);
+
+			if (t+1 < ntotal) {
+				size_t next = (k+1) % nslabs;
+				s3d_slab_prefetch(slab[(t+1) % 2], bounds[next], bounds[next+1]-bounds[next]);
+			}
+
+			t0 = timing_now();
+			#pragma omp parallel for schedule(dynamic) num_threads(threads)
+			for (g = 0; g < ngroups; g++) {
+				size_t a = g*gs, n = (nv-a < gs ? nv-a : gs);
+				camera_generate_views(cur->s, views+a, n);
+			}
+			timing_add(TIMING_RENDER, t0);
+		}
+
+		/* Normalize using the reference image */
+		if (p == 0 && ref) {
+			for (k = 0; k < set->height*set->width; k++)
+				if (images[0][0][k] > max) max = images[0][0][k];
+
+			printf("Maximum intensity: %.17g\n", max);
+			if (max <= 0) {
+				fprintf(stderr, "ERROR: Maximum value of reference image is %e\n", max);
+				goto done;
+			}
+			set->max_intensity = max;
+		} else if (p == 0)
+			max = set->max_intensity;
+
+		set->top = max * set->threshold;
+
+		#pragma omp parallel num_threads(threads)
+		{
+			char *outname = malloc(sizeof(char)*mlen);
+
+			#pragma omp for schedule(dynamic)
+			for (g = (p == 0 && ref ? 1 : 0); g < (long long signed)nv; g++)
+				write_frame(set, images[g], index[g], outname, mlen);
+
+			free(outname);
+		}
+	}
+
+	err = 0;
+
+done:
+	/* The next slab may still be read by its prefetch
+	 * thread (after an error) */
+	for (k = 0; k < 2; k++) {
+		if (slab[k] != NULL) {
+			s3d_slab_wait(slab[k]);
+			s3d_slab_free(slab[k]);
+		}
+	}
+	s3d_slab_close(r);
+
+	if (images != NULL) {
+		for (k = 0; k < nper; k++)
+			camera_free_image(images[k]);
+	}
+	free(images);
+	free(index);
+	free(views);
+	free(bounds);
+	free(angles);
+
+	if (set->stream != NULL && stream_close(set->stream, set->ntodo) && !err) {
+		fprintf(stderr, "ERROR: Failed to write output stream.\n");
+		err = -1;
+	}
+	set->stream = NULL;
+	if (set->manifest != NULL)
+		resume_close(set->manifest);
+	set->manifest = NULL;
+
+	/* A frame stack which was not completely written is
+	 * left without a header (see framestack_finish()) */
+	if (err && set->raw != NULL)
+		framestack_close(set->raw);
+	else if (close_raw(set))
+		err = -1;
+	set->raw = NULL;
+
+	free(set->todo);
+	free(set->keys);
+	set->todo = NULL;
+	set->keys = NULL;
+
+	if (!err && set->ntodo > 0) {
+		timing_summary(stdout);
+		if (set->trace != NULL && timing_write_trace(set->trace))
+			err = -1;
+	}
+
+	return err;
+}
+
+/**
+ * Render the video described by 'set' from the (loaded
+ * and bricked) volume 's', using all threads. Used both
+ * for a single run and for every request of a server
+ * (see serve()).
+ *
+ * out: File descriptor of the original stdout.
+ *
+ * Returns non-zero on error.
+ */
+int render_video(s3d_t *s, struct settings *set, double centerpoint[3], int out) {
+	int outer, inner, nrender = 1, threads = set->threads, err = 0;
+	double *angles, start;
+	size_t i, frames = set->fps * set->videolength;
+	struct thread_stats *stats;
+	struct encoder *enc = NULL;
+	frameq_t *q = NULL;
+
+	angles = frame_angles(frames);
+	if (select_frames(set, frames)) {
+		free(angles);
+		return -1;
+	}
+
+	if (set->verify_kernel)
+		verify_kernel(s, set);
+
+	/* Find maximum intensity (using all threads) */
+	if (set->max_intensity <= 0) {
+		set->max_intensity = find_max_intensity(s, set, threads);
+		if (set->max_intensity <= 0) {
+			fprintf(stderr, "ERROR: Maximum value of reference image is %e\n", set->max_intensity);
+			free(angles);
+			return -1;
+		}
+	}
+	set->top = set->max_intensity * set->threshold;
+	if (set->ncameras > 0)
+		find_camera_max_intensity(s, set, centerpoint);
+
+	if (plan_frames(set, angles, frames) == 0) {
+		printf("All frames have already been rendered.\n");
+		goto done;
+	}
+
+	if (open_raw(set)) {
+		err = -1;
+		goto done;
+	}
+
+	choose_parallelism(
+		set->parallel, set->ntodo, s->nvoxels, set->height*set->width,
+		threads, &outer, &inner
+	);
+	printf("Rendering %d frame(s) at a time, using %d thread(s) per frame.\n", outer, inner);
+
+	stats = malloc(sizeof(struct thread_stats)*outer);
+
+	if (outer > 1 && inner > 1)
+		omp_set_max_active_levels(2);
+	
+	/* Start encoder threads */
+	if (set->encoders > 0) {
+		if (set->queue == 0)
+			set->queue = 2*(outer + set->encoders);
+
+		q = frameq_new(set->queue, set->height, set->width, set->huge_pages);
+		if (q == NULL) {
+			perror("ERROR");
+			fprintf(stderr, "ERROR: Unable to allocate buffers for %d frames.\n", set->queue);
+			exit(EXIT_FAILURE);
+		}
+		enc = malloc(sizeof(struct encoder)*set->encoders);
+		for (i = 0; i < (size_t)set->encoders; i++) {
+			enc[i].queue = q;
+			enc[i].set = set;
+			pthread_create(&enc[i].thread, NULL, encode_frames, enc+i);
+		}
+
+		printf("Writing frames using %d encoder thread(s), with at most %d frames in memory.\n", set->encoders, set->queue);
+	}
+
+	/* Frames can be at most this far ahead of the
+	 * next frame to write (with dynamic scheduling) */
+	if (strcmp(set->format, "png"))
+		open_stream(set, out, outer*set->chunk + set->queue + set->encoders + 1);
+
+	start = timing_now();
+	#pragma omp parallel num_threads(outer)
+	{
+		#pragma omp master
+		nrender = omp_get_num_threads();
+
+		generate_frames(s, angles, set, centerpoint, q, inner, stats);
+	}
+
+	if (q != NULL) {
+		frameq_close(q);
+		for (i = 0; i < (size_t)set->encoders; i++)
+			pthread_join(enc[i].thread, NULL);
+
+		printf("All frames written after %.3fs.\n", timing_now()-start);
+	}
+
+	if (set->stream != NULL && stream_close(set->stream, set->ntodo)) {
+		fprintf(stderr, "ERROR: Failed to write output stream.\n");
+		err = -1;
+	}
+	set->stream = NULL;
+
+	print_thread_stats(stats, nrender, start);
+	if (q != NULL) {
+		print_encoder_stats(enc, set->encoders);
+		frameq_free(q);
+		free(enc);
+	}
+	free(stats);
+
+	if (close_raw(set))
+		err = -1;
+
+done:
+	if (set->manifest != NULL)
+		resume_close(set->manifest);
+	set->manifest = NULL;
+
+	free(set->todo);
+	free(set->keys);
+	free(angles);
+	set->todo = NULL;
+	set->keys = NULL;
+
+	return err;
+}
+
+/**
+ * Return the subset of the voxels drawn in step 'k' of
+ * a preview: 'k' with its (log2 PREVIEW_SUBSETS) bits
+ * reversed. The first 4^n subsets drawn thus consist of
+ * every (PREVIEW_SUBSETS/4^n)-th run of voxels, which
+ * are spread evenly over the volume.
+ */
+size_t preview_subset(size_t k) {
+	size_t r = 0, bit;
+
+	for (bit = 1; bit < PREVIEW_SUBSETS; bit <<= 1) {
+		r <<= 1;
+		if (k & bit) r |= 1;
+	}
+
+	return r;
+}
+
+/**
+ * Estimate the maximum intensity of the reference image
+ * (at the size of the preview) from the first subset of
+ * the voxels. Since every pixel of that image is a noisy
+ * estimate (based on 1/PREVIEW_SUBSETS of the voxels),
+ * its maximum would be far too large; the largest mean
+ * over blocks of PREVIEW_BLOCK x PREVIEW_BLOCK pixels is
+ * used instead, which averages over about as many voxels
+ * as a pixel of the final image.
+ */
+double preview_max_intensity(s3d_t *s, struct settings *set, int threads) {
+	size_t i, j, bi, bj, B = PREVIEW_BLOCK;
+	double sum, mx = 0.0, t0 = timing_now();
+	camera_view_t cv;
+	real_t **img;
+
+	if (B > set->height) B = set->height;
+	if (B > set->width) B = set->width;
+
+	init_main_view(set, &cv, threads);
+	img = cv.image = camera_view_alloc_image(set->height, set->width);
+	cv.subset_first = preview_subset(0);
+	cv.subset_stride = PREVIEW_SUBSETS;
+	camera_view_generate(s, &cv);
+
+	for (bi = 0; bi+B <= set->height; bi += B) {
+		for (bj = 0; bj+B <= set->width; bj += B) {
+			sum = 0.0;
+			for (i = bi; i < bi+B; i++)
+				for (j = bj; j < bj+B; j++)
+					sum += img[i][j];
+
+			if (sum > mx) mx = sum;
+		}
+	}
+
+	camera_free_image(img);
+	camera_view_free(&cv);
+
+	mx *= (double)PREVIEW_SUBSETS / (B*B);
+	timing_add(TIMING_MAX_INTENSITY, t0);
+	printf("Maximum intensity (estimated): %.17g\n", mx);
+
+	return mx;
+}
+
+/**
+ * Render a progressive preview of the video (--preview):
+ * frames are rendered at a fraction of the frame size,
+ * from a growing subset of the voxels. Each frame is
+ * written after 1, 4, 16 and all PREVIEW_SUBSETS subsets
+ * of the voxels have been drawn, with the colormap
+ * scaled to the fraction of voxels drawn, so that every
+ * image is an unbiased estimate of the final frame at
+ * that size. Files are replaced as frames are refined.
+ *
+ * Unless given with --max-intensity, the maximum
+ * intensity is estimated from the first subset (see
+ * preview_max_intensity()). A maximum intensity given
+ * with --max-intensity (that of full-size frames) is
+ * multiplied by preview^2, since every pixel of the
+ * preview covers preview^2 pixels of the full frame.
+ */
+int render_preview(s3d_t *s, struct settings *set, double centerpoint[3]) {
+	int outer, inner, threads = set->threads,
+		mlen = strlen(set->outfile)+20;
+	size_t frames = set->fps * set->videolength;
+	double *angles, mx = set->max_intensity * set->preview * set->preview;
+
+	angles = frame_angles(frames);
+	if (select_frames(set, frames)) {
+		free(angles);
+		return -1;
+	}
+
+	set->height = set->height / set->preview > 0 ? set->height / set->preview : 1;
+	set->width = set->width / set->preview > 0 ? set->width / set->preview : 1;
+
+	printf("Preview: %zux%zu pixels, refined from 1/%d of the voxels.\n",
+		set->width, set->height, PREVIEW_SUBSETS);
+
+	if (mx <= 0) {
+		mx = preview_max_intensity(s, set, threads);
+		if (mx <= 0) {
+			fprintf(stderr, "ERROR: Maximum value of reference image is %e\n", mx);
+			free(angles);
+			return -1;
+		}
+	}
+
+	choose_parallelism(
+		set->parallel, set->last - set->first, s->nvoxels, set->height*set->width,
+		threads, &outer, &inner
+	);
+
+	if (outer > 1 && inner > 1)
+		omp_set_max_active_levels(2);
+
+	#pragma omp parallel num_threads(outer)
+	{
+		long long signed int j;
+		size_t k, n;
+		double loc[3], dir[3];
+		char *outname = malloc(sizeof(char)*mlen);
+		camera_view_t cv;
+
+		timing_thread_name("render");
+		init_main_view(set, &cv, inner);
+		cv.image = alloc_frame_image(set, set->height, set->width);
+
+		#pragma omp for schedule(dynamic)
+		for (j = set->first; j < (long long signed)set->last; j++) {
+			camera_view_clear_image(&cv);
+
+			memcpy(loc, set->location, sizeof(loc));
+			memcpy(dir, set->direction, sizeof(dir));
+			camera_rotate(angles[j], loc, dir, centerpoint, set->rotate_axis);
+			camera_view_place(&cv, loc, dir);
+
+			snprintf(outname, mlen, "%s%lld.png", set->outfile, j);
+
+			for (k = 0, n = 1; n <= PREVIEW_SUBSETS; n *= 4) {
+				double t0 = timing_now();
+				for (; k < n; k++) {
+					cv.subset_first = preview_subset(k);
+					cv.subset_stride = PREVIEW_SUBSETS;
+					camera_view_generate(s, &cv);
+				}
+				timing_add(TIMING_RENDER, t0);
+
+				saveimg_options(cv.image, set->height, set->width, mx * set->threshold * n / PREVIEW_SUBSETS, &set->png, outname);
+			}
+
+			timing_count(TIMING_FRAMES, 1);
+		}
+
+		free_frame_image(set, cv.image, set->height, set->width);
+		camera_view_free(&cv);
+		free(outname);
+	}
+
+	free(angles);
+	return 0;
+}
+
+/**
+ * Parse the value 'val' of the request key 'key' as a
+ * positive integer. Returns non-zero on error.
+ */
+int request_size(const char *key, const char *val, size_t *v, char *err, size_t errlen) {
+	char *end;
+	unsigned long long x = strtoull(val, &end, 10);
+
+	if (*val == 0 || *val == '-' || *end != 0 || x == 0) {
+		snprintf(err, errlen, "Invalid value of '%s': '%s'", key, val);
+		return -1;
+	}
+
+	*v = x;
+	return 0;
+}
+
+/**
+ * Parse the value 'val' of the request key 'key' as
+ * 'n' comma-separated (finite) numbers. Returns
+ * non-zero on error.
+ */
+int request_reals(const char *key, const char *val, double *v, int n, char *err, size_t errlen) {
+	const char *p = val;
+	char *end;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v[i] = strtod(p, &end);
+		if (end == p || !isfinite(v[i]) || *end != (i < n-1 ? ',' : 0)) {
+			snprintf(err, errlen, "Invalid value of '%s': '%s'", key, val);
+			return -1;
+		}
+		p = end+1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a request to the server (see serve()): a list of
+ * 'key=value' pairs, separated by whitespace, overriding
+ * the settings in 'req'. Keys are 'out' (output file
+ * prefix), 'width', 'height', 'visang', 'location',
+ * 'direction', 'axis' (three comma-separated numbers),
+ * 'threshold', 'fps', 'length', 'frames' (A:B, as with
+ * --frames) and 'max-intensity'. 'line' is modified, and
+ * must be kept until the request has been rendered.
+ *
+ * err: Buffer (of length 'errlen') for a description of
+ *      the error, if any.
+ *
+ * Returns non-zero on error.
+ */
+int parse_request(char *line, struct settings *req, char *err, size_t errlen) {
+	char *tok, *val, *save;
+	double x;
+	int r = 0;
+
+	for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL && r == 0; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		val = strchr(tok, '=');
+		if (val == NULL) {
+			snprintf(err, errlen, "Expected 'key=value': '%s'", tok);
+			return -1;
+		}
+		*val++ = 0;
+
+		if (!strcmp(tok, "out")) req->outfile = val;
+		else if (!strcmp(tok, "width")) r = request_size(tok, val, &req->width, err, errlen);
+		else if (!strcmp(tok, "height")) r = request_size(tok, val, &req->height, err, errlen);
+		else if (!strcmp(tok, "fps")) r = request_size(tok, val, &req->fps, err, errlen);
+		else if (!strcmp(tok, "length")) r = request_size(tok, val, &req->videolength, err, errlen);
+		else if (!strcmp(tok, "visang")) r = request_reals(tok, val, &req->visang, 1, err, errlen);
+		else if (!strcmp(tok, "location")) r = request_reals(tok, val, req->location, 3, err, errlen);
+		else if (!strcmp(tok, "direction")) r = request_reals(tok, val, req->direction, 3, err, errlen);
+		else if (!strcmp(tok, "axis")) r = request_reals(tok, val, req->rotate_axis, 3, err, errlen);
+		else if (!strcmp(tok, "threshold")) r = request_reals(tok, val, &req->threshold, 1, err, errlen);
+		else if (!strcmp(tok, "max-intensity")) {
+			r = request_reals(tok, val, &x, 1, err, errlen);
+			if (r == 0 && !(x > 0)) {
+				snprintf(err, errlen, "Invalid value of '%s': '%s'", tok, val);
+				r = -1;
+			}
+			req->max_intensity = x;
+		} else if (!strcmp(tok, "frames")) {
+			if (parse_frames(req, val)) {
+				snprintf(err, errlen, "Invalid value of '%s': '%s'", tok, val);
+				r = -1;
+			}
+		} else {
+			snprintf(err, errlen, "Unrecognized key: '%s'", tok);
+			r = -1;
+		}
+	}
+
+	return r;
+}
+
+/**
+ * Return a hash of the settings which determine the
+ * reference image (and thus the maximum intensity).
+ */
+uint64_t reference_hash(struct settings *set) {
+	uint64_t h = RESUME_HASH_INIT, v[2] = {set->height, set->width};
+
+	h = resume_hash(h, v, sizeof(v));
+	h = resume_hash(h, &set->visang, sizeof(double));
+	h = resume_hash(h, set->location, sizeof(set->location));
+	h = resume_hash(h, set->direction, sizeof(set->direction));
+
+	return h;
+}
+
+/**
+ * Serve the requests read from 'in' (one per line),
+ * answering each on 'reply'. The maximum intensity
+ * given to the server is used by requests with the
+ * initial camera of the server, and that of the last
+ * reference image rendered is reused by requests with
+ * the same initial camera.
+ *
+ * quit: Set to one when the request 'quit' is received.
+ */
+void serve_stream(s3d_t *s, struct settings *set, double centerpoint[3], FILE *in, FILE *reply, int *quit) {
+	char line[4096], err[256], word[8];
+	struct settings req;
+	uint64_t refhash = 0, serverhash = reference_hash(set), h;
+	double refmax = 0.0, t0;
+
+	while (!*quit && fgets(line, sizeof(line), in) != NULL) {
+		if (sscanf(line, " %7s", word) != 1 || word[0] == '#')
+			continue;
+		if (!strcmp(word, "quit")) {
+			*quit = 1;
+			fprintf(reply, "OK\n");
+			break;
+		}
+
+		/* Settings not given in the request are those
+		 * of the server, for the whole video */
+		req = *set;
+		req.first = 0;
+		req.last_set = 0;
+		req.nshards = 0;
+		req.max_intensity = 0.0;
+		req.verify_kernel = 0;
+
+		if (parse_request(line, &req, err, sizeof(err))) {
+			fprintf(reply, "ERROR %s\n", err);
+			fflush(reply);
+			continue;
+		}
+
+		/* The reference image is only rendered again if
+		 * the settings it depends on have changed */
+		h = reference_hash(&req);
+		if (req.max_intensity <= 0 && set->max_intensity > 0 && h == serverhash)
+			req.max_intensity = set->max_intensity;
+		else if (req.max_intensity <= 0 && refmax > 0 && h == refhash)
+			req.max_intensity = refmax;
+
+		t0 = timing_now();
+		if (render_video(s, &req, centerpoint, -1))
+			fprintf(reply, "ERROR Unable to render frames (see log)\n");
+		else {
+			refhash = h;
+			refmax = req.max_intensity;
+			fprintf(reply, "OK %zu %.3f\n", req.ntodo, timing_now()-t0);
+		}
+
+		fflush(stdout);
+		fflush(reply);
+	}
+}
+
+/**
+ * Serve render requests (see parse_request()) with the
+ * volume 's' kept loaded, either from the Unix domain
+ * socket 'set->serve' or, if it is '-', from stdin.
+ * Requests are rendered one at a time (each using all
+ * threads, as a normal run), in order of arrival, and
+ * answered with a line 'OK <frames> <seconds>' or
+ * 'ERROR <message>'. Clients connecting while a request
+ * is rendered wait in the listen queue. Connections on
+ * which nothing arrives for SERVE_TIMEOUT seconds are
+ * closed, so that an idle client does not hold up the
+ * others. The request 'quit' stops the
+ * server.
+ *
+ * out: File descriptor of the original stdout.
+ */
+int serve(s3d_t *s, struct settings *set, double centerpoint[3], int out) {
+	struct sockaddr_un addr;
+	struct timeval timeout = {SERVE_TIMEOUT, 0};
+	int fd, conn, quit = 0;
+	FILE *in, *reply;
+
+	/* Do not die if a client goes away before its reply */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The kernel only needs to be checked once */
+	if (set->verify_kernel)
+		verify_kernel(s, set);
+
+	if (!strcmp(set->serve, "-")) {
+		reply = fdopen(out, "w");
+		printf("Serving requests from stdin.\n");
+		fflush(stdout);
+
+		serve_stream(s, set, centerpoint, stdin, reply, &quit);
+		fclose(reply);
+		return 0;
+	}
+
+	if (strlen(set->serve) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "ERROR: Socket name is too long: %s.\n", set->serve);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, set->serve);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(set->serve);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		chmod(set->serve, S_IRUSR | S_IWUSR) != 0 || listen(fd, 16) != 0) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to listen on socket: %s.\n", set->serve);
+		return -1;
+	}
+
+	printf("Serving requests on '%s'.\n", set->serve);
+	fflush(stdout);
+
+	while (!quit) {
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR) continue;
+			perror("ERROR");
+			break;
+		}
+
+		if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+			setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+			perror("ERROR");
+			close(conn);
+			continue;
+		}
+
+		in = fdopen(conn, "r");
+		reply = fdopen(dup(conn), "w");
+		serve_stream(s, set, centerpoint, in, reply, &quit);
+		fclose(in);
+		fclose(reply);
+	}
+
+	close(fd);
+	unlink(set->serve);
+
+	return quit ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+	s3d_t *s;
+	struct settings *set;
+	double centerpoint[3], t0;
+	struct stat st;
+	int out = STDOUT_FILENO;
+
+	timing_init();
+	timing_thread_name("main");
+
+	set = parse_options(argc, argv);
+	if (set->convert != NULL)
+		return convert_s3d(set);
+
+	/* When streaming video (or serving requests on stdin),
+	 * stdout may be used for the stream (or replies), so
+	 * all other output is sent to stderr */
+	if (strcmp(set->format, "png") || (set->serve != NULL && !strcmp(set->serve, "-"))) {
+		fflush(stdout);
+		out = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+
+	if (set->retone != NULL) {
+		if (retone_frames(set, out))
+			return -1;
+
+		timing_summary(stdout);
+		return 0;
+	}
+
+	read_settings(set);
+
+	if (set->memory_budget > 0)
+		return render_out_of_core(set, out);
+
+	if (set->camerafile != NULL) {
+		if (strcmp(set->format, "png") || set->encoders > 0) {
+			fprintf(stderr, "ERROR: Additional cameras can only be used with PNG output, without separate encoder threads.\n");
+			return -1;
+		}
+		if (set->parallel != PARALLEL_AUTO && set->parallel != PARALLEL_FRAME) {
+			fprintf(stderr, "ERROR: Additional cameras can only be used with one thread per frame.\n");
+			return -1;
+		}
+
+		read_cameras(set);
+		set->parallel = PARALLEL_FRAME;
+	}
+
+	t0 = timing_now();
+	s = loads3d(set->infile, set->threads);
+	if (s == NULL) return -1;
+
+	timing_add(TIMING_LOAD, t0);
+	if (stat(set->infile, &st) == 0)
+		timing_count(TIMING_BYTES_READ, st.st_size);
+
+	s3d_center(s, centerpoint);
+
+	/* Only keep track of non-zero voxels when rendering */
+	t0 = timing_now();
+	s3d_compact(s);
+	s3d_free_data(s);
+	printf("Non-zero voxels: %zu of %zu (%.2f%%)\n",
+		s->nvoxels, s->pixels*s->pixels*s->pixels,
+		100.0*s->nvoxels / (double)(s->pixels*s->pixels*s->pixels));
+
+	/* Group voxels into bricks, so that bricks outside
+	 * the field of view can be skipped when rendering */
+	s3d_build_bricks(s);
+	timing_add(TIMING_COMPACT, t0);
+	printf("Non-empty bricks: %zu (of %dx%dx%d voxels)\n",
+		s->nbricks, S3D_BRICK_SIZE, S3D_BRICK_SIZE, S3D_BRICK_SIZE);
+
+	/* Move the voxels to their place on NUMA nodes
+	 * (or huge pages), before they are first read */
+	if (set->numa != PLACEMENT_DEFAULT || set->huge_pages) {
+		t0 = timing_now();
+		set->volumes = placement_place_volume(s, set->numa, set->huge_pages, &set->nvolumes);
+		if (set->volumes == NULL) return -1;
+		s = set->volumes[0];
+		timing_add(TIMING_COMPACT, t0);
+		placement_report(set->volumes, set->nvolumes, set->numa, set->huge_pages);
+	}
+
+	/* Determine SOV extents (for the user's convenience) */
+	t0 = timing_now();
+	camera_get_extents(s);
+	timing_add(TIMING_EXTENTS, t0);
+
+	if (set->serve != NULL) {
+		if (serve(s, set, centerpoint, out))
+			return -1;
+	} else if (set->preview > 0) {
+		if (render_preview(s, set, centerpoint))
+			return -1;
+	} else if (render_video(s, set, centerpoint, out))
+		return -1;
+
+	timing_summary(stdout);
+	if (set->trace != NULL && timing_write_trace(set->trace))
+		return -1;
+
 	return 0;
 }
 
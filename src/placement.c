@@ -0,0 +1,435 @@
+/* Placement of the volume and frame buffers in memory (NUMA nodes, huge pages) */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "config.h"
+#ifdef USE_NUMA
+#	include <numa.h>
+#	include <numaif.h>
+#endif
+#include "placement.h"
+#include "s3d.h"
+
+/* Alignment of the arrays of a placed volume (in bytes) */
+#define PLACEMENT_ALIGN 64
+
+/* IDs of the NUMA nodes the process may allocate memory
+ * on (which need not be consecutive, e.g. in a cpuset),
+ * see placement_find_nodes() */
+int *placement_ids = NULL;
+int placement_nids = 0;
+pthread_once_t placement_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Check whether memory can be placed on NUMA nodes
+ * (i.e. s3dvid was compiled with libnuma, and the
+ * system supports NUMA).
+ */
+int placement_available(void) {
+#ifdef USE_NUMA
+	return (numa_available() >= 0);
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Build the list of nodes the process may allocate
+ * memory on, from the nodes allowed by its cpuset. If
+ * NUMA is not available (or the nodes are unknown), the
+ * list consists of node 0 only.
+ */
+static void placement_find_nodes(void) {
+#ifdef USE_NUMA
+	struct bitmask *allowed;
+	int node, n = 0;
+#endif
+
+	placement_ids = malloc(sizeof(int));
+	placement_ids[0] = 0;
+	placement_nids = 1;
+
+#ifdef USE_NUMA
+	if (!placement_available())
+		return;
+
+	allowed = numa_get_mems_allowed();
+	if (allowed == NULL) {
+		perror("WARNING: Unable to determine the NUMA nodes of the process");
+		return;
+	}
+
+	for (node = 0; node <= numa_max_node(); node++)
+		if (numa_bitmask_isbitset(allowed, node)) n++;
+
+	if (n > 0) {
+		placement_ids = realloc(placement_ids, sizeof(int)*n);
+		for (node = 0, n = 0; node <= numa_max_node(); node++)
+			if (numa_bitmask_isbitset(allowed, node))
+				placement_ids[n++] = node;
+		placement_nids = n;
+	}
+
+	numa_bitmask_free(allowed);
+#endif
+}
+
+/**
+ * Return the number of NUMA nodes the process may
+ * allocate memory on (1 if NUMA is not available).
+ */
+int placement_nodes(void) {
+	pthread_once(&placement_once, placement_find_nodes);
+	return placement_nids;
+}
+
+/**
+ * Return the ID of node 'k' (from 0 to placement_nodes()-1)
+ * of the nodes the process may allocate memory on.
+ */
+int placement_node_id(int k) {
+	pthread_once(&placement_once, placement_find_nodes);
+	return placement_ids[k];
+}
+
+static size_t placement_round(size_t size, int huge) {
+	size_t page = huge ? PLACEMENT_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+	return (size + page-1) / page * page;
+}
+
+/**
+ * Allocate 'size' bytes of (zeroed) memory directly
+ * from the kernel, to be placed on NUMA node 'node' as
+ * it is first written. 'node' may also be
+ * PLACEMENT_NODE_INTERLEAVE, to interleave pages across all
+ * nodes, or PLACEMENT_NODE_ANY, to leave placement to
+ * the kernel (usually the node of the thread which
+ * first writes each page).
+ *
+ * huge: If non-zero, the memory is aligned to huge pages
+ *       and backed by (transparent) huge pages where the
+ *       kernel allows.
+ *
+ * The memory must be released with placement_free(),
+ * with the same size and 'huge'. Returns NULL on error.
+ */
+void *placement_alloc(size_t size, int node, int huge) {
+	size_t len = placement_round(size, huge),
+		   extra = (huge ? PLACEMENT_HUGE_PAGE : 0), lead = 0;
+	char *p, *a;
+
+	p = mmap(NULL, len + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	/* Align to a huge page, releasing the rest */
+	a = p;
+	if (huge) {
+		a = (char*)(((uintptr_t)p + PLACEMENT_HUGE_PAGE-1) & ~(uintptr_t)(PLACEMENT_HUGE_PAGE-1));
+		lead = a - p;
+		if (lead > 0) munmap(p, lead);
+		if (extra > lead) munmap(a + len, extra - lead);
+#ifdef MADV_HUGEPAGE
+		madvise(a, len, MADV_HUGEPAGE);
+#endif
+	}
+
+#ifdef USE_NUMA
+	if (node != PLACEMENT_NODE_ANY && placement_available()) {
+		struct bitmask *nodes;
+
+		if (node == PLACEMENT_NODE_INTERLEAVE)
+			nodes = numa_get_mems_allowed();
+		else {
+			nodes = numa_allocate_nodemask();
+			if (nodes != NULL)
+				numa_bitmask_setbit(nodes, node);
+		}
+
+		/* Pages are placed as they are first written (and
+		 * may still end up elsewhere if the node is full) */
+		if (nodes == NULL ||
+			mbind(a, len, node == PLACEMENT_NODE_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_PREFERRED,
+				nodes->maskp, nodes->size+1, 0) != 0)
+			perror("WARNING: Unable to place memory on NUMA node(s)");
+
+		if (nodes != NULL)
+			numa_bitmask_free(nodes);
+	}
+#endif
+
+	return a;
+}
+
+void placement_free(void *p, size_t size, int huge) {
+	munmap(p, placement_round(size, huge));
+}
+
+static size_t placement_align(size_t n) {
+	return (n + PLACEMENT_ALIGN-1) / PLACEMENT_ALIGN * PLACEMENT_ALIGN;
+}
+
+/**
+ * Copy the voxel list and bricks of 's' into a single
+ * block of memory allocated with placement_alloc().
+ * The block is recorded as the memory mapping of the
+ * copy, so that the arrays are not freed individually.
+ */
+static s3d_t *placement_copy_volume(s3d_t *s, int node, int huge) {
+	size_t nb = placement_align(sizeof(s3d_brick_t)*s->nbricks),
+		   nv = placement_align(sizeof(real_t)*s->nvoxels),
+		   size = nb + 4*nv;
+	char *block;
+	s3d_t *c;
+
+	block = placement_alloc(size > 0 ? size : 1, node, huge);
+	if (block == NULL)
+		return NULL;
+
+	c = s3d_new();
+	c->pixels = s->pixels;
+	c->xmin = s->xmin; c->xmax = s->xmax;
+	c->ymin = s->ymin; c->ymax = s->ymax;
+	c->zmin = s->zmin; c->zmax = s->zmax;
+
+	c->nbricks = s->nbricks;
+	c->nvoxels = s->nvoxels;
+	c->bricks = (s->bricks != NULL ? (s3d_brick_t*)block : NULL);
+	c->vx = (real_t*)(block + nb);
+	c->vy = (real_t*)(block + nb + nv);
+	c->vz = (real_t*)(block + nb + 2*nv);
+	c->vi = (real_t*)(block + nb + 3*nv);
+
+	if (s->bricks != NULL)
+		memcpy(c->bricks, s->bricks, sizeof(s3d_brick_t)*s->nbricks);
+	memcpy(c->vx, s->vx, sizeof(real_t)*s->nvoxels);
+	memcpy(c->vy, s->vy, sizeof(real_t)*s->nvoxels);
+	memcpy(c->vz, s->vz, sizeof(real_t)*s->nvoxels);
+	memcpy(c->vi, s->vi, sizeof(real_t)*s->nvoxels);
+
+	c->map = block;
+	c->mapsize = placement_round(size > 0 ? size : 1, huge);
+
+	return c;
+}
+
+/**
+ * Place the voxel list and bricks of the (compacted and
+ * bricked) volume 's' in memory according to 'mode':
+ * interleaved across all NUMA nodes, or replicated on
+ * every node (so that threads can read the copy on their
+ * own node, see placement_pin_thread()). With 'huge',
+ * the volume is also moved to huge pages. The original
+ * volume is released.
+ *
+ * n: On return, the number of copies of the volume
+ *    (copy 'k' is on node placement_node_id(k) when
+ *    replicated).
+ *
+ * Returns the copies, or NULL on error.
+ */
+s3d_t **placement_place_volume(s3d_t *s, enum placement_mode mode, int huge, int *n) {
+	s3d_t **v;
+	int k, node;
+
+	*n = (mode == PLACEMENT_REPLICATE ? placement_nodes() : 1);
+	v = malloc(sizeof(s3d_t*)*(*n));
+
+	if (mode == PLACEMENT_DEFAULT && !huge) {
+		v[0] = s;
+		return v;
+	}
+
+	for (k = 0; k < *n; k++) {
+		if (mode == PLACEMENT_REPLICATE) node = placement_node_id(k);
+		else if (mode == PLACEMENT_INTERLEAVE) node = PLACEMENT_NODE_INTERLEAVE;
+		else node = PLACEMENT_NODE_ANY;
+
+		v[k] = placement_copy_volume(s, node, huge);
+		if (v[k] == NULL) {
+			perror("ERROR");
+			fprintf(stderr, "ERROR: Unable to allocate memory for copy %d of the volume.\n", k);
+			while (k-- > 0) {
+				placement_free(v[k]->map, v[k]->mapsize, 0);
+				free(v[k]);
+			}
+			free(v);
+			return NULL;
+		}
+	}
+
+	s3d_free_voxels(s);
+	s3d_free_data(s);
+	free(s);
+
+	return v;
+}
+
+/**
+ * Pin thread number 'tn' (of 'nthreads') to the CPUs
+ * of one NUMA node, dividing threads evenly among
+ * nodes, with consecutive threads on the same node.
+ * Returns the number of the node (from 0 to
+ * placement_nodes()-1, which is also the copy of a
+ * replicated volume on it), or -1 if the thread could
+ * not be pinned.
+ */
+int placement_pin_thread(int tn, int nthreads) {
+	int k = 0;
+
+#ifdef USE_NUMA
+	if (placement_available()) {
+		k = (int)((long long)tn * placement_nodes() / (nthreads > 0 ? nthreads : 1));
+		if (numa_run_on_node(placement_node_id(k)) != 0) {
+			perror("WARNING: Unable to pin thread to NUMA node");
+			return -1;
+		}
+	}
+#endif
+
+	return k;
+}
+
+/**
+ * Allocate an image (as camera_view_alloc_image()),
+ * optionally on huge pages. The pixels are placed on
+ * the node of the thread which first writes them.
+ */
+real_t **placement_alloc_image(size_t pixelsi, size_t pixelsj, int huge) {
+	size_t i;
+	real_t **img = malloc(sizeof(real_t*)*pixelsi);
+
+	img[0] = placement_alloc(sizeof(real_t)*pixelsi*pixelsj, PLACEMENT_NODE_ANY, huge);
+	if (img[0] == NULL) {
+		free(img);
+		return NULL;
+	}
+
+	for (i = 1; i < pixelsi; i++)
+		img[i] = img[i-1] + pixelsj;
+
+	return img;
+}
+
+void placement_free_image(real_t **img, size_t pixelsi, size_t pixelsj, int huge) {
+	placement_free(img[0], sizeof(real_t)*pixelsi*pixelsj, huge);
+	free(img);
+}
+
+/**
+ * Return the amount of memory (in bytes) of the range
+ * 'p' to 'p+len' which is backed by transparent huge
+ * pages (according to /proc/self/smaps).
+ */
+static size_t placement_huge_bytes(const void *p, size_t len) {
+	char line[256], perms[8];
+	unsigned long a, b, start = (uintptr_t)p, end = start + len;
+	size_t kb, total = 0;
+	int inside = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (f == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		/* Each mapping starts with its address range */
+		if (sscanf(line, "%lx-%lx %7s", &a, &b, perms) == 3)
+			inside = (a < end && b > start);
+		else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			total += kb*1024;
+	}
+
+	fclose(f);
+	return total;
+}
+
+/**
+ * Print the share of the (sampled) pages of the range
+ * 'p' to 'p+len' which are on each NUMA node.
+ */
+static void placement_print_nodes(const void *p, size_t len) {
+#ifdef USE_NUMA
+	size_t page = (size_t)sysconf(_SC_PAGESIZE), npages = (len + page-1) / page,
+		   step, n, k, missing = 0, *count;
+	int nodes = placement_nodes(), node, *status;
+	void **pages;
+
+	step = (npages + PLACEMENT_SAMPLES-1) / PLACEMENT_SAMPLES;
+	if (step == 0) step = 1;
+	n = (npages + step-1) / step;
+
+	pages = malloc(sizeof(void*)*n);
+	status = malloc(sizeof(int)*n);
+	count = calloc(nodes, sizeof(size_t));
+
+	for (k = 0; k < n; k++)
+		pages[k] = (char*)p + k*step*page;
+
+	/* Without target nodes, move_pages() only reports where pages are */
+	if (n == 0 || move_pages(0, n, pages, NULL, status, 0) != 0) {
+		printf(" (page placement unknown)");
+	} else {
+		for (k = 0; k < n; k++) {
+			for (node = 0; node < nodes && placement_node_id(node) != status[k]; node++);
+			if (status[k] >= 0 && node < nodes) count[node]++;
+			else missing++;
+		}
+
+		for (node = 0; node < nodes; node++)
+			printf("%s node %d: %.0f%%", node > 0 ? "," : "", placement_node_id(node), 100.0*count[node]/n);
+		if (missing > 0)
+			printf(", not resident: %.0f%%", 100.0*missing/n);
+	}
+
+	free(pages);
+	free(status);
+	free(count);
+#endif
+}
+
+/**
+ * Print where the copies of the volume (from
+ * placement_place_volume()) have been placed: the
+ * share of their pages on each NUMA node, and how
+ * much of them is backed by huge pages.
+ */
+void placement_report(s3d_t **v, int n, enum placement_mode mode, int huge) {
+	const char *modes[] = {"placed by the system", "interleaved", "replicated"};
+	char thp[128] = "";
+	size_t size;
+	int k;
+	FILE *f;
+
+	printf("Memory placement: %d NUMA node(s), volume %s%s.\n", placement_nodes(),
+		modes[mode], huge ? ", on huge pages" : "");
+
+	for (k = 0; k < n; k++) {
+		if (v[k]->map == NULL)
+			continue;
+
+		size = v[k]->mapsize;
+		printf("  Copy %d: %.1f MB,", k, size/1048576.0);
+		if (mode != PLACEMENT_DEFAULT)
+			placement_print_nodes(v[k]->map, size);
+		if (huge)
+			printf("%s %.0f%% on huge pages", mode != PLACEMENT_DEFAULT ? "," : "",
+				100.0*placement_huge_bytes(v[k]->map, size)/size);
+		printf(".\n");
+	}
+
+	/* Huge pages are only used if the kernel allows */
+	if (huge) {
+		f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+		if (f == NULL || fgets(thp, sizeof(thp), f) == NULL)
+			printf("  Transparent huge pages are not supported by the system.\n");
+		else if (strstr(thp, "[never]") != NULL)
+			printf("  Transparent huge pages are disabled by the system.\n");
+		if (f != NULL) fclose(f);
+	}
+}
@@ -1,10 +1,16 @@
 /* Write PNG with colors according to GeriMap */
 
 #include <math.h>
+#include <omp.h>
 #include <png.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "s3dpng.h"
+#include "timing.h"
 
 const int GERIMAP_COLORS=9;
 uint8_t GERIMAP[9][3] = {
@@ -19,86 +25,280 @@ uint8_t GERIMAP[9][3] = {
 	{255,255,255}
 };
 
-double bitmap_threshold = 1;
+/* GeriMap, sampled at COLORMAP_LUT_SIZE points */
+pixel_t colormap_lut[COLORMAP_LUT_SIZE];
+pthread_once_t colormap_once = PTHREAD_ONCE_INIT;
 
-void set_png_threshold(double mx) {
-	bitmap_threshold = mx;
+/* Compressed PNG file, held in memory before writing */
+typedef struct {
+	png_byte *data;
+	size_t size, capacity;
+} png_buffer_t;
+
+/* Per-thread buffers, reused between frames. These are
+ * thread-local rather than OpenMP threadprivate, since
+ * they are also used by encoder threads (see --encoders)
+ * which are not created by OpenMP. */
+static __thread bitmap_t png_bitmap = {NULL, 0, 0};
+static __thread size_t png_bitmap_size = 0;
+static __thread png_byte **png_rows = NULL;
+static __thread size_t png_nrows = 0;
+static __thread png_buffer_t png_out = {NULL, 0, 0};
+
+/**
+ * Fill in a set of PNG encoder options.
+ *
+ * level:  zlib compression level (0-9, where 0 means
+ *         no compression, or Z_DEFAULT_COMPRESSION).
+ * filter: PNG filter to apply to all rows (one of
+ *         PNG_FILTER_VALUE_*), or PNG_OPT_FILTER_DEFAULT
+ *         to choose adaptively for each row.
+ * rle:    If non-zero, use run-length encoding only
+ *         (much faster than full deflate).
+ * strips: Number of horizontal strips to compress
+ *         independently (and in parallel).
+ */
+void png_options_init(png_options_t *o, int level, int filter, int rle, int strips) {
+	o->level = level;
+	o->filter = filter;
+	o->rle = rle;
+	o->strips = strips > 1 ? strips : 1;
 }
 
 /**
- * Convert a scalar image to a bitmap.
- * Uses GeriMap as colormap.
+ * Build the colormap lookup table, sampling GeriMap
+ * at COLORMAP_LUT_SIZE equidistant points between 0
+ * and the threshold (both included).
  */
-bitmap_t *img2bitmap(double **img, size_t width, size_t height) {
-	long long signed int i, j, index;
-	int gmil;
+void colormap_init(void) {
+	int k, gmil;
 	double gmi, gmif;
-	bitmap_t *bmp;
-
-	bmp = malloc(sizeof(bitmap_t));
-	bmp->pixels = malloc(sizeof(pixel_t)*width*height);
-	bmp->width = width;
-	bmp->height = height;
-
-	/* Generate bitmap image */
-	for (i = width-1, index = 0; i >= 0; i--) {
-		for (j = 0; j < (long long signed int)height; j++, index++) {
-			gmi = (img[i][j]/bitmap_threshold * (GERIMAP_COLORS-1));
-			gmil = floor(gmi);
-			if (gmil >= GERIMAP_COLORS) gmil = GERIMAP_COLORS-1;
-
-			if (gmil >= GERIMAP_COLORS-1) {
-				bmp->pixels[index].red   = GERIMAP[GERIMAP_COLORS-1][0];
-				bmp->pixels[index].green = GERIMAP[GERIMAP_COLORS-1][1];
-				bmp->pixels[index].blue  = GERIMAP[GERIMAP_COLORS-1][2];
-			} else {
-				gmif = gmi - (double)gmil;
-
-				bmp->pixels[index].red   = GERIMAP[gmil][0]+(GERIMAP[gmil+1][0]-GERIMAP[gmil][0])*gmif;
-				bmp->pixels[index].green = GERIMAP[gmil][1]+(GERIMAP[gmil+1][1]-GERIMAP[gmil][1])*gmif;
-				bmp->pixels[index].blue  = GERIMAP[gmil][2]+(GERIMAP[gmil+1][2]-GERIMAP[gmil][2])*gmif;
+
+	for (k = 0; k < COLORMAP_LUT_SIZE; k++) {
+		gmi = ((double)k)/(COLORMAP_LUT_SIZE-1) * (GERIMAP_COLORS-1);
+		gmil = floor(gmi);
+
+		if (gmil >= GERIMAP_COLORS-1) {
+			colormap_lut[k].red   = GERIMAP[GERIMAP_COLORS-1][0];
+			colormap_lut[k].green = GERIMAP[GERIMAP_COLORS-1][1];
+			colormap_lut[k].blue  = GERIMAP[GERIMAP_COLORS-1][2];
+		} else {
+			gmif = gmi - (double)gmil;
+
+			colormap_lut[k].red   = GERIMAP[gmil][0]+(GERIMAP[gmil+1][0]-GERIMAP[gmil][0])*gmif;
+			colormap_lut[k].green = GERIMAP[gmil][1]+(GERIMAP[gmil+1][1]-GERIMAP[gmil][1])*gmif;
+			colormap_lut[k].blue  = GERIMAP[gmil][2]+(GERIMAP[gmil+1][2]-GERIMAP[gmil][2])*gmif;
+		}
+	}
+}
+
+/**
+ * Convert a scalar image to a bitmap, storing the
+ * result in 'bmp' (which must be large enough).
+ * Uses GeriMap as colormap. The first row of the
+ * bitmap is the last row of the image.
+ *
+ * Pixels are mapped through a lookup table, in blocks
+ * of COLORMAP_BLOCK: intensities are first converted to
+ * table indices (which vectorizes), and then looked up.
+ * Values at or above the threshold (or below zero, or
+ * NaN) are clamped to the ends of the colormap.
+ *
+ * rows:      Number of rows in 'img'.
+ * cols:      Number of columns in 'img'.
+ * threshold: Intensity mapped to the top of the colormap.
+ */
+void colormap_image_threshold(real_t **img, size_t rows, size_t cols, double threshold, bitmap_t *bmp) {
+	size_t i, j, k, n;
+	int idx[COLORMAP_BLOCK];
+	const real_t scale = (COLORMAP_LUT_SIZE-1) / threshold,
+		maxidx = COLORMAP_LUT_SIZE-1;
+	pixel_t *out = bmp->pixels;
+	double t0 = timing_now();
+
+	pthread_once(&colormap_once, colormap_init);
+
+	bmp->width = cols;
+	bmp->height = rows;
+
+	/* Rows of the image are read (and the bitmap
+	 * written) contiguously, in reverse row order */
+	for (i = rows; i-- > 0;) {
+		const real_t *row = img[i];
+
+		for (j = 0; j < cols; j += COLORMAP_BLOCK) {
+			n = (cols-j < COLORMAP_BLOCK ? cols-j : COLORMAP_BLOCK);
+
+			#pragma omp simd
+			for (k = 0; k < n; k++) {
+				real_t v = row[j+k] * scale + (real_t)0.5;
+				v = (v > 0 ? v : 0);
+				v = (v < maxidx ? v : maxidx);
+				idx[k] = (int)v;
 			}
+
+			for (k = 0; k < n; k++)
+				*out++ = colormap_lut[idx[k]];
 		}
 	}
 
-	return bmp;
+	timing_add(TIMING_COLORMAP, t0);
 }
 
-pixel_t *pixel_at(bitmap_t *bmp, size_t x, size_t y) {
-	return bmp->pixels + bmp->width*y + x;
-}
+/**
+ * Convert a scalar image to a bitmap, mapping the
+ * intensity 'threshold' to the top of the colormap,
+ * using a buffer which belongs to the calling thread
+ * and is reused between calls. The returned bitmap
+ * must not be freed, and is only valid until the
+ * next call to this function on the same thread.
+ */
+bitmap_t *thread_bitmap_threshold(real_t **img, size_t rows, size_t cols, double threshold) {
+	if (png_bitmap_size < rows*cols) {
+		free(png_bitmap.pixels);
+		png_bitmap.pixels = malloc(sizeof(pixel_t)*rows*cols);
+		png_bitmap_size = rows*cols;
+	}
 
-int saveimg(double **img, size_t width, size_t height, const char *name) {
-	int s;
-	bitmap_t *bmp = img2bitmap(img, width, height);
-	s = savepng(bmp, name);
+	colormap_image_threshold(img, rows, cols, threshold, &png_bitmap);
+	return &png_bitmap;
+}
 
+void freebitmap(bitmap_t *bmp) {
 	free(bmp->pixels);
 	free(bmp);
+}
 
-	return s;
+pixel_t *pixel_at(bitmap_t *bmp, size_t x, size_t y) {
+	return bmp->pixels + bmp->width*y + x;
 }
-int savepng(bitmap_t *bmp, const char *name) {
+
+/**
+ * Save a scalar image as a PNG file, mapping the
+ * intensity 'threshold' to the top of the colormap,
+ * and using the encoder options 'opts'.
+ *
+ * rows: Number of rows in 'img'.
+ * cols: Number of columns in 'img'.
+ */
+int saveimg_options(real_t **img, size_t rows, size_t cols, double threshold, const png_options_t *opts, const char *name) {
+	bitmap_t *bmp = thread_bitmap_threshold(img, rows, cols, threshold);
+
+	return savepng_options(bmp, opts, name);
+}
+
+/**
+ * Create a temporary file (in the same directory as
+ * 'name') to write a PNG image to. Images are only
+ * moved into place (see png_close_file()) once written
+ * completely, so that an existing PNG file is never
+ * partially written (e.g. if s3dvid is killed).
+ *
+ * tmpname: On return, name of the temporary file.
+ */
+static FILE *png_open_file(const char *name, char **tmpname) {
+	size_t l = strlen(name);
 	FILE *f;
-	png_structp png_ptr = NULL;
-	png_infop info_ptr = NULL;
 
-	size_t x, y;
-	png_byte **row_pointers = NULL;
-	int pixel_size = 3;
-	int depth = 8;
+	*tmpname = malloc(l+5);
+	memcpy(*tmpname, name, l);
+	memcpy(*tmpname+l, ".tmp", 5);
 
-	f = fopen(name, "wb");
+	f = fopen(*tmpname, "wb");
 	if (!f) {
 		perror("ERROR");
 		fprintf(stderr, "ERROR: Unable to create PNG file.\n");
+		free(*tmpname);
+	}
+
+	return f;
+}
+
+/**
+ * Close a file opened with png_open_file(), and move
+ * it into place (or remove it if 'err' is non-zero, or
+ * if closing fails). Returns non-zero on error.
+ */
+static int png_close_file(FILE *f, char *tmpname, const char *name, int err) {
+	if (fclose(f) != 0) {
+		perror("ERROR");
+		err = 1;
+	}
+
+	if (err)
+		unlink(tmpname);
+	else if (rename(tmpname, name) != 0) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to create PNG file: %s.\n", name);
+		unlink(tmpname);
+		err = 1;
+	}
+
+	free(tmpname);
+	return err;
+}
+
+/**
+ * libpng output function, appending to
+ * a buffer in memory.
+ */
+static void png_write_buffer(png_structp png_ptr, png_bytep data, png_size_t n) {
+	png_buffer_t *b = png_get_io_ptr(png_ptr);
+
+	if (b->size + n > b->capacity) {
+		b->capacity = 2*(b->size + n);
+		b->data = realloc(b->data, b->capacity);
+	}
+
+	memcpy(b->data + b->size, data, n);
+	b->size += n;
+}
+static void png_flush_buffer(png_structp png_ptr) { }
+
+/**
+ * Write 'n' bytes of PNG data to the file 'name'.
+ */
+static int png_write_file(const char *name, const png_byte *data, size_t n) {
+	double t0 = timing_now();
+	char *tmpname;
+	FILE *f;
+
+	f = png_open_file(name, &tmpname);
+	if (!f) return -1;
+
+	if (fwrite(data, 1, n, f) != n) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to write PNG.\n");
+		png_close_file(f, tmpname, name, 1);
 		return -1;
 	}
 
+	if (png_close_file(f, tmpname, name, 0))
+		return -1;
+
+	timing_add(TIMING_WRITE, t0);
+	timing_count(TIMING_BYTES_WRITTEN, n);
+
+	return 0;
+}
+
+/**
+ * Save a bitmap as a PNG file, using libpng. The image
+ * is first compressed into memory, and then written to
+ * the file at once (so that compression and file
+ * system time can be told apart).
+ */
+static int savepng_libpng(bitmap_t *bmp, const png_options_t *opts, const char *name) {
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+
+	size_t y;
+	int depth = 8;
+	double t0 = timing_now();
+
 	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	if (png_ptr == NULL) {
 		fprintf(stderr, "ERROR: Unable to create PNG 'write struct'.\n");
-		fclose(f);
 		return -1;
 	}
 
@@ -106,14 +306,12 @@ int savepng(bitmap_t *bmp, const char *name) {
 	if (info_ptr == NULL) {
 		fprintf(stderr, "ERROR: Unable to create PNG 'info struct'.\n");
 		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(f);
 		return -1;
 	}
 
 	if (setjmp(png_jmpbuf(png_ptr))) {
 		fprintf(stderr, "ERROR: Unable to write PNG.\n");
 		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(f);
 		return -1;
 	}
 
@@ -129,30 +327,274 @@ int savepng(bitmap_t *bmp, const char *name) {
 		PNG_FILTER_TYPE_DEFAULT
 	);
 
-	/* Initialize rows of PNG */
-	row_pointers = png_malloc(png_ptr, bmp->height * sizeof(png_byte*));
-	for (y = 0; y < bmp->height; y++) {
-		png_byte *row = png_malloc(png_ptr, sizeof(uint8_t)*bmp->width*pixel_size);
-		row_pointers[y] = row;
-		for (x = 0; x < bmp->width; x++) {
-			pixel_t *pixel = pixel_at(bmp, x, y);
-			*row++ = pixel->red;
-			*row++ = pixel->green;
-			*row++ = pixel->blue;
+	png_set_compression_level(png_ptr, opts->level);
+	if (opts->rle)
+		png_set_compression_strategy(png_ptr, Z_RLE);
+	if (opts->filter != PNG_OPT_FILTER_DEFAULT)
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE << opts->filter);
+
+	/* Rows point directly into the bitmap, since
+	 * pixel_t has the same layout as a PNG RGB pixel */
+	if (png_nrows < bmp->height) {
+		free(png_rows);
+		png_rows = malloc(sizeof(png_byte*)*bmp->height);
+		png_nrows = bmp->height;
+	}
+	for (y = 0; y < bmp->height; y++)
+		png_rows[y] = (png_byte*)pixel_at(bmp, 0, y);
+
+	png_out.size = 0;
+	png_set_write_fn(png_ptr, &png_out, png_write_buffer, png_flush_buffer);
+	png_write_info(png_ptr, info_ptr);
+	png_write_image(png_ptr, png_rows);
+	png_write_end(png_ptr, NULL);
+
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	timing_add(TIMING_ENCODE, t0);
+
+	return png_write_file(name, png_out.data, png_out.size);
+}
+
+/**
+ * Paeth predictor (PNG specification, section 9.4).
+ */
+static inline int paeth(int a, int b, int c) {
+	int p = a + b - c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+	if (pa <= pb && pa <= pc) return a;
+	else if (pb <= pc) return b;
+	else return c;
+}
+
+/**
+ * Apply the PNG filter 'type' to one row of 'n' bytes.
+ *
+ * row:  Row to filter.
+ * prev: Previous row (or NULL for the first row of the image).
+ * out:  Filtered row (without the filter type byte).
+ */
+static void filter_row(int type, const uint8_t *row, const uint8_t *prev, size_t n, uint8_t *out) {
+	const size_t bpp = 3;
+	size_t i;
+	int a, b, c;
+
+	for (i = 0; i < n; i++) {
+		a = (i >= bpp ? row[i-bpp] : 0);
+		b = (prev != NULL ? prev[i] : 0);
+		c = (prev != NULL && i >= bpp ? prev[i-bpp] : 0);
+
+		switch (type) {
+			case PNG_FILTER_VALUE_SUB:   out[i] = row[i] - a; break;
+			case PNG_FILTER_VALUE_UP:    out[i] = row[i] - b; break;
+			case PNG_FILTER_VALUE_AVG:   out[i] = row[i] - ((a+b) >> 1); break;
+			case PNG_FILTER_VALUE_PAETH: out[i] = row[i] - paeth(a, b, c); break;
+			default:                     out[i] = row[i]; break;
 		}
 	}
+}
+
+/**
+ * Filter one row, choosing the filter which minimizes
+ * the sum of absolute (signed) differences if
+ * 'filter' is PNG_OPT_FILTER_DEFAULT (the same
+ * heuristic as libpng uses). The filtered row,
+ * including the filter type byte, is written to 'out'.
+ */
+static void filter_row_adaptive(int filter, const uint8_t *row, const uint8_t *prev, size_t n, uint8_t *out, uint8_t *tmp) {
+	int type;
+	size_t i, sum, bestsum = (size_t)-1;
 
-	png_init_io(png_ptr, f);
-	png_set_rows(png_ptr, info_ptr, row_pointers);
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+	if (filter != PNG_OPT_FILTER_DEFAULT) {
+		out[0] = filter;
+		filter_row(filter, row, prev, n, out+1);
+		return;
+	}
 
-	/* Dealloc */
-	for (y = 0; y < bmp->height; y++)
-		png_free(png_ptr, row_pointers[y]);
-	png_free(png_ptr, row_pointers);
+	for (type = PNG_FILTER_VALUE_NONE; type <= PNG_FILTER_VALUE_PAETH; type++) {
+		filter_row(type, row, prev, n, tmp);
+		for (i = 0, sum = 0; i < n; i++)
+			sum += (tmp[i] < 128 ? tmp[i] : 256-tmp[i]);
+
+		if (sum < bestsum) {
+			bestsum = sum;
+			out[0] = type;
+			memcpy(out+1, tmp, n);
+		}
+	}
+}
+
+/**
+ * Write a PNG chunk to the given file.
+ */
+static int write_chunk(FILE *f, const char *type, const uint8_t *data, size_t n) {
+	uint8_t len[4] = {n >> 24, n >> 16, n >> 8, n}, crc[4];
+	uLong c = crc32(0, (const Bytef*)type, 4);
+
+	if (n > 0) c = crc32(c, data, n);
+	crc[0] = c >> 24; crc[1] = c >> 16; crc[2] = c >> 8; crc[3] = c;
+
+	if (fwrite(len, 1, 4, f) != 4 || fwrite(type, 1, 4, f) != 4 ||
+		(n > 0 && fwrite(data, 1, n, f) != n) || fwrite(crc, 1, 4, f) != 4)
+		return -1;
 
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(f);
 	return 0;
 }
 
+/**
+ * Save a bitmap as a PNG file, splitting the image into
+ * 'nstrips' horizontal strips which are filtered and
+ * deflated independently, in parallel. The compressed
+ * strips are concatenated into a single zlib stream
+ * (each but the last ending on a byte boundary with a
+ * sync flush), which makes the file a valid PNG. Since
+ * strips cannot refer back to data in earlier strips,
+ * files are slightly larger than with savepng_libpng().
+ */
+static int savepng_split(bitmap_t *bmp, const png_options_t *opts, const char *name, int nstrips) {
+	static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	size_t rowbytes = 3*bmp->width, i;
+	uint8_t ihdr[13], zhdr[2], adler[4];
+	uint8_t **zdata;
+	size_t *zsize;
+	uLong *zadler, ad;
+	int s, err = 0, level = opts->level;
+	double t0 = timing_now();
+	size_t nbytes;
+	char *tmpname = NULL;
+	FILE *f;
+
+	if ((size_t)nstrips > bmp->height) nstrips = bmp->height;
+	if (nstrips < 1) nstrips = 1;
+
+	zdata = malloc(sizeof(uint8_t*)*nstrips);
+	zsize = malloc(sizeof(size_t)*nstrips);
+	zadler = malloc(sizeof(uLong)*nstrips);
+
+	#pragma omp parallel for schedule(dynamic) num_threads(nstrips) reduction(|:err)
+	for (s = 0; s < nstrips; s++) {
+		size_t r0 = bmp->height*s/nstrips, r1 = bmp->height*(s+1)/nstrips,
+			   rawsize = (r1-r0)*(rowbytes+1), r;
+		uint8_t *raw = malloc(rawsize), *tmp = malloc(rowbytes), *row, *prev;
+		int flush = (s == nstrips-1 ? Z_FINISH : Z_SYNC_FLUSH), ret;
+		size_t used;
+		z_stream zs;
+
+		for (r = r0; r < r1; r++) {
+			row = (uint8_t*)pixel_at(bmp, 0, r);
+			prev = (r > 0 ? (uint8_t*)pixel_at(bmp, 0, r-1) : NULL);
+			filter_row_adaptive(opts->filter, row, prev, rowbytes, raw + (r-r0)*(rowbytes+1), tmp);
+		}
+
+		zadler[s] = adler32(adler32(0, NULL, 0), raw, rawsize);
+
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, opts->level, Z_DEFLATED, -15, 8, opts->rle ? Z_RLE : Z_DEFAULT_STRATEGY) != Z_OK) {
+			err = 1;
+			zdata[s] = NULL;
+		} else {
+			zsize[s] = deflateBound(&zs, rawsize) + 16;
+			zdata[s] = malloc(zsize[s]);
+
+			zs.next_in = raw;
+			zs.avail_in = rawsize;
+			zs.next_out = zdata[s];
+			zs.avail_out = zsize[s];
+
+			/* Output may be left pending if the buffer fills
+			 * up, in which case the buffer is grown: the last
+			 * strip is complete once the stream has ended, and
+			 * the others once the flush left room to spare */
+			for (;;) {
+				ret = deflate(&zs, flush);
+				if (ret == Z_STREAM_ERROR || (ret == Z_BUF_ERROR && zs.avail_out > 0)) {
+					err = 1;
+					break;
+				}
+				if (flush == Z_FINISH ? ret == Z_STREAM_END : (zs.avail_in == 0 && zs.avail_out > 0))
+					break;
+				if (zs.avail_out == 0) {
+					used = zsize[s];
+					zsize[s] *= 2;
+					zdata[s] = realloc(zdata[s], zsize[s]);
+					zs.next_out = zdata[s] + used;
+					zs.avail_out = zsize[s] - used;
+				}
+			}
+
+			zsize[s] -= zs.avail_out;
+			deflateEnd(&zs);
+		}
+
+		free(raw);
+		free(tmp);
+	}
+
+	/* Combine checksums of strips */
+	ad = zadler[0];
+	for (s = 1; s < nstrips; s++) {
+		size_t len = (bmp->height*(s+1)/nstrips - bmp->height*s/nstrips) * (rowbytes+1);
+		ad = adler32_combine(ad, zadler[s], len);
+	}
+
+	timing_add(TIMING_ENCODE, t0);
+	t0 = timing_now();
+
+	f = png_open_file(name, &tmpname);
+	if (!f) {
+		err = 1;
+	} else if (!err) {
+		ihdr[0] = bmp->width >> 24; ihdr[1] = bmp->width >> 16; ihdr[2] = bmp->width >> 8; ihdr[3] = bmp->width;
+		ihdr[4] = bmp->height >> 24; ihdr[5] = bmp->height >> 16; ihdr[6] = bmp->height >> 8; ihdr[7] = bmp->height;
+		ihdr[8] = 8;		/* Bit depth */
+		ihdr[9] = 2;		/* Color type (RGB) */
+		ihdr[10] = ihdr[11] = ihdr[12] = 0;	/* Compression, filter, interlace */
+
+		/* zlib header (32K window, compression level hint) */
+		zhdr[0] = 0x78;
+		zhdr[1] = (level >= 0 && level < 2) ? 0x01 : (level >= 0 && level < 6 ? 0x5E : (level == 6 || level < 0 ? 0x9C : 0xDA));
+		adler[0] = ad >> 24; adler[1] = ad >> 16; adler[2] = ad >> 8; adler[3] = ad;
+
+		err |= (fwrite(signature, 1, 8, f) != 8);
+		err |= write_chunk(f, "IHDR", ihdr, 13);
+		err |= write_chunk(f, "IDAT", zhdr, 2);
+		for (s = 0; s < nstrips; s++)
+			err |= write_chunk(f, "IDAT", zdata[s], zsize[s]);
+		err |= write_chunk(f, "IDAT", adler, 4);
+		err |= write_chunk(f, "IEND", NULL, 0);
+	}
+
+	if (f != NULL && png_close_file(f, tmpname, name, err))
+		err = 1;
+
+	if (!err) {
+		/* Signature, and IHDR, IDAT and IEND chunks
+		 * (each with 12 bytes of length, type and CRC) */
+		nbytes = 8 + (12+13) + (12+2) + (12+4) + 12;
+		for (s = 0; s < nstrips; s++)
+			nbytes += 12 + zsize[s];
+
+		timing_add(TIMING_WRITE, t0);
+		timing_count(TIMING_BYTES_WRITTEN, nbytes);
+	}
+
+	if (err)
+		fprintf(stderr, "ERROR: Unable to write PNG.\n");
+
+	for (i = 0; i < (size_t)nstrips; i++)
+		free(zdata[i]);
+	free(zdata);
+	free(zsize);
+	free(zadler);
+
+	return err ? -1 : 0;
+}
+
+/**
+ * Save a bitmap as a PNG file, using the encoder
+ * options 'opts'.
+ */
+int savepng_options(bitmap_t *bmp, const png_options_t *opts, const char *name) {
+	if (opts->strips > 1)
+		return savepng_split(bmp, opts, name, opts->strips);
+	else
+		return savepng_libpng(bmp, opts, name);
+}
@@ -0,0 +1,241 @@
+/* Resume interrupted runs, by keeping a manifest of written frames */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "resume.h"
+
+/**
+ * Add 'n' bytes of 'data' to the (64-bit FNV-1a)
+ * hash 'h'. Start from RESUME_HASH_INIT.
+ */
+uint64_t resume_hash(uint64_t h, const void *data, size_t n) {
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/**
+ * Return the key identifying the contents of frame
+ * number 'index', which is rendered at camera angle
+ * 'angle' using the settings of the manifest. Frames
+ * are only reused if their key is unchanged.
+ */
+uint64_t resume_frame_key(resume_t *r, size_t index, double angle) {
+	uint64_t h = r->settings, i = index;
+
+	h = resume_hash(h, &i, sizeof(i));
+	h = resume_hash(h, &angle, sizeof(angle));
+
+	return h;
+}
+
+/**
+ * Add a frame to the in-memory list of frames.
+ */
+static void resume_add(resume_t *r, size_t index, uint64_t key, uint64_t size) {
+	if (r->n == r->capacity) {
+		r->capacity = r->capacity > 0 ? 2*r->capacity : 256;
+		r->frames = realloc(r->frames, sizeof(resume_frame_t)*r->capacity);
+	}
+
+	r->frames[r->n].index = index;
+	r->frames[r->n].key = key;
+	r->frames[r->n].size = size;
+	r->frames[r->n].seq = r->n;
+	r->n++;
+}
+
+static int resume_compare(const void *a, const void *b) {
+	const resume_frame_t *fa = a, *fb = b;
+
+	if (fa->index != fb->index)
+		return fa->index < fb->index ? -1 : 1;
+	/* Later records of the same frame come first */
+	else
+		return fa->seq > fb->seq ? -1 : (fa->seq < fb->seq ? 1 : 0);
+}
+
+/**
+ * Sort the list of frames by index, keeping
+ * only the latest record of each frame.
+ */
+static void resume_sort(resume_t *r) {
+	size_t k, n = 0;
+
+	qsort(r->frames, r->n, sizeof(resume_frame_t), resume_compare);
+
+	for (k = 0; k < r->n; k++) {
+		if (n == 0 || r->frames[k].index != r->frames[n-1].index)
+			r->frames[n++] = r->frames[k];
+	}
+
+	r->n = n;
+}
+
+/**
+ * Find the record of frame 'index' (or
+ * return NULL if there is none).
+ */
+static resume_frame_t *resume_find(resume_t *r, size_t index) {
+	size_t a = 0, b = r->n, m;
+
+	while (a < b) {
+		m = (a+b) / 2;
+		if (r->frames[m].index < index) a = m+1;
+		else b = m;
+	}
+
+	return (a < r->n && r->frames[a].index == index) ? r->frames + a : NULL;
+}
+
+/**
+ * Read the frames recorded in an existing manifest,
+ * if it was written with the same settings. Returns
+ * the number of frames read, or -1 if the manifest
+ * does not exist or does not match.
+ */
+static long long signed int resume_read(resume_t *r) {
+	char magic[32];
+	unsigned long long settings, key, size;
+	size_t index;
+	int version;
+	FILE *f;
+
+	f = fopen(r->filename, "r");
+	if (f == NULL) return -1;
+
+	if (fscanf(f, "%31s %d %llx", magic, &version, &settings) != 3 ||
+		strcmp(magic, RESUME_MAGIC) || version != RESUME_VERSION ||
+		settings != r->settings) {
+		fclose(f);
+		return -1;
+	}
+
+	/* An incomplete last line (if interrupted
+	 * while writing it) is ignored */
+	while (fscanf(f, " frame %zu %llx %llu", &index, &key, &size) == 3)
+		resume_add(r, index, key, size);
+
+	fclose(f);
+	resume_sort(r);
+
+	return r->n;
+}
+
+/**
+ * Open the manifest 'filename', for frames rendered
+ * with the settings identified by the hash 'settings'
+ * (which should cover everything that affects the
+ * contents of frames). Frames recorded by earlier runs
+ * with the same settings are kept, and all others are
+ * forgotten. The manifest is then rewritten (atomically),
+ * and frames are appended to it as they are written.
+ */
+resume_t *resume_open(const char *filename, uint64_t settings) {
+	resume_t *r = malloc(sizeof(resume_t));
+	size_t l = strlen(filename), k;
+	char *tmpname;
+	long long signed int n;
+	FILE *f;
+
+	r->filename = malloc(l+1);
+	memcpy(r->filename, filename, l+1);
+	r->settings = settings;
+	r->n = r->capacity = 0;
+	r->frames = NULL;
+
+	n = resume_read(r);
+	if (n >= 0)
+		printf("Resuming: %lld frame(s) recorded in '%s'.\n", n, filename);
+	else
+		printf("Resuming: no frames rendered with the current settings recorded in '%s'.\n", filename);
+
+	tmpname = malloc(l+5);
+	memcpy(tmpname, filename, l);
+	memcpy(tmpname+l, ".tmp", 5);
+
+	f = fopen(tmpname, "w");
+	if (f == NULL) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to create manifest: %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(f, "%s %d %016" PRIx64 "\n", RESUME_MAGIC, RESUME_VERSION, settings);
+	for (k = 0; k < r->n; k++)
+		fprintf(f, "frame %zu %016" PRIx64 " %" PRIu64 "\n",
+			r->frames[k].index, r->frames[k].key, r->frames[k].size);
+
+	if (fclose(f) != 0 || rename(tmpname, filename) != 0) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to write manifest: %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	free(tmpname);
+
+	r->f = fopen(filename, "a");
+	if (r->f == NULL) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to open manifest: %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+
+	return r;
+}
+
+/**
+ * Check whether frame number 'index' (with the given
+ * key) has already been written to the file 'name',
+ * and is still there (with the size it was written with).
+ */
+int resume_is_done(resume_t *r, size_t index, uint64_t key, const char *name) {
+	resume_frame_t *fr = resume_find(r, index);
+	struct stat st;
+
+	if (fr == NULL || fr->key != key)
+		return 0;
+
+	return (stat(name, &st) == 0 && (uint64_t)st.st_size == fr->size);
+}
+
+/**
+ * Record that frame number 'index' has been written
+ * (completely) to the file 'name'. May be called from
+ * any thread. Returns non-zero on error.
+ */
+int resume_record(resume_t *r, size_t index, uint64_t key, const char *name) {
+	struct stat st;
+	int err;
+
+	if (stat(name, &st) != 0)
+		return -1;
+
+	pthread_mutex_lock(&r->lock);
+	fprintf(r->f, "frame %zu %016" PRIx64 " %" PRIu64 "\n", index, key, (uint64_t)st.st_size);
+	err = (fflush(r->f) != 0);
+	pthread_mutex_unlock(&r->lock);
+
+	return err ? -1 : 0;
+}
+
+void resume_close(resume_t *r) {
+	fclose(r->f);
+	pthread_mutex_destroy(&r->lock);
+
+	free(r->filename);
+	free(r->frames);
+	free(r);
+}
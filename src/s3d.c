@@ -1,34 +1,56 @@
 /* Handle S3D loading */
 
-#include <mat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "config.h"
 #include "s3d.h"
-
-void s3d_center(s3d_t *s, double cp[3]) {
-	cp[0] = (s->xmax+s->xmin) * 0.5;
-	cp[1] = (s->ymax+s->ymin) * 0.5;
-	cp[2] = (s->zmax+s->zmin) * 0.5;
+#include "s3dcache.h"
+
+/* Held while calling the HDF5 or MATLAB libraries,
+ * which are (generally) not thread safe */
+static pthread_mutex_t s3d_library_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Take (or release) the lock which serializes calls
+ * into the HDF5 and MATLAB libraries, so that S3D
+ * files may be loaded from several threads at once.
+ */
+void s3d_lock_library(void) {
+	pthread_mutex_lock(&s3d_library_lock);
+}
+void s3d_unlock_library(void) {
+	pthread_mutex_unlock(&s3d_library_lock);
 }
 
-double ***get_image(MATFile *mfp, const char *name, size_t pixels) {
-	double *ptr, ***img, **tmp1;
-	mxArray *arr;
-	size_t m, n, pixels2 = pixels*pixels, pixels3 = pixels2*pixels,
-		   i, j;
-
-	arr = matGetVariable(mfp, name);
-	if (arr == NULL || mxIsEmpty(arr)) {
-		fprintf(stderr, "ERROR: Variable '%s' does not exist in the S3D file.\n", name);
-		return NULL;
-	}
+/**
+ * Allocate a new, empty, S3D object.
+ */
+s3d_t *s3d_new(void) {
+	s3d_t *s = malloc(sizeof(s3d_t));
+
+	s->data = NULL;
+	s->pixels = 0;
+	s->nvoxels = 0;
+	s->vx = s->vy = s->vz = s->vi = NULL;
+	s->nbricks = 0;
+	s->bricks = NULL;
+	s->buffer = NULL;
+	s->map = NULL;
+	s->mapsize = 0;
 
-	m = mxGetM(arr);
-	n = mxGetN(arr);
+	return s;
+}
 
-	ptr = mxGetPr(arr);
-	if (!((m == 1 && n == pixels3) || (n == 1 && m != pixels3))) {
-		fprintf(stderr, "ERROR: Invalid dimensions of S3D image (m = %zu, n = %zu, pixels^3 = %zu).\n", m, n, pixels3);
-		return NULL;
-	}
+/**
+ * Create an index into the (contiguous) S3D data
+ * cube 'ptr', so that element (i,j,k) can be
+ * accessed as 'img[i][j][k]'.
+ */
+double ***s3d_index(double *ptr, size_t pixels) {
+	double ***img, **tmp1;
+	size_t pixels2 = pixels*pixels, i, j;
 
 	img = malloc(sizeof(double**)*pixels);
 	tmp1 = malloc(sizeof(double*)*pixels*pixels);
@@ -39,55 +61,170 @@ double ***get_image(MATFile *mfp, const char *name, size_t pixels) {
 		}
 	}
 
-	/* We don't destroy the mxArray, to avoid
-	 * taking up twice as much memory. */
-	/*mxDestroyArray(arr);*/
-
 	return img;
 }
-double get_scalar(MATFile *mfp, const char *name) {
-	mxArray *arr;
 
-	arr = matGetVariable(mfp, name);
-	if (arr == NULL || mxIsEmpty(arr)) {
-		fprintf(stderr, "ERROR: Variable '%s' does not exist in the S3D file.\n", name);
-		exit(EXIT_FAILURE);
-	}
-	if (!mxIsScalar(arr)) {
-		fprintf(stderr, "ERROR: Unrecognized type of '%s'.\n", name);
-		exit(EXIT_FAILURE);
-	}
+void s3d_center(s3d_t *s, double cp[3]) {
+	cp[0] = (s->xmax+s->xmin) * 0.5;
+	cp[1] = (s->ymax+s->ymin) * 0.5;
+	cp[2] = (s->zmax+s->zmin) * 0.5;
+}
 
-	return mxGetScalar(arr);
+/**
+ * Build the list of non-zero voxels from the
+ * dense data cube. Since SOV images are mostly
+ * empty, iterating over this list (rather than
+ * the full cube) makes the cost of rendering a
+ * frame proportional to the number of non-zero
+ * voxels.
+ *
+ * Voxels are stored in the same order, and their
+ * positions computed in exactly the same way, as
+ * when traversing the cube directly.
+ */
+void s3d_compact(s3d_t *s) {
+	/* Already compacted (e.g. loaded from a sparse cache file) */
+	if (s->vx != NULL)
+		return;
+
+	s3d_compact_planes(s, s->data[0][0], 0, s->pixels);
+}
+
+/**
+ * Build the list of non-zero voxels from planes
+ * 'first' to 'first+n-1' (along x) of the data cube,
+ * replacing any previous voxel list (and bricks).
+ * The planes are stored contiguously in 'planes'.
+ * This allows a volume which does not fit in memory
+ * to be processed one slab at a time (see s3dslab.c).
+ */
+void s3d_compact_planes(s3d_t *s, const double *planes, size_t first, size_t n) {
+	size_t i, j, k, nv, pixels2 = s->pixels*s->pixels;
+	double dx = (s->xmax-s->xmin)/(s->pixels-1),
+		   dy = (s->ymax-s->ymin)/(s->pixels-1),
+		   dz = (s->zmax-s->zmin)/(s->pixels-1),
+		   idx, jdy, kdz;
+	const double *p;
+
+	s3d_free_voxels(s);
+
+	/* Count non-zero elements */
+	nv = 0;
+	for (i = 0; i < n*pixels2; i++)
+		if (planes[i] != 0) nv++;
+
+	s->nvoxels = nv;
+	s->vx = malloc(sizeof(real_t)*nv);
+	s->vy = malloc(sizeof(real_t)*nv);
+	s->vz = malloc(sizeof(real_t)*nv);
+	s->vi = malloc(sizeof(real_t)*nv);
+
+	/* Offset of the first plane is accumulated in
+	 * the same way as when starting from plane 0 */
+	idx = 0;
+	for (i = 0; i < first; i++)
+		idx += dx;
+
+	nv = 0;
+	for (i=0; i < n; i++, idx+=dx) {
+		for (j=0, jdy=0; j < s->pixels; j++, jdy+=dy) {
+			p = planes + i*pixels2 + j*s->pixels;
+			for (k=0, kdz=0; k < s->pixels; k++, kdz+=dz) {
+				if (p[k] == 0) continue;
+
+				s->vx[nv] = s->xmin+idx;
+				s->vy[nv] = s->ymin+jdy;
+				s->vz[nv] = s->zmin+kdz;
+				s->vi[nv] = p[k];
+				nv++;
+			}
+		}
+	}
 }
-s3d_t *loads3d(const char *filename) {
-	MATFile *mfp;
-	s3d_t *s;
-
-	mfp = matOpen(filename, "r");
-	if (mfp == NULL) {
-		fprintf(stderr, "ERROR: Unable to open S3D file: %s.\n", filename);
-		return NULL;
+
+/**
+ * Release the list of non-zero voxels and the bricks
+ * (unless they are mapped from a cache file, or placed
+ * by placement_place_volume()).
+ */
+void s3d_free_voxels(s3d_t *s) {
+	char *m = s->map;
+
+	if (s->vx != NULL && !(m != NULL && (char*)s->vx >= m && (char*)s->vx < m + s->mapsize)) {
+		free(s->vx);
+		free(s->vy);
+		free(s->vz);
+		free(s->vi);
 	}
 
-	s = malloc(sizeof(s3d_t));
+	/* Bricks are only mapped along with the voxels of placed volumes */
+	if (!(m != NULL && (char*)s->bricks >= m && (char*)s->bricks < m + s->mapsize))
+		free(s->bricks);
 
-	/* pixels */
-	s->pixels = (size_t)get_scalar(mfp, "pixels");
+	s->vx = s->vy = s->vz = s->vi = NULL;
+	s->nvoxels = 0;
+	s->bricks = NULL;
+	s->nbricks = 0;
+}
 
-	/* Bounds */
-	s->xmin = get_scalar(mfp, "xmin");
-	s->xmax = get_scalar(mfp, "xmax");
-	s->ymin = get_scalar(mfp, "ymin");
-	s->ymax = get_scalar(mfp, "ymax");
-	s->zmin = get_scalar(mfp, "zmin");
-	s->zmax = get_scalar(mfp, "zmax");
+/**
+ * Release the dense data cube (and any memory
+ * mapping no longer referenced), once the list of
+ * non-zero voxels has been built. Data read by the
+ * MATLAB library is not owned by the S3D object,
+ * and is not released.
+ */
+void s3d_free_data(s3d_t *s) {
+	char *m = s->map;
+
+	if (s->data != NULL) {
+		free(s->buffer);
+		free(s->data[0]);
+		free(s->data);
+
+		s->data = NULL;
+		s->buffer = NULL;
+	}
 
-	/* Data */
-	s->data = get_image(mfp, "image", s->pixels);
+	if (m != NULL && !((char*)s->vx >= m && (char*)s->vx < m + s->mapsize)) {
+		munmap(s->map, s->mapsize);
+		s->map = NULL;
+		s->mapsize = 0;
+	}
+}
 
-	matClose(mfp);
+/**
+ * Load an S3D file. s3dvid cache files (and cache
+ * data in shared memory) are mapped directly into
+ * memory, MAT v7.3 files (which are HDF5 files) are
+ * read using libhdf5 if available, and all other
+ * files using the MATLAB MAT-file library.
+ *
+ * threads: Number of threads to read the file with
+ *          (where supported by the file format).
+ *
+ * May be called from several threads at once, though
+ * files read through the HDF5 or MATLAB libraries are
+ * then read one at a time.
+ */
+s3d_t *loads3d(const char *filename, int threads) {
+	s3d_t *s = NULL;
+
+	if (s3dcache_is_handle(filename) || s3d_is_cache(filename))
+		return loads3d_cache(filename);
+
+	s3d_lock_library();
+#ifdef USE_HDF5
+	if (s3d_is_hdf5(filename))
+		s = loads3d_hdf5(filename, threads > 1 ? threads : 1);
+	else
+#endif
+#ifdef USE_MATLAB
+		s = loads3d_mat(filename);
+#else
+		fprintf(stderr, "ERROR: Unable to load S3D file '%s': Not a MAT v7.3 (HDF5) file, and s3dvid was compiled without MATLAB support.\n", filename);
+#endif
+	s3d_unlock_library();
 
 	return s;
 }
-
@@ -0,0 +1,491 @@
+/* Load S3D files saved in MAT v7.3 (HDF5) format */
+
+#include <hdf5.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include "s3d.h"
+#include "s3dslab.h"
+
+/* Number of elements to read at a time
+ * when reading through the HDF5 library */
+#define HDF5_SLAB_SIZE (1<<22)
+
+/**
+ * Check whether the given file is an
+ * HDF5 (i.e. MAT v7.3) file.
+ */
+int s3d_is_hdf5(const char *filename) {
+	htri_t r;
+
+	H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+	r = H5Fis_hdf5(filename);
+
+	return (r > 0);
+}
+
+/**
+ * Read a scalar variable from the file.
+ */
+double hdf5_get_scalar(hid_t file, const char *name) {
+	hid_t dset, space;
+	hssize_t n;
+	double v;
+
+	dset = H5Dopen2(file, name, H5P_DEFAULT);
+	if (dset < 0) {
+		fprintf(stderr, "ERROR: Variable '%s' does not exist in the S3D file.\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	space = H5Dget_space(dset);
+	n = H5Sget_simple_extent_npoints(space);
+	H5Sclose(space);
+
+	if (n != 1 || H5Dread(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &v) < 0) {
+		fprintf(stderr, "ERROR: Unrecognized type of '%s'.\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	H5Dclose(dset);
+	return v;
+}
+
+/**
+ * Undo the HDF5 shuffle filter on 'n' bytes of
+ * data, consisting of elements of 'size' bytes.
+ */
+void hdf5_unshuffle(const uint8_t *in, uint8_t *out, size_t n, size_t size) {
+	size_t i, b, nelem = n / size;
+
+	for (b = 0; b < size; b++)
+		for (i = 0; i < nelem; i++)
+			out[i*size + b] = in[b*nelem + i];
+
+	/* Trailing bytes are not shuffled */
+	memcpy(out + nelem*size, in + nelem*size, n - nelem*size);
+}
+
+/**
+ * Read a contiguous, unfiltered dataset directly from
+ * the file (bypassing the HDF5 library), in parallel.
+ *
+ * offset:  Absolute offset of the data in the file.
+ * n:       Number of elements to read.
+ * buf:     Buffer to read data into.
+ * threads: Number of threads to read with.
+ */
+int hdf5_read_contiguous(const char *filename, off_t offset, size_t n, double *buf, int threads) {
+	int fd, err = 0;
+	long long signed int slab, nslabs = (n + HDF5_SLAB_SIZE - 1) / HDF5_SLAB_SIZE;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+
+	#pragma omp parallel for schedule(dynamic) num_threads(threads) reduction(|:err)
+	for (slab = 0; slab < nslabs; slab++) {
+		size_t start = slab*HDF5_SLAB_SIZE,
+			   len = (n-start < HDF5_SLAB_SIZE ? n-start : HDF5_SLAB_SIZE) * sizeof(double),
+			   done = 0;
+		ssize_t r;
+		char *dst = (char*)(buf + start);
+
+		while (done < len) {
+			r = pread(fd, dst+done, len-done, offset + start*sizeof(double) + done);
+			if (r <= 0) { err = 1; break; }
+			done += r;
+		}
+	}
+
+	close(fd);
+	return err ? -1 : 0;
+}
+
+/**
+ * Read a chunked dataset by reading the raw (deflated)
+ * chunks from the file and decompressing them in
+ * parallel, directly into 'buf'. Only datasets which
+ * are effectively one-dimensional (as S3D images are)
+ * and compressed with deflate (and possibly shuffle)
+ * are supported. Returns 1 if the dataset cannot be
+ * read in this way.
+ *
+ * dim:       Index of the dataset dimension which is not 1.
+ * userblock: Size of the user block at the start of the file.
+ * threads:   Number of threads to decompress chunks with.
+ */
+int hdf5_read_chunked(
+	const char *filename, hid_t dset, hid_t dcpl, int dim,
+	hsize_t userblock, size_t n, double *buf, int threads
+) {
+	int i, nfilters, shuffle = -1, deflate = -1, fd, err = 0, ret;
+	long long signed int c;
+	hsize_t nchunks, chunkdims[2], chunklen;
+	hid_t space;
+	unsigned flags;
+	size_t nelmts = 0;
+	unsigned cd_values[8];
+	H5Z_filter_t filter;
+
+	if (H5Pget_chunk(dcpl, 2, chunkdims) < 0)
+		return 1;
+	chunklen = chunkdims[dim];
+
+	/* Check filters */
+	nfilters = H5Pget_nfilters(dcpl);
+	for (i = 0; i < nfilters; i++) {
+		nelmts = 8;
+		filter = H5Pget_filter2(dcpl, i, &flags, &nelmts, cd_values, 0, NULL, NULL);
+		if (filter == H5Z_FILTER_SHUFFLE && deflate < 0) shuffle = i;
+		else if (filter == H5Z_FILTER_DEFLATE) deflate = i;
+		else return 1;
+	}
+
+	space = H5Dget_space(dset);
+	if (H5Dget_num_chunks(dset, space, &nchunks) < 0) {
+		H5Sclose(space);
+		return 1;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		H5Sclose(space);
+		return 1;
+	}
+
+	/* Chunk locations are looked up serially, since
+	 * the HDF5 library is (generally) not thread safe */
+	hsize_t (*offsets)[2] = malloc(sizeof(hsize_t[2])*nchunks);
+	haddr_t *addrs = malloc(sizeof(haddr_t)*nchunks);
+	hsize_t *sizes = malloc(sizeof(hsize_t)*nchunks);
+	unsigned *masks = malloc(sizeof(unsigned)*nchunks);
+
+	for (c = 0; c < (long long signed)nchunks; c++) {
+		if (H5Dget_chunk_info(dset, space, c, offsets[c], masks+c, addrs+c, sizes+c) < 0)
+			break;
+	}
+	H5Sclose(space);
+
+	/* Fall back to reading through the library if
+	 * the chunks could not be located */
+	ret = (c < (long long signed)nchunks ? 1 : 0);
+
+	if (ret == 0) {
+		#pragma omp parallel num_threads(threads) reduction(|:err)
+		{
+			size_t rawsize = 0, chunkbytes = chunklen*sizeof(double), done, len;
+			uint8_t *raw = NULL, *tmp = malloc(chunkbytes),
+				*unshuffled = (shuffle >= 0 ? malloc(chunkbytes) : NULL);
+			uLongf destlen;
+			ssize_t r;
+
+			#pragma omp for schedule(dynamic)
+			for (c = 0; c < (long long signed)nchunks; c++) {
+				if (err) continue;
+
+				if (rawsize < sizes[c]) {
+					free(raw);
+					rawsize = sizes[c];
+					raw = malloc(rawsize);
+				}
+
+				for (done = 0; done < sizes[c]; done += r) {
+					r = pread(fd, raw+done, sizes[c]-done, addrs[c] + userblock + done);
+					if (r <= 0) break;
+				}
+				if (done < sizes[c]) { err = 1; continue; }
+
+				/* Filters are applied in order (shuffle, then deflate)
+				 * and must be undone in reverse order */
+				destlen = chunkbytes;
+				if (deflate >= 0 && !(masks[c] & (1 << deflate))) {
+					if (uncompress(tmp, &destlen, raw, sizes[c]) != Z_OK) { err = 1; continue; }
+				} else {
+					destlen = sizes[c] < chunkbytes ? sizes[c] : chunkbytes;
+					memcpy(tmp, raw, destlen);
+				}
+
+				/* Edge chunks are padded to the full chunk size */
+				len = n - offsets[c][dim];
+				if (len > chunklen) len = chunklen;
+
+				if (shuffle >= 0 && !(masks[c] & (1 << shuffle))) {
+					hdf5_unshuffle(tmp, unshuffled, destlen, sizeof(double));
+					memcpy(buf + offsets[c][dim], unshuffled, len*sizeof(double));
+				} else
+					memcpy(buf + offsets[c][dim], tmp, len*sizeof(double));
+			}
+
+			free(raw);
+			free(tmp);
+			free(unshuffled);
+		}
+	}
+
+	free(offsets);
+	free(addrs);
+	free(sizes);
+	free(masks);
+	close(fd);
+
+	return err ? -1 : ret;
+}
+
+/**
+ * Read elements 'first' to 'first+n-1' of the dataset
+ * through the HDF5 library, in slabs of HDF5_SLAB_SIZE
+ * elements, directly into 'buf'.
+ *
+ * dim: Index of the dataset dimension which is not 1.
+ */
+int hdf5_read_slabs(hid_t dset, int dim, size_t first, size_t n, double *buf) {
+	hid_t fspace, mspace;
+	hsize_t start[2] = {0,0}, count[2] = {1,1}, mcount;
+	size_t i;
+	int err = 0;
+
+	fspace = H5Dget_space(dset);
+	for (i = 0; i < n && !err; i += HDF5_SLAB_SIZE) {
+		mcount = (n-i < HDF5_SLAB_SIZE ? n-i : HDF5_SLAB_SIZE);
+
+		start[dim] = first+i;
+		count[dim] = mcount;
+		H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count, NULL);
+		mspace = H5Screate_simple(1, &mcount, NULL);
+
+		if (H5Dread(dset, H5T_NATIVE_DOUBLE, mspace, fspace, H5P_DEFAULT, buf+i) < 0)
+			err = 1;
+
+		H5Sclose(mspace);
+	}
+	H5Sclose(fspace);
+
+	return err ? -1 : 0;
+}
+
+/**
+ * Open the S3D image dataset of the given (open) file,
+ * and check its dimensions. Returns a negative value
+ * on error.
+ *
+ * dim: On return, index of the dataset dimension
+ *      which is not 1.
+ */
+hid_t hdf5_open_image(hid_t file, const char *name, size_t pixels, int *dim) {
+	hid_t dset, space;
+	hsize_t dims[2] = {1,1};
+	size_t pixels3 = pixels*pixels*pixels;
+	int rank;
+
+	dset = H5Dopen2(file, name, H5P_DEFAULT);
+	if (dset < 0) {
+		fprintf(stderr, "ERROR: Variable '%s' does not exist in the S3D file.\n", name);
+		return -1;
+	}
+
+	space = H5Dget_space(dset);
+	rank = H5Sget_simple_extent_ndims(space);
+	if (rank >= 1 && rank <= 2)
+		H5Sget_simple_extent_dims(space, dims, NULL);
+	H5Sclose(space);
+
+	/* MATLAB stores column/row vectors as 2D arrays */
+	*dim = (dims[0] == 1 ? 1 : 0);
+	if (rank < 1 || rank > 2 || dims[1-*dim] != 1 || dims[*dim] != pixels3) {
+		fprintf(stderr, "ERROR: Invalid dimensions of S3D image (m = %llu, n = %llu, pixels^3 = %zu).\n",
+			(unsigned long long)dims[0], (unsigned long long)dims[1], pixels3);
+		H5Dclose(dset);
+		return -1;
+	}
+
+	return dset;
+}
+
+/**
+ * Load the S3D image from the given (open) file.
+ * Where possible, the raw data is read in parallel
+ * (using 'threads' threads) without going through
+ * the HDF5 library.
+ */
+double *hdf5_get_image(const char *filename, hid_t file, const char *name, size_t pixels, int threads) {
+	hid_t dset, dtype, dcpl, fcpl;
+	hsize_t userblock = 0;
+	size_t pixels3 = pixels*pixels*pixels;
+	int dim, r = 1;
+	haddr_t addr;
+	double *buf;
+
+	dset = hdf5_open_image(file, name, pixels, &dim);
+	if (dset < 0)
+		return NULL;
+
+	buf = malloc(sizeof(double)*pixels3);
+	if (buf == NULL) {
+		fprintf(stderr, "ERROR: Unable to allocate memory for S3D image.\n");
+		H5Dclose(dset);
+		return NULL;
+	}
+
+	fcpl = H5Fget_create_plist(file);
+	H5Pget_userblock(fcpl, &userblock);
+	H5Pclose(fcpl);
+
+	/* Raw data can only be used directly if stored
+	 * as native (little-endian) doubles */
+	dtype = H5Dget_type(dset);
+	dcpl = H5Dget_create_plist(dset);
+	if (H5Tequal(dtype, H5T_NATIVE_DOUBLE) > 0) {
+		switch (H5Pget_layout(dcpl)) {
+			case H5D_CONTIGUOUS:
+				/* Unlike chunk addresses, this offset
+				 * already includes the user block */
+				addr = H5Dget_offset(dset);
+				if (addr != HADDR_UNDEF)
+					r = hdf5_read_contiguous(filename, addr, pixels3, buf, threads);
+				break;
+			case H5D_CHUNKED:
+				r = hdf5_read_chunked(filename, dset, dcpl, dim, userblock, pixels3, buf, threads);
+				break;
+			default: break;
+		}
+	}
+	H5Pclose(dcpl);
+	H5Tclose(dtype);
+
+	/* Fall back to reading through the HDF5 library */
+	if (r > 0)
+		r = hdf5_read_slabs(dset, dim, 0, pixels3, buf);
+
+	H5Dclose(dset);
+
+	if (r != 0) {
+		fprintf(stderr, "ERROR: Unable to read S3D image '%s'.\n", name);
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/**
+ * Load an S3D file saved in MAT v7.3 format
+ * (which is an HDF5 file), without the MATLAB
+ * runtime, reading the image with 'threads' threads
+ * where possible. The caller must hold the library
+ * lock (see s3d_lock_library()).
+ */
+s3d_t *loads3d_hdf5(const char *filename, int threads) {
+	hid_t file;
+	double *buf;
+	s3d_t *s;
+
+	H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+	file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (file < 0) {
+		fprintf(stderr, "ERROR: Unable to open S3D file: %s.\n", filename);
+		return NULL;
+	}
+
+	s = s3d_new();
+
+	/* pixels */
+	s->pixels = (size_t)hdf5_get_scalar(file, "pixels");
+
+	/* Bounds */
+	s->xmin = hdf5_get_scalar(file, "xmin");
+	s->xmax = hdf5_get_scalar(file, "xmax");
+	s->ymin = hdf5_get_scalar(file, "ymin");
+	s->ymax = hdf5_get_scalar(file, "ymax");
+	s->zmin = hdf5_get_scalar(file, "zmin");
+	s->zmax = hdf5_get_scalar(file, "zmax");
+
+	/* Data */
+	buf = hdf5_get_image(filename, file, "image", s->pixels, threads);
+	H5Fclose(file);
+
+	if (buf == NULL) {
+		free(s);
+		return NULL;
+	}
+
+	s->buffer = buf;
+	s->data = s3d_index(buf, s->pixels);
+
+	return s;
+}
+
+/* State of an HDF5 file read in slabs */
+struct hdf5_slab {
+	hid_t file, dset;
+	int dim;
+};
+
+/**
+ * Read planes through the HDF5 library.
+ */
+static int hdf5_slab_read(s3d_slab_reader_t *r, size_t first, size_t n, double *buf) {
+	struct hdf5_slab *h = r->priv;
+	size_t pixels2 = r->s->pixels*r->s->pixels;
+	int err;
+
+	s3d_lock_library();
+	err = hdf5_read_slabs(h->dset, h->dim, first*pixels2, n*pixels2, buf);
+	s3d_unlock_library();
+
+	return err;
+}
+
+static void hdf5_slab_close(s3d_slab_reader_t *r) {
+	struct hdf5_slab *h = r->priv;
+
+	s3d_lock_library();
+	H5Dclose(h->dset);
+	H5Fclose(h->file);
+	s3d_unlock_library();
+	free(h);
+}
+
+/**
+ * Open an S3D file saved in MAT v7.3 format for
+ * reading in slabs (see s3dslab.c). Slabs are read
+ * through the HDF5 library (which takes care of
+ * any compression). The caller must hold the library
+ * lock (see s3d_lock_library()).
+ */
+int s3d_slab_open_hdf5(const char *filename, s3d_slab_reader_t *r) {
+	struct hdf5_slab *h = malloc(sizeof(struct hdf5_slab));
+	s3d_t *s = r->s;
+
+	H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+	h->file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (h->file < 0) {
+		fprintf(stderr, "ERROR: Unable to open S3D file: %s.\n", filename);
+		free(h);
+		return -1;
+	}
+
+	s->pixels = (size_t)hdf5_get_scalar(h->file, "pixels");
+	s->xmin = hdf5_get_scalar(h->file, "xmin");
+	s->xmax = hdf5_get_scalar(h->file, "xmax");
+	s->ymin = hdf5_get_scalar(h->file, "ymin");
+	s->ymax = hdf5_get_scalar(h->file, "ymax");
+	s->zmin = hdf5_get_scalar(h->file, "zmin");
+	s->zmax = hdf5_get_scalar(h->file, "zmax");
+
+	h->dset = hdf5_open_image(h->file, "image", s->pixels, &h->dim);
+	if (h->dset < 0) {
+		H5Fclose(h->file);
+		free(h);
+		return -1;
+	}
+
+	r->priv = h;
+	r->read = hdf5_slab_read;
+	r->close = hdf5_slab_close;
+
+	return 0;
+}
@@ -0,0 +1,233 @@
+/* Spatial bricks of voxels, for culling and level of detail */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s3d.h"
+
+/**
+ * Return the index (along one axis) of the brick
+ * containing coordinate 'x'.
+ */
+static size_t s3d_brick_coord(double x, double xmin, double xmax, size_t nb) {
+	double f;
+
+	if (xmax <= xmin) return 0;
+
+	f = (x-xmin) / (xmax-xmin) * nb;
+	if (!(f > 0)) return 0;
+	else if (f >= nb) return nb-1;
+	else return (size_t)f;
+}
+
+/**
+ * Return the index along x of the layer of bricks
+ * containing the x coordinate 'x'. Voxels in different
+ * layers never share a brick.
+ */
+size_t s3d_brick_layer(s3d_t *s, double x) {
+	size_t nb = (s->pixels + S3D_BRICK_SIZE-1) / S3D_BRICK_SIZE;
+
+	return s3d_brick_coord(x, s->xmin, s->xmax, nb > 0 ? nb : 1);
+}
+
+/**
+ * Return the Morton code of the grid cell with
+ * coordinates 'c[0]' to 'c[dims-1]' (each less than
+ * 'n'), formed by interleaving the bits of the
+ * coordinates. Cells which are close in space are
+ * close along the resulting (Z-order) curve.
+ */
+static size_t s3d_morton(const size_t *c, int dims, size_t n) {
+	size_t code = 0, bit;
+	int d, k = 0;
+
+	for (bit = 1; bit < n; bit <<= 1) {
+		for (d = 0; d < dims; d++, k++) {
+			if (c[d] & bit)
+				code |= (size_t)1 << k;
+		}
+	}
+
+	return code;
+}
+
+/**
+ * Return the smallest power of two which is at least 'n'.
+ */
+static size_t s3d_pow2(size_t n) {
+	size_t p = 1;
+	while (p < n) p <<= 1;
+	return p;
+}
+
+/**
+ * Reorder the array 'a' (of length 'n') so that
+ * element 'k' becomes 'a[perm[k]]'.
+ */
+static void s3d_permute(real_t *a, const size_t *perm, size_t n, real_t *tmp) {
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		tmp[k] = a[perm[k]];
+
+	memcpy(a, tmp, sizeof(real_t)*n);
+}
+
+/**
+ * Divide the volume into bricks of S3D_BRICK_SIZE^3
+ * grid cells, and reorder the list of non-zero voxels
+ * (see s3d_compact()) so that the voxels of each brick
+ * are stored contiguously.
+ *
+ * Voxels are ordered along a Morton (Z-order) curve, so
+ * that consecutive voxels project to nearby pixels and
+ * the pixels being added to stay in cache, whichever
+ * way the camera is rotated: the voxels of a brick by
+ * their cell within the brick, and the bricks of each
+ * layer (along x) by their position in the layer.
+ * Layers are kept in order, so that a slab of layers
+ * (see s3d_slab_plan()) holds its bricks in the same
+ * order as the whole volume.
+ *
+ * For each non-empty brick, a bounding sphere, the
+ * total intensity and the intensity-weighted centroid
+ * are stored, so that whole bricks can be rejected (or
+ * drawn as a single point) when rendering.
+ *
+ * Lists which are already in this order (such as those
+ * of sparse cache files, see convert_s3d()) are left
+ * untouched, so that lists mapped from a cache file
+ * keep sharing the page cache. Other lists are
+ * reordered in place, which for a list mapped from a
+ * cache file (privately) copies it into the private
+ * memory of the process.
+ */
+void s3d_build_bricks(s3d_t *s) {
+	size_t nb, p2, nkeys, nlocal, i, k, b, c[3], *brick, *start, *perm, *perm1;
+	unsigned short *local;
+	real_t *tmp;
+	s3d_brick_t *br;
+
+	if (s->bricks != NULL || s->nvoxels == 0)
+		return;
+
+	nb = (s->pixels + S3D_BRICK_SIZE-1) / S3D_BRICK_SIZE;
+	if (nb == 0) nb = 1;
+	p2 = s3d_pow2(nb);
+	nkeys = nb*p2*p2;
+	nlocal = S3D_BRICK_SIZE*S3D_BRICK_SIZE*S3D_BRICK_SIZE;
+
+	/* Assign voxels to bricks (identified by their layer and
+	 * Morton code within the layer), and to cells of bricks */
+	brick = malloc(sizeof(size_t)*s->nvoxels);
+	local = malloc(sizeof(unsigned short)*s->nvoxels);
+	start = calloc((nkeys > nlocal ? nkeys : nlocal)+1, sizeof(size_t));
+
+	for (k = 0; k < s->nvoxels; k++) {
+		c[0] = s3d_brick_coord(s->vy[k], s->ymin, s->ymax, nb);
+		c[1] = s3d_brick_coord(s->vz[k], s->zmin, s->zmax, nb);
+		brick[k] = s3d_brick_coord(s->vx[k], s->xmin, s->xmax, nb)*p2*p2 + s3d_morton(c, 2, nb);
+
+		c[0] = s3d_brick_coord(s->vx[k], s->xmin, s->xmax, nb*S3D_BRICK_SIZE) % S3D_BRICK_SIZE;
+		c[1] = s3d_brick_coord(s->vy[k], s->ymin, s->ymax, nb*S3D_BRICK_SIZE) % S3D_BRICK_SIZE;
+		c[2] = s3d_brick_coord(s->vz[k], s->zmin, s->zmax, nb*S3D_BRICK_SIZE) % S3D_BRICK_SIZE;
+		local[k] = s3d_morton(c, 3, S3D_BRICK_SIZE);
+		start[local[k]+1]++;
+	}
+
+	/* Sort voxels by cell, and then by brick (stable
+	 * counting sorts, i.e. a radix sort) */
+	for (b = 0; b < nlocal; b++)
+		start[b+1] += start[b];
+
+	perm1 = malloc(sizeof(size_t)*s->nvoxels);
+	for (k = 0; k < s->nvoxels; k++)
+		perm1[start[local[k]]++] = k;
+
+	free(local);
+	memset(start, 0, sizeof(size_t)*(nkeys+1));
+	for (k = 0; k < s->nvoxels; k++)
+		start[brick[k]+1]++;
+
+	for (b = 0; b < nkeys; b++)
+		start[b+1] += start[b];
+
+	perm = malloc(sizeof(size_t)*s->nvoxels);
+	for (k = 0; k < s->nvoxels; k++)
+		perm[start[brick[perm1[k]]]++] = perm1[k];
+
+	free(perm1);
+
+	/* The sort is stable, so a list already in
+	 * order is left as it is (and not written) */
+	for (k = 0; k < s->nvoxels && perm[k] == k; k++)
+		;
+
+	if (k < s->nvoxels) {
+		tmp = malloc(sizeof(real_t)*s->nvoxels);
+		s3d_permute(s->vx, perm, s->nvoxels, tmp);
+		s3d_permute(s->vy, perm, s->nvoxels, tmp);
+		s3d_permute(s->vz, perm, s->nvoxels, tmp);
+		s3d_permute(s->vi, perm, s->nvoxels, tmp);
+		free(tmp);
+	}
+	free(perm);
+	free(brick);
+
+	/* 'start[b]' now points to the end of brick 'b' */
+	s->nbricks = 0;
+	for (b = 0; b < nkeys; b++)
+		if (start[b] > (b > 0 ? start[b-1] : 0))
+			s->nbricks++;
+
+	s->bricks = malloc(sizeof(s3d_brick_t)*s->nbricks);
+
+	for (b = 0, i = 0; b < nkeys; b++) {
+		size_t first = (b > 0 ? start[b-1] : 0);
+		double mn[3], mx[3], sum = 0, c[3] = {0,0,0}, dx, dy, dz;
+
+		if (start[b] == first) continue;
+
+		br = s->bricks + i++;
+		br->start = first;
+		br->count = start[b] - first;
+
+		mn[0] = mx[0] = s->vx[first];
+		mn[1] = mx[1] = s->vy[first];
+		mn[2] = mx[2] = s->vz[first];
+		for (k = first; k < start[b]; k++) {
+			if (s->vx[k] < mn[0]) mn[0] = s->vx[k];
+			if (s->vx[k] > mx[0]) mx[0] = s->vx[k];
+			if (s->vy[k] < mn[1]) mn[1] = s->vy[k];
+			if (s->vy[k] > mx[1]) mx[1] = s->vy[k];
+			if (s->vz[k] < mn[2]) mn[2] = s->vz[k];
+			if (s->vz[k] > mx[2]) mx[2] = s->vz[k];
+
+			sum += s->vi[k];
+			c[0] += s->vi[k]*s->vx[k];
+			c[1] += s->vi[k]*s->vy[k];
+			c[2] += s->vi[k]*s->vz[k];
+		}
+
+		br->center[0] = 0.5*(mn[0]+mx[0]);
+		br->center[1] = 0.5*(mn[1]+mx[1]);
+		br->center[2] = 0.5*(mn[2]+mx[2]);
+
+		dx = mx[0]-mn[0]; dy = mx[1]-mn[1]; dz = mx[2]-mn[2];
+		br->radius = 0.5*sqrt(dx*dx + dy*dy + dz*dz);
+
+		br->sum = sum;
+		if (sum != 0) {
+			br->centroid[0] = c[0] / sum;
+			br->centroid[1] = c[1] / sum;
+			br->centroid[2] = c[2] / sum;
+		} else {
+			br->centroid[0] = br->center[0];
+			br->centroid[1] = br->center[1];
+			br->centroid[2] = br->center[2];
+		}
+	}
+
+	free(start);
+}
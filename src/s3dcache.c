@@ -0,0 +1,331 @@
+/* Native, memory-mappable, S3D cache files */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "s3d.h"
+#include "s3dcache.h"
+
+/**
+ * Check whether 'name' refers to cache data held in
+ * shared memory ('shm:NAME') or by an already open
+ * file descriptor ('fd:N'), rather than to a file.
+ */
+int s3dcache_is_handle(const char *name) {
+	return (!strncmp(name, S3DCACHE_SHM_PREFIX, strlen(S3DCACHE_SHM_PREFIX)) ||
+			!strncmp(name, S3DCACHE_FD_PREFIX, strlen(S3DCACHE_FD_PREFIX)));
+}
+
+/**
+ * Open cache data for reading (or, if 'create' is
+ * non-zero, create it for writing). Besides file names,
+ * 'name' may be 'shm:NAME', naming a POSIX shared memory
+ * object, or 'fd:N', naming a file descriptor which is
+ * already open (and which is duplicated, so that it
+ * stays open). Returns a file descriptor, or -1 on error.
+ */
+int s3dcache_open(const char *name, int create) {
+	const char *p;
+	char *end;
+	long fd;
+
+	if (!strncmp(name, S3DCACHE_SHM_PREFIX, strlen(S3DCACHE_SHM_PREFIX))) {
+		p = name + strlen(S3DCACHE_SHM_PREFIX);
+		if (create)
+			return shm_open(p, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		else
+			return shm_open(p, O_RDONLY, 0);
+	} else if (!strncmp(name, S3DCACHE_FD_PREFIX, strlen(S3DCACHE_FD_PREFIX))) {
+		p = name + strlen(S3DCACHE_FD_PREFIX);
+		fd = strtol(p, &end, 10);
+		if (*p == 0 || *end != 0 || fd < 0 || fd > INT_MAX)
+			return -1;
+
+		return dup((int)fd);
+	}
+
+	if (create)
+		return open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else
+		return open(name, O_RDONLY);
+}
+
+/**
+ * Check whether the given file is an
+ * s3dvid cache file.
+ */
+int s3d_is_cache(const char *filename) {
+	s3dcache_header_t h;
+	ssize_t n;
+	int fd;
+
+	fd = s3dcache_open(filename, 0);
+	if (fd < 0) return 0;
+
+	n = pread(fd, h.magic, sizeof(h.magic), 0);
+	close(fd);
+
+	return (n == sizeof(h.magic) && !memcmp(h.magic, S3DCACHE_MAGIC, sizeof(h.magic)));
+}
+
+/**
+ * Check the header of a cache file, and return the
+ * expected total size of the file (or 0 if the
+ * header is invalid).
+ */
+size_t s3dcache_check_header(s3dcache_header_t *h, const char *filename) {
+	if (memcmp(h->magic, S3DCACHE_MAGIC, sizeof(h->magic))) {
+		fprintf(stderr, "ERROR: '%s' is not an s3dvid cache file.\n", filename);
+		return 0;
+	}
+	if (h->endian != S3DCACHE_ENDIAN || h->version != S3DCACHE_VERSION) {
+		fprintf(stderr, "ERROR: '%s' was written by an incompatible version of s3dvid (or on another architecture).\n", filename);
+		return 0;
+	}
+
+	if (h->flags & S3DCACHE_SPARSE)
+		return h->offset + 4*sizeof(double)*h->nvoxels;
+	else
+		return h->offset + sizeof(double)*h->pixels*h->pixels*h->pixels;
+}
+
+#ifdef SINGLE_PRECISION
+/**
+ * Return a copy of the 'n' doubles in 'a', converted
+ * to single precision.
+ */
+static real_t *s3dcache_to_real(const double *a, size_t n) {
+	size_t i;
+	real_t *r = malloc(sizeof(real_t)*n);
+
+	for (i = 0; i < n; i++)
+		r[i] = a[i];
+
+	return r;
+}
+#endif
+
+/**
+ * Set up an S3D object pointing into the (already
+ * mapped) cache data 'map'. Voxel lists are stored
+ * in double precision, and are copied (rather than
+ * used in place) when compiled with SINGLE_PRECISION.
+ */
+s3d_t *s3dcache_attach(void *map, size_t mapsize, const char *filename) {
+	s3dcache_header_t *h = map;
+	double *payload;
+	size_t size;
+	s3d_t *s;
+
+	if (mapsize < sizeof(s3dcache_header_t)) {
+		fprintf(stderr, "ERROR: '%s' is too small to be an s3dvid cache file.\n", filename);
+		return NULL;
+	}
+
+	size = s3dcache_check_header(h, filename);
+	if (size == 0)
+		return NULL;
+	else if (size > mapsize) {
+		fprintf(stderr, "ERROR: '%s' is truncated.\n", filename);
+		return NULL;
+	}
+
+	s = s3d_new();
+	s->pixels = h->pixels;
+	s->xmin = h->xmin; s->xmax = h->xmax;
+	s->ymin = h->ymin; s->ymax = h->ymax;
+	s->zmin = h->zmin; s->zmax = h->zmax;
+
+	s->map = map;
+	s->mapsize = mapsize;
+
+	payload = (double*)((char*)map + h->offset);
+	if (h->flags & S3DCACHE_SPARSE) {
+		s->nvoxels = h->nvoxels;
+#ifdef SINGLE_PRECISION
+		s->vx = s3dcache_to_real(payload, h->nvoxels);
+		s->vy = s3dcache_to_real(payload + h->nvoxels, h->nvoxels);
+		s->vz = s3dcache_to_real(payload + 2*h->nvoxels, h->nvoxels);
+		s->vi = s3dcache_to_real(payload + 3*h->nvoxels, h->nvoxels);
+#else
+		/* The voxel list is used in place */
+		s->vx = payload;
+		s->vy = payload + h->nvoxels;
+		s->vz = payload + 2*h->nvoxels;
+		s->vi = payload + 3*h->nvoxels;
+#endif
+	} else
+		s->data = s3d_index(payload, s->pixels);
+
+	return s;
+}
+
+/**
+ * Load an s3dvid cache file. The file is mapped into
+ * memory (privately, so that the volume may be modified
+ * without affecting the file) and used in place. Sparse
+ * files written in render order (see s3d_build_bricks())
+ * are never modified, so that several processes rendering
+ * the same file share the page cache rather than each
+ * holding a private copy. Full data cubes are compacted
+ * into a private voxel list by every process.
+ *
+ * The cache data may also be held in shared memory, or
+ * by an open file descriptor (see s3dcache_open()), in
+ * which case it is mapped (and shared) in the same way,
+ * without being read from disk.
+ */
+s3d_t *loads3d_cache(const char *filename) {
+	struct stat st;
+	void *map;
+	int fd;
+	s3d_t *s;
+
+	fd = s3dcache_open(filename, 0);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "ERROR: Unable to open S3D file: %s.\n", filename);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to map S3D file: %s.\n", filename);
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	s = s3dcache_attach(map, st.st_size, filename);
+	if (s == NULL)
+		munmap(map, st.st_size);
+
+	return s;
+}
+
+/**
+ * Fill in the header of a cache file for
+ * the given S3D object.
+ *
+ * sparse: If non-zero, only the (compacted)
+ *         list of non-zero voxels is stored.
+ */
+void s3dcache_header(s3d_t *s, int sparse, s3dcache_header_t *h) {
+	memset(h, 0, sizeof(s3dcache_header_t));
+	memcpy(h->magic, S3DCACHE_MAGIC, sizeof(h->magic));
+	h->endian = S3DCACHE_ENDIAN;
+	h->version = S3DCACHE_VERSION;
+	h->flags = (sparse ? S3DCACHE_SPARSE : 0);
+	h->pixels = s->pixels;
+	h->nvoxels = s->nvoxels;
+	h->offset = S3DCACHE_HEADER_SIZE;
+	h->xmin = s->xmin; h->xmax = s->xmax;
+	h->ymin = s->ymin; h->ymax = s->ymax;
+	h->zmin = s->zmin; h->zmax = s->zmax;
+}
+
+/**
+ * Write 'n' values of the voxel list to the given
+ * stream, in double precision.
+ */
+static int s3dcache_write_reals(const real_t *a, size_t n, FILE *f) {
+#ifdef SINGLE_PRECISION
+	double buf[4096];
+	size_t i, j, nb;
+
+	for (i = 0; i < n; i += nb) {
+		nb = (n-i < 4096 ? n-i : 4096);
+		for (j = 0; j < nb; j++)
+			buf[j] = a[i+j];
+
+		if (fwrite(buf, sizeof(double), nb, f) != nb)
+			return -1;
+	}
+
+	return 0;
+#else
+	return (fwrite(a, sizeof(double), n, f) == n ? 0 : -1);
+#endif
+}
+
+/**
+ * Write the payload of a cache file (everything
+ * following the header) to the given stream.
+ */
+int s3dcache_write_payload(s3d_t *s, int sparse, FILE *f) {
+	size_t n, pixels2 = s->pixels*s->pixels, i;
+
+	if (sparse) {
+		n = s->nvoxels;
+		if (s3dcache_write_reals(s->vx, n, f) != 0 ||
+			s3dcache_write_reals(s->vy, n, f) != 0 ||
+			s3dcache_write_reals(s->vz, n, f) != 0 ||
+			s3dcache_write_reals(s->vi, n, f) != 0)
+			return -1;
+	} else {
+		for (i = 0; i < s->pixels; i++) {
+			if (fwrite(s->data[i][0], sizeof(double), pixels2, f) != pixels2)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Save the given S3D object as an s3dvid cache file (or
+ * in shared memory, see s3dcache_open()).
+ *
+ * sparse: If non-zero, only the (compacted) list of
+ *         non-zero voxels is stored (s3d_compact() must
+ *         have been called). Otherwise, the full data
+ *         cube is stored.
+ */
+int s3d_save_cache(s3d_t *s, const char *filename, int sparse) {
+	s3dcache_header_t h;
+	char pad[S3DCACHE_HEADER_SIZE];
+	FILE *f;
+	int fd;
+
+	if (!sparse && s->data == NULL) {
+		fprintf(stderr, "ERROR: Only sparse cache files can be written from sparse S3D data.\n");
+		return -1;
+	}
+
+	fd = s3dcache_open(filename, 1);
+	f = (fd >= 0 ? fdopen(fd, "wb") : NULL);
+	if (!f) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to create cache file: %s.\n", filename);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	s3dcache_header(s, sparse, &h);
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, &h, sizeof(h));
+
+	if (fwrite(pad, 1, sizeof(pad), f) != sizeof(pad) ||
+		s3dcache_write_payload(s, sparse, f) != 0) {
+		fprintf(stderr, "ERROR: Unable to write cache file: %s.\n", filename);
+		fclose(f);
+		return -1;
+	}
+
+	if (fclose(f) != 0) {
+		perror("ERROR");
+		return -1;
+	}
+
+	return 0;
+}
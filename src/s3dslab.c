@@ -0,0 +1,270 @@
+/* Read S3D volumes one slab at a time (out-of-core rendering) */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "s3d.h"
+#include "s3dcache.h"
+#include "s3dslab.h"
+#include "timing.h"
+
+/**
+ * Read planes from a (dense) cache file.
+ */
+static int s3d_slab_read_cache(s3d_slab_reader_t *r, size_t first, size_t n, double *buf) {
+	size_t pixels2 = r->s->pixels*r->s->pixels,
+		   len = n*pixels2*sizeof(double), done;
+	off_t offset = r->offset + (off_t)(first*pixels2*sizeof(double));
+	ssize_t rd;
+
+	for (done = 0; done < len; done += rd) {
+		rd = pread(r->fd, (char*)buf + done, len-done, offset + done);
+		if (rd <= 0) return -1;
+	}
+
+	return 0;
+}
+
+static void s3d_slab_close_cache(s3d_slab_reader_t *r) {
+	close(r->fd);
+}
+
+/**
+ * Open a (dense) cache file for reading in slabs.
+ */
+static int s3d_slab_open_cache(const char *filename, s3d_slab_reader_t *r) {
+	s3dcache_header_t h;
+	off_t size, needed = 0;
+
+	r->fd = s3dcache_open(filename, 0);
+	if (r->fd < 0) {
+		fprintf(stderr, "ERROR: Unable to open S3D file: %s.\n", filename);
+		return -1;
+	}
+
+	size = lseek(r->fd, 0, SEEK_END);
+	if (pread(r->fd, &h, sizeof(h), 0) == sizeof(h))
+		needed = s3dcache_check_header(&h, filename);
+
+	if (needed == 0) {
+		close(r->fd);
+		return -1;
+	}
+
+	if (h.flags & S3DCACHE_SPARSE) {
+		fprintf(stderr, "ERROR: '%s' only holds the non-zero voxels, and cannot be read in slabs. Render it without a memory budget.\n", filename);
+		close(r->fd);
+		return -1;
+	} else if (needed > size) {
+		fprintf(stderr, "ERROR: '%s' is truncated.\n", filename);
+		close(r->fd);
+		return -1;
+	}
+
+	r->s->pixels = h.pixels;
+	r->s->xmin = h.xmin; r->s->xmax = h.xmax;
+	r->s->ymin = h.ymin; r->s->ymax = h.ymax;
+	r->s->zmin = h.zmin; r->s->zmax = h.zmax;
+
+	r->offset = h.offset;
+	r->read = s3d_slab_read_cache;
+	r->close = s3d_slab_close_cache;
+
+	return 0;
+}
+
+/**
+ * Open an S3D file for reading in slabs. Dense cache
+ * files (or cache data in shared memory) and MAT v7.3
+ * (HDF5) files are supported; files read through the
+ * MATLAB library can only be loaded as a whole.
+ */
+s3d_slab_reader_t *s3d_slab_open(const char *filename) {
+	s3d_slab_reader_t *r = malloc(sizeof(s3d_slab_reader_t));
+	int err = -1;
+
+	r->s = s3d_new();
+	r->fd = -1;
+	r->offset = 0;
+	r->priv = NULL;
+
+	if (s3dcache_is_handle(filename) || s3d_is_cache(filename))
+		err = s3d_slab_open_cache(filename, r);
+	else {
+		s3d_lock_library();
+#ifdef USE_HDF5
+		if (s3d_is_hdf5(filename))
+			err = s3d_slab_open_hdf5(filename, r);
+		else
+#endif
+			fprintf(stderr, "ERROR: '%s' cannot be read in slabs. Convert it to a (dense) cache file first, using '--convert'.\n", filename);
+		s3d_unlock_library();
+	}
+
+	if (err) {
+		free(r->s);
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void s3d_slab_close(s3d_slab_reader_t *r) {
+	r->close(r);
+	free(r->s);
+	free(r);
+}
+
+/**
+ * Return the (largest) number of bytes of memory
+ * needed per plane of a slab, for the raw plane and
+ * for the voxel list and temporary arrays built from
+ * it (assuming, in the worst case, that all voxels
+ * are non-zero).
+ */
+size_t s3d_slab_plane_bytes(size_t pixels) {
+	return pixels*pixels * (sizeof(double) + 5*sizeof(real_t) + 2*sizeof(size_t));
+}
+
+/**
+ * Divide the volume into slabs of at most 'maxplanes'
+ * planes. Where possible, slabs end on the boundary
+ * between two layers of bricks, so that the bricks of
+ * each slab are the same as when loading the whole
+ * volume (and the resulting images identical).
+ *
+ * bounds: On return, slab 'k' consists of planes
+ *         '(*bounds)[k]' to '(*bounds)[k+1]-1'.
+ *
+ * Returns the number of slabs.
+ */
+size_t s3d_slab_plan(s3d_slab_reader_t *r, size_t maxplanes, size_t **bounds) {
+	s3d_t *s = r->s;
+	size_t i, nslabs = 0, start = 0, lastcut = 0, layer, prev = 0;
+	double dx = (s->xmax-s->xmin)/(s->pixels-1), idx = 0;
+
+	*bounds = malloc(sizeof(size_t)*(s->pixels+1));
+	(*bounds)[0] = 0;
+
+	for (i = 0; i < s->pixels; i++, idx += dx) {
+		layer = s3d_brick_layer(s, (real_t)(s->xmin+idx));
+		if (i > start && layer != prev)
+			lastcut = i;
+		prev = layer;
+
+		if (i - start == maxplanes) {
+			start = (lastcut > start ? lastcut : i);
+			(*bounds)[++nslabs] = start;
+		}
+	}
+
+	(*bounds)[++nslabs] = s->pixels;
+
+	return nslabs;
+}
+
+/**
+ * Allocate a slab with room for 'capacity' planes.
+ */
+s3d_slab_t *s3d_slab_new(s3d_slab_reader_t *r, size_t capacity) {
+	s3d_slab_t *sl = malloc(sizeof(s3d_slab_t));
+
+	sl->r = r;
+	sl->first = sl->n = 0;
+	sl->capacity = capacity;
+	sl->buf = malloc(sizeof(double)*capacity*r->s->pixels*r->s->pixels);
+	sl->running = 0;
+	sl->err = 0;
+
+	/* Voxels are positioned relative to the whole volume */
+	sl->s = s3d_new();
+	memcpy(sl->s, r->s, sizeof(s3d_t));
+	sl->s->data = NULL;
+	sl->s->vx = sl->s->vy = sl->s->vz = sl->s->vi = NULL;
+	sl->s->bricks = NULL;
+	sl->s->buffer = NULL;
+	sl->s->map = NULL;
+
+	return sl;
+}
+
+/**
+ * Load planes 'first' to 'first+n-1' into the slab,
+ * build the list of non-zero voxels and divide it
+ * into bricks.
+ */
+int s3d_slab_load(s3d_slab_t *sl, size_t first, size_t n) {
+	s3d_slab_reader_t *r = sl->r;
+	double t0 = timing_now();
+
+	sl->first = first;
+	sl->n = n;
+
+	if (n > sl->capacity || r->read(r, first, n, sl->buf)) {
+		fprintf(stderr, "ERROR: Unable to read planes %zu to %zu of the S3D file.\n", first, first+n-1);
+		return -1;
+	}
+
+	timing_add(TIMING_LOAD, t0);
+	timing_count(TIMING_BYTES_READ, n*r->s->pixels*r->s->pixels*sizeof(double));
+
+	t0 = timing_now();
+	s3d_compact_planes(sl->s, sl->buf, first, n);
+	s3d_build_bricks(sl->s);
+	timing_add(TIMING_COMPACT, t0);
+
+	return 0;
+}
+
+static void *s3d_slab_thread(void *arg) {
+	s3d_slab_t *sl = arg;
+
+	timing_thread_name("prefetch");
+	sl->err = s3d_slab_load(sl, sl->first, sl->n);
+
+	return NULL;
+}
+
+/**
+ * Start loading planes 'first' to 'first+n-1' into
+ * the slab in a separate thread, so that reading the
+ * next slab overlaps with rendering the current one.
+ * The slab must not be used until s3d_slab_wait()
+ * has returned.
+ */
+void s3d_slab_prefetch(s3d_slab_t *sl, size_t first, size_t n) {
+	sl->first = first;
+	sl->n = n;
+	sl->err = 0;
+
+	if (pthread_create(&sl->thread, NULL, s3d_slab_thread, sl) != 0)
+		sl->err = s3d_slab_load(sl, first, n);
+	else
+		sl->running = 1;
+}
+
+/**
+ * Wait for a slab started with s3d_slab_prefetch()
+ * to finish loading. Returns non-zero on error.
+ */
+int s3d_slab_wait(s3d_slab_t *sl) {
+	if (sl->running) {
+		pthread_join(sl->thread, NULL);
+		sl->running = 0;
+	}
+
+	return sl->err;
+}
+
+void s3d_slab_free(s3d_slab_t *sl) {
+	s3d_slab_wait(sl);
+	s3d_free_voxels(sl->s);
+	free(sl->s);
+	free(sl->buf);
+	free(sl);
+}
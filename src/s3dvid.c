@@ -0,0 +1,219 @@
+/* Interface of libs3dvid (see s3dvid.h) */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "camera.h"
+#include "s3d.h"
+#include "s3dpng.h"
+#include "s3dvid.h"
+
+/**
+ * Prepare a (loaded) S3D object for rendering: build
+ * the list of non-zero voxels, drop the data cube and
+ * divide the voxels into bricks.
+ */
+static s3dvid_volume_t *s3dvid_volume_prepare(s3d_t *s) {
+	s3dvid_volume_t *v = malloc(sizeof(s3dvid_volume_t));
+
+	s3d_compact(s);
+	s3d_free_data(s);
+	s3d_build_bricks(s);
+
+	v->s = s;
+	s3d_center(s, v->center);
+
+	return v;
+}
+
+/**
+ * Load a volume from an S3D file (or cache file),
+ * reading it with 'threads' threads where supported.
+ * Volumes may be loaded from several threads at once;
+ * files read through the HDF5 (or MATLAB) library are
+ * then read one at a time. Returns NULL on error.
+ */
+s3dvid_volume_t *s3dvid_volume_load(const char *filename, int threads) {
+	s3d_t *s;
+
+	s = loads3d(filename, threads);
+	if (s == NULL) return NULL;
+
+	return s3dvid_volume_prepare(s);
+}
+
+/**
+ * Create a volume from a data cube held in memory
+ * (e.g. computed by the caller, rather than read from
+ * a file). Element (i,j,k) of the cube is stored at
+ * 'data[(i*pixels + j)*pixels + k]', and the cube spans
+ * 'bounds' = {xmin, xmax, ymin, ymax, zmin, zmax}. Only
+ * the non-zero voxels are copied, so the data cube may
+ * be released once this function returns. Returns NULL
+ * if the cube has fewer than two pixels along each side,
+ * or 'data' or 'bounds' is NULL.
+ */
+s3dvid_volume_t *s3dvid_volume_new(const double *data, size_t pixels, const double bounds[6]) {
+	s3d_t *s;
+
+	if (data == NULL || bounds == NULL) {
+		fprintf(stderr, "ERROR: No data cube or bounds given for the volume.\n");
+		return NULL;
+	}
+	if (pixels < 2) {
+		fprintf(stderr, "ERROR: Volume must have at least 2 pixels along each side (got %zu).\n", pixels);
+		return NULL;
+	}
+
+	s = s3d_new();
+
+	s->pixels = pixels;
+	s->xmin = bounds[0]; s->xmax = bounds[1];
+	s->ymin = bounds[2]; s->ymax = bounds[3];
+	s->zmin = bounds[4]; s->zmax = bounds[5];
+
+	s3d_compact_planes(s, data, 0, pixels);
+
+	return s3dvid_volume_prepare(s);
+}
+
+void s3dvid_volume_free(s3dvid_volume_t *v) {
+	s3d_free_voxels(v->s);
+	s3d_free_data(v->s);
+	free(v->s);
+	free(v);
+}
+
+/**
+ * Create a camera with an image of 'height' times
+ * 'width' pixels and vision angle 'visang' (in
+ * radians), at 'location' and looking along
+ * 'direction'. Each image is rendered using one
+ * thread, without level of detail.
+ */
+s3dvid_camera_t *s3dvid_camera_new(
+	size_t height, size_t width, double visang,
+	double location[3], double direction[3]
+) {
+	s3dvid_camera_t *c = malloc(sizeof(s3dvid_camera_t));
+
+	camera_view_init(&c->view, height, width, visang, location, direction);
+
+	return c;
+}
+
+/**
+ * Move the camera to 'location', looking along
+ * 'direction' (keeping all other settings).
+ */
+void s3dvid_camera_place(s3dvid_camera_t *c, double location[3], double direction[3]) {
+	camera_view_place(&c->view, location, direction);
+}
+
+/**
+ * Place the camera as in frame 'angle' of a video:
+ * starting at 'location' and looking along 'direction',
+ * rotated by 'angle' (in radians) about the line through
+ * the center of the volume 'v' along 'axis'.
+ */
+void s3dvid_camera_orbit(
+	s3dvid_camera_t *c, s3dvid_volume_t *v, double location[3],
+	double direction[3], double axis[3], double angle
+) {
+	double loc[3], dir[3];
+
+	memcpy(loc, location, sizeof(loc));
+	memcpy(dir, direction, sizeof(dir));
+	camera_rotate(angle, loc, dir, v->center, axis);
+
+	s3dvid_camera_place(c, loc, dir);
+}
+
+void s3dvid_camera_free(s3dvid_camera_t *c) {
+	camera_view_free(&c->view);
+	free(c);
+}
+
+s3dvid_frame_t *s3dvid_frame_new(size_t height, size_t width) {
+	s3dvid_frame_t *f = malloc(sizeof(s3dvid_frame_t));
+
+	f->height = height;
+	f->width = width;
+	f->image = camera_view_alloc_image(height, width);
+
+	return f;
+}
+
+void s3dvid_frame_clear(s3dvid_frame_t *f) {
+	memset(f->image[0], 0, sizeof(real_t)*f->height*f->width);
+}
+
+/**
+ * Return the largest intensity of the frame (by which
+ * frames are normalized, see s3dvid_frame_rgb()).
+ */
+double s3dvid_frame_max(const s3dvid_frame_t *f) {
+	size_t k;
+	double mx = 0.0;
+
+	for (k = 0; k < f->height*f->width; k++)
+		if (f->image[0][k] > mx) mx = f->image[0][k];
+
+	return mx;
+}
+
+/**
+ * Colormap the frame, mapping the intensity 'top' to
+ * the top of the colormap, into 'rgb' (3*height*width
+ * bytes, RGB24, with the first row at the top).
+ */
+void s3dvid_frame_rgb(const s3dvid_frame_t *f, double top, uint8_t *rgb) {
+	bitmap_t bmp;
+
+	bmp.pixels = (pixel_t*)rgb;
+	colormap_image_threshold(f->image, f->height, f->width, top, &bmp);
+}
+
+/**
+ * Save the frame as a PNG file, mapping the intensity
+ * 'top' to the top of the colormap. If 'opts' is NULL,
+ * the default encoder options are used. Returns
+ * non-zero on error.
+ */
+int s3dvid_frame_save_png(const s3dvid_frame_t *f, double top, const png_options_t *opts, const char *name) {
+	png_options_t def;
+
+	if (opts == NULL) {
+		png_options_init(&def, Z_DEFAULT_COMPRESSION, PNG_OPT_FILTER_DEFAULT, 0, 1);
+		opts = &def;
+	}
+
+	return saveimg_options(f->image, f->height, f->width, top, opts, name);
+}
+
+void s3dvid_frame_free(s3dvid_frame_t *f) {
+	camera_free_image(f->image);
+	free(f);
+}
+
+/**
+ * Render the volume 'v' as seen from the camera 'c',
+ * adding to the frame 'f' (which must have the size of
+ * the camera image, and may be cleared beforehand with
+ * s3dvid_frame_clear()). Returns non-zero on error.
+ */
+int s3dvid_render(s3dvid_volume_t *v, s3dvid_camera_t *c, s3dvid_frame_t *f) {
+	if (f->height != c->view.pixelsi || f->width != c->view.pixelsj) {
+		fprintf(stderr, "ERROR: Frame size (%zux%zu) differs from camera image size (%zux%zu).\n",
+			f->width, f->height, c->view.pixelsj, c->view.pixelsi);
+		return -1;
+	}
+
+	c->view.image = f->image;
+	camera_view_generate(v->s, &c->view);
+	c->view.image = NULL;
+
+	return 0;
+}
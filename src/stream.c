@@ -0,0 +1,183 @@
+/* Write frames as a single video stream (YUV4MPEG2 or raw RGB) */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s3dpng.h"
+#include "stream.h"
+#include "timing.h"
+
+/**
+ * Open a new output stream.
+ *
+ * f:        File to write frames to (e.g. stdout or a named pipe).
+ * format:   Format of the stream (STREAM_Y4M or STREAM_RGB).
+ * width:    Width of frames (in pixels).
+ * height:   Height of frames (in pixels).
+ * fps:      Number of frames per second.
+ * capacity: Maximum number of frames that may be held in the
+ *           reorder buffer while waiting for earlier frames.
+ */
+stream_t *stream_open(FILE *f, enum stream_format format, size_t width, size_t height, size_t fps, size_t capacity) {
+	size_t i;
+	stream_t *st = malloc(sizeof(stream_t));
+
+	st->f = f;
+	st->format = format;
+	st->width = width;
+	st->height = height;
+	st->next = 0;
+	st->capacity = capacity;
+	st->failed = 0;
+
+	if (format == STREAM_Y4M)
+		st->framesize = width*height + 2*((width+1)/2)*((height+1)/2);
+	else
+		st->framesize = 3*width*height;
+
+	st->slots = malloc(sizeof(uint8_t*)*capacity);
+	st->ready = malloc(sizeof(int)*capacity);
+	for (i = 0; i < capacity; i++) {
+		st->slots[i] = malloc(st->framesize);
+		st->ready[i] = 0;
+	}
+
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+
+	if (format == STREAM_Y4M)
+		fprintf(f, "YUV4MPEG2 W%zu H%zu F%zu:1 Ip A1:1 C420jpeg\n", width, height, fps);
+
+	return st;
+}
+
+/**
+ * Convert an RGB24 image to planar YUV 4:2:0 (BT.601,
+ * limited range), with chroma sited in the center of
+ * each 2x2 block of pixels.
+ */
+void stream_rgb2yuv420(const pixel_t *rgb, size_t width, size_t height, uint8_t *yuv) {
+	size_t i, j, cw = (width+1)/2, ch = (height+1)/2;
+	uint8_t *Y = yuv, *U = yuv + width*height, *V = U + cw*ch;
+
+	for (i = 0; i < height; i++) {
+		for (j = 0; j < width; j++) {
+			const pixel_t *p = rgb + i*width + j;
+			Y[i*width + j] = ((66*p->red + 129*p->green + 25*p->blue + 128) >> 8) + 16;
+		}
+	}
+
+	for (i = 0; i < ch; i++) {
+		for (j = 0; j < cw; j++) {
+			size_t i0 = 2*i, i1 = (2*i+1 < height ? 2*i+1 : 2*i),
+				   j0 = 2*j, j1 = (2*j+1 < width ? 2*j+1 : 2*j);
+			const pixel_t *a = rgb + i0*width + j0, *b = rgb + i0*width + j1,
+				*c = rgb + i1*width + j0, *d = rgb + i1*width + j1;
+			int r = (a->red + b->red + c->red + d->red + 2) >> 2,
+				g = (a->green + b->green + c->green + d->green + 2) >> 2,
+				bl = (a->blue + b->blue + c->blue + d->blue + 2) >> 2;
+
+			U[i*cw + j] = ((-38*r - 74*g + 112*bl + 128) >> 8) + 128;
+			V[i*cw + j] = ((112*r - 94*g - 18*bl + 128) >> 8) + 128;
+		}
+	}
+}
+
+/**
+ * Write out all frames in the reorder buffer which
+ * directly follow the last written frame. Must be
+ * called with the stream lock held.
+ */
+void stream_flush_ready(stream_t *st) {
+	size_t slot;
+	double t0;
+
+	while (st->ready[(slot = st->next % st->capacity)]) {
+		if (!st->failed) {
+			t0 = timing_now();
+			if (st->format == STREAM_Y4M && fputs("FRAME\n", st->f) == EOF)
+				st->failed = 1;
+			else if (fwrite(st->slots[slot], 1, st->framesize, st->f) != st->framesize)
+				st->failed = 1;
+
+			timing_add(TIMING_WRITE, t0);
+			timing_count(TIMING_BYTES_WRITTEN, st->framesize + (st->format == STREAM_Y4M ? 6 : 0));
+		}
+
+		st->ready[slot] = 0;
+		st->next++;
+	}
+
+	pthread_cond_broadcast(&st->cond);
+}
+
+/**
+ * Add frame number 'index' to the stream. Frames may
+ * be added in any order (and from any thread), but are
+ * written in order. The frame is converted to the output
+ * format before taking the lock, so that conversion
+ * happens in parallel. Returns non-zero if writing to
+ * the stream has failed.
+ *
+ * rgb: Frame to write (RGB24, row by row).
+ */
+int stream_write(stream_t *st, size_t index, const pixel_t *rgb) {
+	uint8_t *slot;
+	double t0 = timing_now();
+
+	pthread_mutex_lock(&st->lock);
+	/* Wait for space in the reorder buffer */
+	while (index >= st->next + st->capacity)
+		pthread_cond_wait(&st->cond, &st->lock);
+
+	slot = st->slots[index % st->capacity];
+	pthread_mutex_unlock(&st->lock);
+	timing_add(TIMING_WAIT, t0);
+
+	/* No other thread uses this slot until it is marked ready */
+	t0 = timing_now();
+	if (st->format == STREAM_Y4M)
+		stream_rgb2yuv420(rgb, st->width, st->height, slot);
+	else
+		memcpy(slot, rgb, st->framesize);
+	timing_add(TIMING_ENCODE, t0);
+
+	pthread_mutex_lock(&st->lock);
+	st->ready[index % st->capacity] = 1;
+	stream_flush_ready(st);
+	pthread_mutex_unlock(&st->lock);
+
+	return st->failed;
+}
+
+/**
+ * Close the stream. Returns non-zero if any frames
+ * are missing, or if writing failed.
+ *
+ * nframes: Total number of frames expected in the stream.
+ */
+int stream_close(stream_t *st, size_t nframes) {
+	size_t i;
+	int ret = st->failed;
+
+	if (st->next != nframes) {
+		fprintf(stderr, "ERROR: Only %zu of %zu frames were written to the output stream.\n", st->next, nframes);
+		ret = 1;
+	}
+
+	if (fflush(st->f) != 0)
+		ret = 1;
+
+	for (i = 0; i < st->capacity; i++)
+		free(st->slots[i]);
+	free(st->slots);
+	free(st->ready);
+
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+	free(st);
+
+	return ret;
+}
@@ -0,0 +1,269 @@
+/* Per-thread timing of rendering stages */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "timing.h"
+
+const char *timing_stage_names[TIMING_NSTAGES] = {
+	"load", "compact", "extents", "max_intensity",
+	"render", "colormap", "encode", "write", "wait"
+};
+const char *timing_counter_names[TIMING_NCOUNTERS] = {
+	"voxels", "frames", "bytes_read", "bytes_written"
+};
+
+/* One timed interval (when tracing) */
+typedef struct {
+	enum timing_stage stage;
+	double start, end;
+} timing_event_t;
+
+/* Timings recorded by one thread */
+typedef struct timing_thread {
+	int id;
+	char name[32];
+
+	double seconds[TIMING_NSTAGES];
+	size_t calls[TIMING_NSTAGES];
+	size_t counters[TIMING_NCOUNTERS];
+
+	timing_event_t *events;
+	size_t nevents, maxevents;
+
+	struct timing_thread *next;
+} timing_thread_t;
+
+/* All threads which have recorded anything */
+timing_thread_t *timing_threads = NULL;
+int timing_nthreads = 0;
+pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double timing_start = 0;
+int timing_trace = 0;
+
+/* Record of the calling thread (thread-local rather than
+ * OpenMP threadprivate, since encoder and prefetch threads
+ * are not created by OpenMP) */
+static __thread timing_thread_t *timing_self = NULL;
+
+/**
+ * Return the current time (in seconds), from a
+ * monotonic clock (unaffected by changes to the
+ * system time).
+ */
+double timing_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/**
+ * Start timing. Event times in traces are
+ * relative to the time of this call.
+ */
+void timing_init(void) {
+	timing_start = timing_now();
+}
+
+/**
+ * Record every timed interval (not just totals),
+ * so that a trace can be written at exit.
+ */
+void timing_enable_trace(void) {
+	timing_trace = 1;
+}
+
+/**
+ * Return the record of the calling thread,
+ * creating it on first use.
+ */
+static timing_thread_t *timing_thread(void) {
+	timing_thread_t *t;
+
+	if (timing_self != NULL)
+		return timing_self;
+
+	t = calloc(1, sizeof(timing_thread_t));
+	strcpy(t->name, "worker");
+
+	pthread_mutex_lock(&timing_lock);
+	t->id = timing_nthreads++;
+	t->next = timing_threads;
+	timing_threads = t;
+	pthread_mutex_unlock(&timing_lock);
+
+	timing_self = t;
+	return t;
+}
+
+/**
+ * Set the name of the calling thread (e.g. "render"
+ * or "encoder"), as shown in traces.
+ */
+void timing_thread_name(const char *name) {
+	timing_thread_t *t = timing_thread();
+
+	strncpy(t->name, name, sizeof(t->name)-1);
+	t->name[sizeof(t->name)-1] = 0;
+}
+
+/**
+ * Add the time since 't0' (as returned by
+ * timing_now()) to the given stage, for the
+ * calling thread.
+ */
+void timing_add(enum timing_stage stage, double t0) {
+	timing_thread_t *t = timing_thread();
+	double t1 = timing_now();
+
+	t->seconds[stage] += t1 - t0;
+	t->calls[stage]++;
+
+	if (timing_trace) {
+		if (t->nevents == t->maxevents) {
+			t->maxevents = (t->maxevents == 0 ? 256 : 2*t->maxevents);
+			t->events = realloc(t->events, sizeof(timing_event_t)*t->maxevents);
+		}
+
+		t->events[t->nevents].stage = stage;
+		t->events[t->nevents].start = t0 - timing_start;
+		t->events[t->nevents].end = t1 - timing_start;
+		t->nevents++;
+	}
+}
+
+/**
+ * Add 'n' to the given counter, for the
+ * calling thread.
+ */
+void timing_count(enum timing_counter counter, size_t n) {
+	timing_thread()->counters[counter] += n;
+}
+
+/**
+ * Return the peak resident memory of the
+ * process (in bytes).
+ */
+size_t timing_peak_memory(void) {
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+
+	/* ru_maxrss is given in kilobytes */
+	return (size_t)ru.ru_maxrss * 1024;
+}
+
+/**
+ * Print a summary of the time spent in each
+ * stage, and of all counters. Must not be called
+ * while other threads are still recording.
+ */
+void timing_summary(FILE *f) {
+	timing_thread_t *t;
+	int s, c, nthr;
+	size_t calls, counters[TIMING_NCOUNTERS];
+	double total, mx;
+
+	memset(counters, 0, sizeof(counters));
+	for (t = timing_threads; t != NULL; t = t->next)
+		for (c = 0; c < TIMING_NCOUNTERS; c++)
+			counters[c] += t->counters[c];
+
+	fprintf(f, "-------------------------------\n");
+	fprintf(f, "TIMING\n\n");
+	fprintf(f, "  %-14s %9s %12s %12s %14s %8s\n", "Stage", "Calls", "Total [s]", "Mean [ms]", "Max/thread [s]", "Threads");
+
+	for (s = 0; s < TIMING_NSTAGES; s++) {
+		calls = 0; total = 0; mx = 0; nthr = 0;
+		for (t = timing_threads; t != NULL; t = t->next) {
+			if (t->calls[s] == 0) continue;
+
+			calls += t->calls[s];
+			total += t->seconds[s];
+			if (t->seconds[s] > mx) mx = t->seconds[s];
+			nthr++;
+		}
+
+		if (calls == 0) continue;
+
+		fprintf(f, "  %-14s %9zu %12.3f %12.3f %14.3f %8d\n",
+			timing_stage_names[s], calls, total, total*1e3/calls, mx, nthr);
+	}
+
+	fprintf(f, "\n  Wall time:      %.3fs\n", timing_now() - timing_start);
+	fprintf(f, "  Voxels drawn:   %zu\n", counters[TIMING_VOXELS]);
+	fprintf(f, "  Frames written: %zu\n", counters[TIMING_FRAMES]);
+	fprintf(f, "  Data read:      %.1f MB\n", counters[TIMING_BYTES_READ]/1e6);
+	fprintf(f, "  Data written:   %.1f MB\n", counters[TIMING_BYTES_WRITTEN]/1e6);
+	fprintf(f, "  Peak memory:    %.1f MB\n", timing_peak_memory()/1e6);
+	fprintf(f, "-------------------------------\n\n");
+}
+
+/**
+ * Write all recorded intervals to the file 'filename',
+ * which must have been enabled with timing_enable_trace().
+ * If the name ends with '.json', the trace is written in
+ * the Trace Event format (which can be viewed in e.g.
+ * chrome://tracing or Perfetto), together with the
+ * totals per thread. Otherwise, one interval is written
+ * per line, as CSV.
+ */
+int timing_write_trace(const char *filename) {
+	timing_thread_t *t;
+	size_t i, len = strlen(filename);
+	int s, c, first = 1, json = (len >= 5 && !strcmp(filename+len-5, ".json"));
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror("ERROR");
+		fprintf(stderr, "ERROR: Unable to create trace file: %s.\n", filename);
+		return -1;
+	}
+
+	if (!json) {
+		fprintf(f, "thread,name,stage,start,end\n");
+		for (t = timing_threads; t != NULL; t = t->next)
+			for (i = 0; i < t->nevents; i++)
+				fprintf(f, "%d,%s,%s,%.9f,%.9f\n", t->id, t->name,
+					timing_stage_names[t->events[i].stage],
+					t->events[i].start, t->events[i].end);
+	} else {
+		fprintf(f, "{\"traceEvents\": [\n");
+		for (t = timing_threads; t != NULL; t = t->next) {
+			fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+				first ? "" : ",\n", t->id, t->name, t->id);
+			first = 0;
+
+			for (i = 0; i < t->nevents; i++)
+				fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+					timing_stage_names[t->events[i].stage], t->id,
+					t->events[i].start*1e6, (t->events[i].end-t->events[i].start)*1e6);
+		}
+
+		fprintf(f, "\n],\n\"threads\": [\n");
+		for (t = timing_threads; t != NULL; t = t->next) {
+			fprintf(f, "  {\"id\": %d, \"name\": \"%s\"", t->id, t->name);
+			for (s = 0; s < TIMING_NSTAGES; s++)
+				fprintf(f, ", \"%s\": {\"calls\": %zu, \"seconds\": %.9f}",
+					timing_stage_names[s], t->calls[s], t->seconds[s]);
+			for (c = 0; c < TIMING_NCOUNTERS; c++)
+				fprintf(f, ", \"%s\": %zu", timing_counter_names[c], t->counters[c]);
+			fprintf(f, "}%s\n", t->next != NULL ? "," : "");
+		}
+		fprintf(f, "],\n\"wall_time\": %.9f,\n\"peak_memory\": %zu\n}\n",
+			timing_now() - timing_start, timing_peak_memory());
+	}
+
+	if (fclose(f) != 0) {
+		perror("ERROR");
+		return -1;
+	}
+
+	return 0;
+}